@@ -6,9 +6,24 @@
 */
 
 #include "CppSQLite3.h"
+#include <cctype>
+#include <charconv>
+#include <climits>
 #include <cstdlib>
 #include <utility>
 
+// SSE2 and AVX2 kernels for the binary encoding, see below
+#if !defined(CPPSQLITE_NO_SIMD) && (defined(__x86_64__) || defined(_M_X64))
+#define CPPSQLITE_X86_SIMD 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define CPPSQLITE_TARGET_AVX2
+#else
+#define CPPSQLITE_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
 
 // Named constant for passing to CppSQLite3Exception when passing it a string
 // that cannot be deleted.
@@ -17,6 +32,94 @@ static const bool DONT_DELETE_MSG=false;
 // Error message used when throwing CppSQLite3Exception when allocations fail.
 static const char* const ALLOCATION_ERROR_MESSAGE = "Cannot allocate memory";
 
+// file: URI for a plain path. Bytes other than letters, digits and
+// -._~/: are percent-encoded. An absolute path gets an empty authority,
+// and on Windows backslashes become slashes and a drive letter is written
+// as /C:/...
+static std::string fileUri(std::string_view szPath)
+{
+    std::string sPath(szPath);
+
+#ifdef _WIN32
+    std::replace(sPath.begin(), sPath.end(), '\\', '/');
+
+    if (sPath.size() >= 2 && sPath[1] == ':' && std::isalpha(static_cast<unsigned char>(sPath[0])))
+    {
+        sPath.insert(0, 1, '/');
+    }
+#endif
+
+    std::string sUri(!sPath.empty() && sPath[0] == '/' ? "file://" : "file:");
+
+    for (char c : sPath)
+    {
+        unsigned char ch = static_cast<unsigned char>(c);
+
+        if (std::isalnum(ch) || c == '-' || c == '.' || c == '_' || c == '~' || c == '/' || c == ':')
+        {
+            sUri += c;
+        }
+        else
+        {
+            char szEscape[4];
+            std::snprintf(szEscape, sizeof(szEscape), "%%%02X", ch);
+            sUri += szEscape;
+        }
+    }
+
+    return sUri;
+}
+
+// Parse the leading number of a string the way atoi()/atof() do, but without
+// the locale lookups. Integers are truncated at the first non-digit.
+static long long parseInt64(const char* szValue)
+{
+    while (std::isspace(static_cast<unsigned char>(*szValue)))
+    {
+        szValue++;
+    }
+
+    if (*szValue == '+')
+    {
+        szValue++;
+    }
+
+    long long nValue = 0;
+    std::from_chars(szValue, szValue + std::strlen(szValue), nValue);
+    return nValue;
+}
+
+static double parseDouble(const char* szValue)
+{
+#if defined(__cpp_lib_to_chars)
+    const char* szStart = szValue;
+
+    while (std::isspace(static_cast<unsigned char>(*szValue)))
+    {
+        szValue++;
+    }
+
+    if (*szValue == '+')
+    {
+        szValue++;
+    }
+
+    double dValue = 0.0;
+    std::from_chars_result res = std::from_chars(szValue, szValue + std::strlen(szValue), dValue);
+
+    // Out of range values (inf, 0 or a denormal from strtod) and hex floats,
+    // which from_chars reads as a 0 followed by junk, are left to strtod
+    if (res.ec == std::errc() && *res.ptr != 'x' && *res.ptr != 'X')
+    {
+        return dValue;
+    }
+
+    return std::strtod(szStart, 0);
+#else
+    return std::strtod(szValue, 0);
+#endif
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // Prototypes for SQLite functions not included in SQLite DLL, but copied below
 // from SQLite encode.c
@@ -24,6 +127,12 @@ static const char* const ALLOCATION_ERROR_MESSAGE = "Cannot allocate memory";
 int sqlite3_encode_binary(const unsigned char *in, int n, unsigned char *out);
 int sqlite3_decode_binary(const unsigned char *in, unsigned char *out);
 
+// Their parts, shared with the chunked encoder and decoder
+static void binaryHistogram(const unsigned char* in, int n, int* cnt);
+static int binaryOffset(const int* cnt, int n);
+static int encodeBinaryBody(const unsigned char* in, int n, unsigned char* out, int e);
+static int decodeBinaryBody(const unsigned char* in, int n, unsigned char* out, int e, int* pnRead);
+
 ////////////////////////////////////////////////////////////////////////////////
 
 namespace detail
@@ -112,6 +221,257 @@ void SQLite3Memory::clear()
     mnBufferLen = 0;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+
+NameIndex::NameIndex() :
+    mbBuilt(false)
+{
+}
+
+void NameIndex::reset(int nNames)
+{
+    // Keep the load factor at or below one half
+    std::size_t nSlots = 4;
+    while (nSlots < static_cast<std::size_t>(nNames) * 2)
+    {
+        nSlots *= 2;
+    }
+
+    mvSlots.assign(nSlots, Slot{0, 0, 0, -1});
+    msNames.clear();
+    mbBuilt = true;
+}
+
+void NameIndex::insert(std::string_view szName, int nIndex, bool bReplace)
+{
+    std::uint32_t nHash = hashName(szName);
+    std::size_t nMask = mvSlots.size() - 1;
+
+    for (std::size_t i = nHash & nMask; ; i = (i + 1) & nMask)
+    {
+        Slot& slot = mvSlots[i];
+
+        if (slot.nIndex < 0)
+        {
+            slot.nHash = nHash;
+            slot.nOffset = static_cast<std::uint32_t>(msNames.size());
+            slot.nLen = static_cast<std::uint32_t>(szName.size());
+            slot.nIndex = nIndex;
+            msNames.append(szName.data(), szName.size());
+            return;
+        }
+
+        if (slot.nHash == nHash &&
+            std::string_view(msNames.data() + slot.nOffset, slot.nLen) == szName)
+        {
+            if (bReplace)
+            {
+                slot.nIndex = nIndex;
+            }
+            return;
+        }
+    }
+}
+
+int NameIndex::find(std::string_view szName, std::uint32_t nHash) const
+{
+    if (mvSlots.empty())
+    {
+        return -1;
+    }
+
+    std::size_t nMask = mvSlots.size() - 1;
+
+    for (std::size_t i = nHash & nMask; ; i = (i + 1) & nMask)
+    {
+        const Slot& slot = mvSlots[i];
+
+        if (slot.nIndex < 0)
+        {
+            return -1;
+        }
+
+        if (slot.nHash == nHash &&
+            std::string_view(msNames.data() + slot.nOffset, slot.nLen) == szName)
+        {
+            return slot.nIndex;
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+StatementCache::StatementCache() :
+    mnMaxEntries(CPPSQLITE_STATEMENT_CACHE_ENTRIES),
+    mnMaxBytes(CPPSQLITE_STATEMENT_CACHE_BYTES),
+    mnBytes(0),
+    mnHits(0),
+    mnMisses(0),
+    mnEvictions(0)
+{
+}
+
+StatementCache::~StatementCache()
+{
+    clear();
+}
+
+StatementCache::Entry* StatementCache::acquire(std::string_view szSQL)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    if (!enabled())
+    {
+        return nullptr;
+    }
+
+    auto it = mIndex.find(szSQL);
+
+    if (it == mIndex.end() || it->second->bInUse)
+    {
+        mnMisses++;
+        return nullptr;
+    }
+
+    mnHits++;
+    mEntries.splice(mEntries.begin(), mEntries, it->second);
+    Entry& entry = mEntries.front();
+    entry.bInUse = true;
+    entry.pCache = shared_from_this();
+    return &entry;
+}
+
+StatementCache::Entry* StatementCache::insert(std::string_view szSQL, sqlite3_stmt* pVM)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    if (!enabled() || !pVM || mIndex.find(szSQL) != mIndex.end())
+    {
+        return nullptr;
+    }
+
+    mEntries.push_front(Entry{shared_from_this(), std::string(szSQL), pVM, 0, true, false, StatementMeta{NameIndex(), NameIndex(), NameIndex(), 0}});
+    Entry& entry = mEntries.front();
+    entry.nBytes = sqlite3_stmt_status(pVM, SQLITE_STMTSTATUS_MEMUSED, 0);
+    mIndex.emplace(std::string_view(entry.sSQL), mEntries.begin());
+    mnBytes += entry.nBytes;
+
+    evict();
+    return &entry;
+}
+
+int StatementCache::release(Entry* pEntry)
+{
+    // The last handle out of a cache whose DB is gone destroys it, after
+    // the lock is dropped
+    std::shared_ptr<StatementCache> pKeep = std::move(pEntry->pCache);
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    sqlite3_stmt* pVM = pEntry->pVM;
+    int nRet = sqlite3_reset(pVM);
+
+    if (pEntry->bOrphaned)
+    {
+        for (auto it = mEntries.begin(); it != mEntries.end(); ++it)
+        {
+            if (&*it == pEntry)
+            {
+                mEntries.erase(it);
+                break;
+            }
+        }
+        sqlite3_finalize(pVM);
+        return nRet;
+    }
+
+    sqlite3_clear_bindings(pVM);
+    pEntry->bInUse = false;
+
+    int nBytes = sqlite3_stmt_status(pVM, SQLITE_STMTSTATUS_MEMUSED, 0);
+    mnBytes += nBytes - pEntry->nBytes;
+    pEntry->nBytes = nBytes;
+
+    evict();
+    return nRet;
+}
+
+void StatementCache::clear()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    auto it = mEntries.begin();
+    while (it != mEntries.end())
+    {
+        auto next = std::next(it);
+        if (it->bInUse)
+        {
+            // Finalized by release() once its owner is done with it
+            if (!it->bOrphaned)
+            {
+                mIndex.erase(std::string_view(it->sSQL));
+                mnBytes -= it->nBytes;
+                it->bOrphaned = true;
+            }
+        }
+        else
+        {
+            erase(it);
+        }
+        it = next;
+    }
+}
+
+void StatementCache::setLimits(int nMaxEntries, long long nMaxBytes)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    mnMaxEntries = nMaxEntries > 0 ? nMaxEntries : 0;
+    mnMaxBytes = nMaxBytes > 0 ? nMaxBytes : LLONG_MAX;
+    evict();
+}
+
+CppSQLite3StatementCacheStats StatementCache::stats() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    CppSQLite3StatementCacheStats stats;
+    stats.nHits = mnHits;
+    stats.nMisses = mnMisses;
+    stats.nEvictions = mnEvictions;
+    stats.nEntries = static_cast<int>(mIndex.size());
+    stats.nBytes = mnBytes;
+    return stats;
+}
+
+void StatementCache::evict()
+{
+    // Walk from the least recently used end, skipping checked out handles
+    auto it = mEntries.end();
+    while (it != mEntries.begin() &&
+           (static_cast<long long>(mIndex.size()) > mnMaxEntries || mnBytes > mnMaxBytes))
+    {
+        auto victim = std::prev(it);
+        if (victim->bInUse)
+        {
+            it = victim;
+            continue;
+        }
+        erase(victim);
+        mnEvictions++;
+    }
+}
+
+void StatementCache::erase(std::list<Entry>::iterator it)
+{
+    if (!it->bOrphaned)
+    {
+        mIndex.erase(std::string_view(it->sSQL));
+        mnBytes -= it->nBytes;
+    }
+    sqlite3_finalize(it->pVM);
+    mEntries.erase(it);
+}
+
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -222,6 +582,23 @@ const char* CppSQLite3Buffer::format(const char* szFormat, ...)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+// Buffer size for nLen bytes once encoded, worked out wide as a few MB
+// of binary would overflow int
+static int encodedBufferSize(int nLen)
+{
+    long long nBytes = 3 + (257 * static_cast<long long>(nLen)) / 254;
+
+    if (nLen < 0 || nBytes > INT_MAX)
+    {
+        throw CppSQLite3Exception(CPPSQLITE_ERROR,
+                                ALLOCATION_ERROR_MESSAGE,
+                                DONT_DELETE_MSG);
+    }
+
+    return static_cast<int>(nBytes);
+}
+
+
 CppSQLite3Binary::CppSQLite3Binary() :
                         mpBuf(0),
                         mnBinaryLen(0),
@@ -232,6 +609,36 @@ CppSQLite3Binary::CppSQLite3Binary() :
 }
 
 
+CppSQLite3Binary::CppSQLite3Binary(CppSQLite3Binary&& binary) noexcept :
+                        mpBuf(binary.mpBuf),
+                        mnBinaryLen(binary.mnBinaryLen),
+                        mnBufferLen(binary.mnBufferLen),
+                        mnEncodedLen(binary.mnEncodedLen),
+                        mbEncoded(binary.mbEncoded)
+{
+    binary.mpBuf = 0;
+    binary.mnBinaryLen = 0;
+    binary.mnBufferLen = 0;
+    binary.mnEncodedLen = 0;
+    binary.mbEncoded = false;
+}
+
+
+CppSQLite3Binary& CppSQLite3Binary::operator=(CppSQLite3Binary&& binary) noexcept
+{
+    if (this != &binary)
+    {
+        clear();
+        std::swap(mpBuf, binary.mpBuf);
+        std::swap(mnBinaryLen, binary.mnBinaryLen);
+        std::swap(mnBufferLen, binary.mnBufferLen);
+        std::swap(mnEncodedLen, binary.mnEncodedLen);
+        std::swap(mbEncoded, binary.mbEncoded);
+    }
+    return *this;
+}
+
+
 CppSQLite3Binary::~CppSQLite3Binary()
 {
     clear();
@@ -247,21 +654,24 @@ void CppSQLite3Binary::setBinary(const unsigned char* pBuf, int nLen)
 
 void CppSQLite3Binary::setEncoded(const unsigned char* pBuf)
 {
-    clear();
-
-    mnEncodedLen = strlen((const char*)pBuf);
-    mnBufferLen = mnEncodedLen + 1; // Allow for NULL terminator
+    setEncoded(pBuf, (int)strlen((const char*)pBuf));
+}
 
-    mpBuf = (unsigned char*)malloc(mnBufferLen);
 
-    if (!mpBuf)
+void CppSQLite3Binary::setEncoded(const unsigned char* pBuf, int nLen)
+{
+    if (nLen < 0 || nLen == INT_MAX)
     {
         throw CppSQLite3Exception(CPPSQLITE_ERROR,
                                 ALLOCATION_ERROR_MESSAGE,
                                 DONT_DELETE_MSG);
     }
 
-    memcpy(mpBuf, pBuf, mnBufferLen);
+    growBuffer(nLen + 1); // Allow for NULL terminator
+
+    memcpy(mpBuf, pBuf, nLen);
+    mpBuf[nLen] = 0;
+    mnEncodedLen = nLen;
     mbEncoded = true;
 }
 
@@ -270,10 +680,13 @@ const unsigned char* CppSQLite3Binary::getEncoded()
 {
     if (!mbEncoded)
     {
-        unsigned char* ptmp = (unsigned char*)malloc(mnBinaryLen);
-        memcpy(ptmp, mpBuf, mnBinaryLen);
-        mnEncodedLen = sqlite3_encode_binary(ptmp, mnBinaryLen, mpBuf);
-        free(ptmp);
+        // Move the binary to the end of the buffer and encode it forwards
+        // into the start. The encoder writes behind what it has read, as
+        // the buffer has room for every escape.
+        growBuffer(encodedBufferSize(mnBinaryLen));
+        unsigned char* pIn = mpBuf + mnBufferLen - mnBinaryLen;
+        memmove(pIn, mpBuf, mnBinaryLen);
+        mnEncodedLen = sqlite3_encode_binary(pIn, mnBinaryLen, mpBuf);
         mbEncoded = true;
     }
 
@@ -286,7 +699,8 @@ const unsigned char* CppSQLite3Binary::getBinary()
     if (mbEncoded)
     {
         // in/out buffers can be the same
-        mnBinaryLen = sqlite3_decode_binary(mpBuf, mpBuf);
+        int nRead;
+        mnBinaryLen = mnEncodedLen > 0 ? decodeBinaryBody(mpBuf + 1, mnEncodedLen - 1, mpBuf, mpBuf[0], &nRead) : 0;
 
         if (mnBinaryLen == -1)
         {
@@ -309,28 +723,51 @@ int CppSQLite3Binary::getBinaryLength()
 }
 
 
-unsigned char* CppSQLite3Binary::allocBuffer(int nLen)
+int CppSQLite3Binary::getEncodedLength()
 {
-    clear();
+    getEncoded();
+    return mnEncodedLen;
+}
+
+
+void CppSQLite3Binary::reserve(int nLen)
+{
+    growBuffer(encodedBufferSize(nLen));
+}
 
+
+unsigned char* CppSQLite3Binary::allocBuffer(int nLen)
+{
     // Allow extra space for encoded binary as per comments in
     // SQLite encode.c See bottom of this file for implementation
     // of SQLite functions use 3 instead of 2 just to be sure ;-)
+    growBuffer(encodedBufferSize(nLen));
+
     mnBinaryLen = nLen;
-    mnBufferLen = 3 + (257*nLen)/254;
+    mbEncoded = false;
 
-    mpBuf = (unsigned char*)malloc(mnBufferLen);
+    return mpBuf;
+}
 
-    if (!mpBuf)
+
+void CppSQLite3Binary::growBuffer(int nBytes)
+{
+    if (nBytes <= mnBufferLen)
+    {
+        return;
+    }
+
+    unsigned char* pBuf = (unsigned char*)realloc(mpBuf, nBytes);
+
+    if (!pBuf)
     {
         throw CppSQLite3Exception(CPPSQLITE_ERROR,
                                 ALLOCATION_ERROR_MESSAGE,
                                 DONT_DELETE_MSG);
     }
 
-    mbEncoded = false;
-
-    return mpBuf;
+    mpBuf = pBuf;
+    mnBufferLen = nBytes;
 }
 
 
@@ -340,6 +777,8 @@ void CppSQLite3Binary::clear()
     {
         mnBinaryLen = 0;
         mnBufferLen = 0;
+        mnEncodedLen = 0;
+        mbEncoded = false;
         free(mpBuf);
         mpBuf = 0;
     }
@@ -348,70 +787,261 @@ void CppSQLite3Binary::clear()
 
 ////////////////////////////////////////////////////////////////////////////////
 
-CppSQLite3Query::CppSQLite3Query()
+CppSQLite3BinaryEncoder::CppSQLite3BinaryEncoder()
 {
-    mpVM = 0;
-    mbEof = true;
-    mnCols = 0;
-    mbOwnVM = false;
+    reset();
 }
 
 
-CppSQLite3Query::CppSQLite3Query(const CppSQLite3Query& rQuery)
+void CppSQLite3BinaryEncoder::scan(const unsigned char* pBuf, int nLen)
 {
-    mpVM = rQuery.mpVM;
-    // Only one object can own the VM
-    const_cast<CppSQLite3Query&>(rQuery).mpVM = 0;
-    mbEof = rQuery.mbEof;
-    mnCols = rQuery.mnCols;
-    mbOwnVM = rQuery.mbOwnVM;
-}
-
+    if (mnOffset >= 0)
+    {
+        throw CppSQLite3Exception(CPPSQLITE_ERROR,
+                                "Input scanned after encoding began",
+                                DONT_DELETE_MSG);
+    }
 
-CppSQLite3Query::CppSQLite3Query(sqlite3* pDB,
-                            sqlite3_stmt* pVM,
-                            bool bEof,
-                            bool bOwnVM/*=true*/)
-{
-    mpDB = pDB;
-    mpVM = pVM;
-    mbEof = bEof;
-    mnCols = sqlite3_column_count(mpVM);
-    mbOwnVM = bOwnVM;
+    binaryHistogram(pBuf, nLen, mnCounts);
+    mnScanned += nLen;
 }
 
 
-CppSQLite3Query::~CppSQLite3Query()
+int CppSQLite3BinaryEncoder::encode(const unsigned char* pBuf, int nLen, unsigned char* pOut)
 {
-    try
+    if (nLen <= 0)
     {
-        finalize();
+        return 0;
     }
-    catch (...)
+
+    int nOut = 0;
+
+    if (mnOffset < 0)
     {
+        if (mnScanned == 0)
+        {
+            throw CppSQLite3Exception(CPPSQLITE_ERROR,
+                                    "Input was not scanned",
+                                    DONT_DELETE_MSG);
+        }
+
+        mnOffset = binaryOffset(mnCounts, mnScanned);
+        pOut[nOut++] = static_cast<unsigned char>(mnOffset);
     }
+
+    return nOut + encodeBinaryBody(pBuf, nLen, pOut + nOut, mnOffset);
 }
 
 
-CppSQLite3Query& CppSQLite3Query::operator=(const CppSQLite3Query& rQuery)
+int CppSQLite3BinaryEncoder::finish(unsigned char* pOut)
 {
-    try
-    {
-        finalize();
-    }
-    catch (...)
+    int nOut = 0;
+
+    // sqlite3_encode_binary() writes "x" for no input
+    if (mnOffset < 0)
     {
+        pOut[nOut++] = 'x';
+    }
+
+    pOut[nOut] = 0;
+    reset();
+    return nOut;
+}
+
+
+void CppSQLite3BinaryEncoder::reset()
+{
+    memset(mnCounts, 0, sizeof(mnCounts));
+    mnScanned = 0;
+    mnOffset = -1;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+
+CppSQLite3BinaryDecoder::CppSQLite3BinaryDecoder()
+{
+    reset();
+}
+
+
+int CppSQLite3BinaryDecoder::decode(const unsigned char* pBuf, int nLen, unsigned char* pOut)
+{
+    int nIn = 0;
+    int nOut = 0;
+
+    if (mnOffset < 0 && nIn < nLen)
+    {
+        mnOffset = pBuf[nIn++];
+    }
+
+    // Second byte of an escape that ended the last chunk
+    if (mbEscape && nIn < nLen)
+    {
+        unsigned char c = pBuf[nIn++];
+        if (c < 1 || c > 3)
+        {
+            throw CppSQLite3Exception(CPPSQLITE_ERROR,
+                                    "Cannot decode binary",
+                                    DONT_DELETE_MSG);
+        }
+
+        static const unsigned char escaped[] = { 0, 0, 1, '\'' };
+        pOut[nOut++] = static_cast<unsigned char>(escaped[c] + mnOffset);
+        mbEscape = false;
+    }
+
+    if (nIn >= nLen)
+    {
+        return nOut;
+    }
+
+    // The kernel may read one byte past what it is given, so the last
+    // byte is kept back and handled here
+    int nRead = 0;
+    int nBody = decodeBinaryBody(pBuf + nIn, nLen - 1 - nIn, pOut + nOut, mnOffset, &nRead);
+
+    if (nBody < 0)
+    {
+        throw CppSQLite3Exception(CPPSQLITE_ERROR,
+                                "Cannot decode binary",
+                                DONT_DELETE_MSG);
+    }
+
+    nIn += nRead;
+    nOut += nBody;
+
+    if (nIn < nLen)
+    {
+        if (pBuf[nIn] == 1)
+        {
+            mbEscape = true;
+        }
+        else
+        {
+            pOut[nOut++] = static_cast<unsigned char>(pBuf[nIn] + mnOffset);
+        }
+    }
+
+    return nOut;
+}
+
+
+void CppSQLite3BinaryDecoder::finish()
+{
+    bool bEscape = mbEscape;
+    reset();
+
+    if (bEscape)
+    {
+        throw CppSQLite3Exception(CPPSQLITE_ERROR,
+                                "Cannot decode binary",
+                                DONT_DELETE_MSG);
+    }
+}
+
+
+void CppSQLite3BinaryDecoder::reset()
+{
+    mnOffset = -1;
+    mbEscape = false;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+
+CppSQLite3Query::CppSQLite3Query()
+{
+    mpDB = 0;
+    mpVM = 0;
+    mbEof = true;
+    mnCols = 0;
+    mbOwnVM = false;
+    mpEntry = 0;
+    mpMeta = 0;
+}
+
+
+CppSQLite3Query::CppSQLite3Query(CppSQLite3Query&& rQuery) noexcept
+{
+    mpDB = rQuery.mpDB;
+    mpVM = rQuery.mpVM;
+    mbEof = rQuery.mbEof;
+    mnCols = rQuery.mnCols;
+    mbOwnVM = rQuery.mbOwnVM;
+    mpEntry = rQuery.mpEntry;
+    mpMeta = rQuery.mpMeta;
+    mpOwnMeta = std::move(rQuery.mpOwnMeta);
+    rQuery.release();
+}
+
+
+CppSQLite3Query::CppSQLite3Query(sqlite3* pDB,
+                            sqlite3_stmt* pVM,
+                            bool bEof,
+                            bool bOwnVM/*=true*/,
+                            detail::StatementCache::Entry* pEntry/*=0*/,
+                            detail::StatementMeta* pMeta/*=0*/)
+{
+    mpDB = pDB;
+    mpVM = pVM;
+    mbEof = bEof;
+    mnCols = sqlite3_column_count(mpVM);
+    mbOwnVM = bOwnVM;
+    mpEntry = pEntry;
+    mpMeta = pEntry ? &pEntry->meta : pMeta;
+}
+
+
+CppSQLite3Query::~CppSQLite3Query()
+{
+    try
+    {
+        finalize();
+    }
+    catch (...)
+    {
+    }
+}
+
+
+CppSQLite3Query& CppSQLite3Query::operator=(CppSQLite3Query&& rQuery) noexcept
+{
+    if (this != &rQuery)
+    {
+        try
+        {
+            finalize();
+        }
+        catch (...)
+        {
+        }
+        mpDB = rQuery.mpDB;
+        mpVM = rQuery.mpVM;
+        mbEof = rQuery.mbEof;
+        mnCols = rQuery.mnCols;
+        mbOwnVM = rQuery.mbOwnVM;
+        mpEntry = rQuery.mpEntry;
+        mpMeta = rQuery.mpMeta;
+        mpOwnMeta = std::move(rQuery.mpOwnMeta);
+        rQuery.release();
     }
-    mpVM = rQuery.mpVM;
-    // Only one object can own the VM
-    const_cast<CppSQLite3Query&>(rQuery).mpVM = 0;
-    mbEof = rQuery.mbEof;
-    mnCols = rQuery.mnCols;
-    mbOwnVM = rQuery.mbOwnVM;
     return *this;
 }
 
 
+void CppSQLite3Query::release() noexcept
+{
+    // Leaves the query empty without touching the VM it held
+    mpVM = 0;
+    mbEof = true;
+    mnCols = 0;
+    mbOwnVM = false;
+    mpEntry = 0;
+    mpMeta = 0;
+}
+
+
 int CppSQLite3Query::numFields() const
 {
     checkVM();
@@ -564,6 +1194,47 @@ const unsigned char* CppSQLite3Query::getBlobField(const char* szField, int& nLe
 }
 
 
+std::string_view CppSQLite3Query::getStringView(int nField, std::string_view szNullValue/*=std::string_view()*/) const
+{
+    if (fieldDataType(nField) == SQLITE_NULL)
+    {
+        return szNullValue;
+    }
+
+    // Text must be fetched before its length
+    const char* szValue = (const char*)sqlite3_column_text(mpVM, nField);
+    return std::string_view(szValue, static_cast<std::size_t>(sqlite3_column_bytes(mpVM, nField)));
+}
+
+
+std::string_view CppSQLite3Query::getStringView(const char* szField, std::string_view szNullValue/*=std::string_view()*/) const
+{
+    int nField = fieldIndex(szField);
+    return getStringView(nField, szNullValue);
+}
+
+
+#if defined(__cpp_lib_span)
+std::span<const std::byte> CppSQLite3Query::getBlobSpan(int nField) const
+{
+    if (fieldDataType(nField) == SQLITE_NULL)
+    {
+        return std::span<const std::byte>();
+    }
+
+    const std::byte* pBlob = (const std::byte*)sqlite3_column_blob(mpVM, nField);
+    return std::span<const std::byte>(pBlob, static_cast<std::size_t>(sqlite3_column_bytes(mpVM, nField)));
+}
+
+
+std::span<const std::byte> CppSQLite3Query::getBlobSpan(const char* szField) const
+{
+    int nField = fieldIndex(szField);
+    return getBlobSpan(nField);
+}
+#endif
+
+
 bool CppSQLite3Query::fieldIsNull(int nField) const
 {
     return (fieldDataType(nField) == SQLITE_NULL);
@@ -583,14 +1254,11 @@ int CppSQLite3Query::fieldIndex(const char* szField) const
 
     if (szField)
     {
-        for (int nField = 0; nField < mnCols; nField++)
-        {
-            const char* szTemp = sqlite3_column_name(mpVM, nField);
+        int nField = columnIndex().find(szField);
 
-            if (strcmp(szField, szTemp) == 0)
-            {
-                return nField;
-            }
+        if (nField >= 0)
+        {
+            return nField;
         }
     }
 
@@ -669,8 +1337,17 @@ void CppSQLite3Query::nextRow()
     }
     else
     {
-        nRet = sqlite3_finalize(mpVM);
+        if (mbOwnVM)
+        {
+            nRet = mpEntry ? mpEntry->pCache->release(mpEntry) : sqlite3_finalize(mpVM);
+        }
+        else
+        {
+            nRet = sqlite3_reset(mpVM);
+        }
         mpVM = 0;
+        mpEntry = 0;
+        mpMeta = 0;
         const char* szError = sqlite3_errmsg(mpDB);
         throw CppSQLite3Exception(nRet,
                                 (char*)szError,
@@ -683,8 +1360,10 @@ void CppSQLite3Query::finalize()
 {
     if (mpVM && mbOwnVM)
     {
-        int nRet = sqlite3_finalize(mpVM);
+        int nRet = mpEntry ? mpEntry->pCache->release(mpEntry) : sqlite3_finalize(mpVM);
         mpVM = 0;
+        mpEntry = 0;
+        mpMeta = 0;
         if (nRet != SQLITE_OK)
         {
             const char* szError = sqlite3_errmsg(mpDB);
@@ -694,6 +1373,34 @@ void CppSQLite3Query::finalize()
 }
 
 
+const detail::NameIndex& CppSQLite3Query::columnIndex() const
+{
+    if (!mpMeta)
+    {
+        mpOwnMeta.reset(new detail::StatementMeta());
+        mpMeta = mpOwnMeta.get();
+    }
+
+    detail::NameIndex& index = mpMeta->columns;
+    int nPrepared = sqlite3_stmt_status(mpVM, SQLITE_STMTSTATUS_REPREPARE, 0);
+
+    if (!index.built() || mpMeta->nColumnsPrepared != nPrepared)
+    {
+        int nCols = sqlite3_column_count(mpVM);
+        index.reset(nCols);
+
+        for (int nField = 0; nField < nCols; nField++)
+        {
+            index.add(sqlite3_column_name(mpVM, nField), nField);
+        }
+
+        mpMeta->nColumnsPrepared = nPrepared;
+    }
+
+    return index;
+}
+
+
 void CppSQLite3Query::checkVM() const
 {
     if (mpVM == 0)
@@ -705,6 +1412,38 @@ void CppSQLite3Query::checkVM() const
 }
 
 
+CppSQLite3Query::Unchecked CppSQLite3Query::unchecked() const
+{
+    checkVM();
+    return Unchecked(*this);
+}
+
+
+void CppSQLite3Query::Unchecked::check(int nField) const
+{
+    if (mpQuery->mpVM != mpVM)
+    {
+        throw CppSQLite3Exception(CPPSQLITE_ERROR,
+                                "Null Virtual Machine pointer",
+                                DONT_DELETE_MSG);
+    }
+
+    if (mpQuery->mbEof)
+    {
+        throw CppSQLite3Exception(CPPSQLITE_ERROR,
+                                "No current row",
+                                DONT_DELETE_MSG);
+    }
+
+    if (nField < 0 || nField > mnCols-1)
+    {
+        throw CppSQLite3Exception(CPPSQLITE_ERROR,
+                                "Invalid field index requested",
+                                DONT_DELETE_MSG);
+    }
+}
+
+
 ////////////////////////////////////////////////////////////////////////////////
 
 CppSQLite3Table::CppSQLite3Table()
@@ -713,17 +1452,23 @@ CppSQLite3Table::CppSQLite3Table()
     mnRows = 0;
     mnCols = 0;
     mnCurrentRow = 0;
+    mbCacheNumbers = false;
 }
 
 
-CppSQLite3Table::CppSQLite3Table(const CppSQLite3Table& rTable)
+CppSQLite3Table::CppSQLite3Table(CppSQLite3Table&& rTable) noexcept
 {
     mpaszResults = rTable.mpaszResults;
-    // Only one object can own the results
-    const_cast<CppSQLite3Table&>(rTable).mpaszResults = 0;
+    rTable.mpaszResults = 0;
     mnRows = rTable.mnRows;
     mnCols = rTable.mnCols;
     mnCurrentRow = rTable.mnCurrentRow;
+    mColumns = std::move(rTable.mColumns);
+    mbCacheNumbers = rTable.mbCacheNumbers;
+    mvNumbers = std::move(rTable.mvNumbers);
+    rTable.mnRows = 0;
+    rTable.mnCols = 0;
+    rTable.mnCurrentRow = 0;
 }
 
 
@@ -733,6 +1478,8 @@ CppSQLite3Table::CppSQLite3Table(char** paszResults, int nRows, int nCols)
     mnRows = nRows;
     mnCols = nCols;
     mnCurrentRow = 0;
+    mbCacheNumbers = false;
+    buildColumnIndex();
 }
 
 
@@ -748,21 +1495,23 @@ CppSQLite3Table::~CppSQLite3Table()
 }
 
 
-CppSQLite3Table& CppSQLite3Table::operator=(const CppSQLite3Table& rTable)
+CppSQLite3Table& CppSQLite3Table::operator=(CppSQLite3Table&& rTable) noexcept
 {
-    try
+    if (this != &rTable)
     {
         finalize();
+        mpaszResults = rTable.mpaszResults;
+        rTable.mpaszResults = 0;
+        mnRows = rTable.mnRows;
+        mnCols = rTable.mnCols;
+        mnCurrentRow = rTable.mnCurrentRow;
+        mColumns = std::move(rTable.mColumns);
+        mbCacheNumbers = rTable.mbCacheNumbers;
+        mvNumbers = std::move(rTable.mvNumbers);
+        rTable.mnRows = 0;
+        rTable.mnCols = 0;
+        rTable.mnCurrentRow = 0;
     }
-    catch (...)
-    {
-    }
-    mpaszResults = rTable.mpaszResults;
-    // Only one object can own the results
-    const_cast<CppSQLite3Table&>(rTable).mpaszResults = 0;
-    mnRows = rTable.mnRows;
-    mnCols = rTable.mnCols;
-    mnCurrentRow = rTable.mnCurrentRow;
     return *this;
 }
 
@@ -774,6 +1523,7 @@ void CppSQLite3Table::finalize()
         sqlite3_free_table(mpaszResults);
         mpaszResults = 0;
     }
+    mvNumbers.clear();
 }
 
 
@@ -791,6 +1541,26 @@ int CppSQLite3Table::numRows() const
 }
 
 
+int CppSQLite3Table::fieldIndex(const char* szField) const
+{
+    checkResults();
+
+    if (szField)
+    {
+        int nField = mColumns.find(szField);
+
+        if (nField >= 0)
+        {
+            return nField;
+        }
+    }
+
+    throw CppSQLite3Exception(CPPSQLITE_ERROR,
+                            "Invalid field name requested",
+                            DONT_DELETE_MSG);
+}
+
+
 const char* CppSQLite3Table::fieldValue(int nField) const
 {
     checkResults();
@@ -809,23 +1579,9 @@ const char* CppSQLite3Table::fieldValue(int nField) const
 
 const char* CppSQLite3Table::fieldValue(const char* szField) const
 {
-    checkResults();
-
-    if (szField)
-    {
-        for (int nField = 0; nField < mnCols; nField++)
-        {
-            if (strcmp(szField, mpaszResults[nField]) == 0)
-            {
-                int nIndex = (mnCurrentRow*mnCols) + mnCols + nField;
-                return mpaszResults[nIndex];
-            }
-        }
-    }
-
-    throw CppSQLite3Exception(CPPSQLITE_ERROR,
-                            "Invalid field name requested",
-                            DONT_DELETE_MSG);
+    int nField = fieldIndex(szField);
+    int nIndex = (mnCurrentRow*mnCols) + mnCols + nField;
+    return mpaszResults[nIndex];
 }
 
 
@@ -837,21 +1593,15 @@ int CppSQLite3Table::getIntField(int nField, int nNullValue/*=0*/) const
     }
     else
     {
-        return atoi(fieldValue(nField));
+        return static_cast<int>(parseIntField(nField));
     }
 }
 
 
 int CppSQLite3Table::getIntField(const char* szField, int nNullValue/*=0*/) const
 {
-    if (fieldIsNull(szField))
-    {
-        return nNullValue;
-    }
-    else
-    {
-        return atoi(fieldValue(szField));
-    }
+    int nField = fieldIndex(szField);
+    return getIntField(nField, nNullValue);
 }
 
 
@@ -863,21 +1613,15 @@ float CppSQLite3Table::getFloatField(int nField, float fNullValue/*=0.0f*/) cons
     }
     else
     {
-        return static_cast<float>(atof(fieldValue(nField)));
+        return static_cast<float>(parseDoubleField(nField));
     }
 }
 
 
 float CppSQLite3Table::getFloatField(const char* szField, float fNullValue/*=0.0f*/) const
 {
-    if (fieldIsNull(szField))
-    {
-        return fNullValue;
-    }
-    else
-    {
-        return static_cast<float>(atof(fieldValue(szField)));
-    }
+    int nField = fieldIndex(szField);
+    return getFloatField(nField, fNullValue);
 }
 
 
@@ -889,21 +1633,15 @@ double CppSQLite3Table::getDoubleField(int nField, double dNullValue/*=0.0*/) co
     }
     else
     {
-        return atof(fieldValue(nField));
+        return parseDoubleField(nField);
     }
 }
 
 
 double CppSQLite3Table::getDoubleField(const char* szField, double dNullValue/*=0.0*/) const
 {
-    if (fieldIsNull(szField))
-    {
-        return dNullValue;
-    }
-    else
-    {
-        return atof(fieldValue(szField));
-    }
+    int nField = fieldIndex(szField);
+    return getDoubleField(nField, dNullValue);
 }
 
 
@@ -922,14 +1660,22 @@ const char* CppSQLite3Table::getStringField(int nField, const char* szNullValue/
 
 const char* CppSQLite3Table::getStringField(const char* szField, const char* szNullValue/*=""*/) const
 {
-    if (fieldIsNull(szField))
-    {
-        return szNullValue;
-    }
-    else
-    {
-        return fieldValue(szField);
-    }
+    int nField = fieldIndex(szField);
+    return getStringField(nField, szNullValue);
+}
+
+
+std::string_view CppSQLite3Table::getStringView(int nField, std::string_view szNullValue/*=std::string_view()*/) const
+{
+    const char* szValue = fieldValue(nField);
+    return szValue ? std::string_view(szValue) : szNullValue;
+}
+
+
+std::string_view CppSQLite3Table::getStringView(const char* szField, std::string_view szNullValue/*=std::string_view()*/) const
+{
+    int nField = fieldIndex(szField);
+    return getStringView(nField, szNullValue);
 }
 
 
@@ -962,6 +1708,17 @@ const char* CppSQLite3Table::fieldName(int nCol) const
 }
 
 
+void CppSQLite3Table::setCacheNumbers(bool bCacheNumbers)
+{
+    mbCacheNumbers = bCacheNumbers;
+
+    if (!mbCacheNumbers)
+    {
+        std::vector<NumericCell>().swap(mvNumbers);
+    }
+}
+
+
 void CppSQLite3Table::setRow(int nRow)
 {
     checkResults();
@@ -977,6 +1734,84 @@ void CppSQLite3Table::setRow(int nRow)
 }
 
 
+void CppSQLite3Table::buildColumnIndex()
+{
+    if (!mpaszResults)
+    {
+        return;
+    }
+
+    mColumns.reset(mnCols);
+
+    for (int nField = 0; nField < mnCols; nField++)
+    {
+        mColumns.add(mpaszResults[nField], nField);
+    }
+}
+
+
+long long CppSQLite3Table::parseIntField(int nField) const
+{
+    NumericCell* pCell = 0;
+
+    if (mbCacheNumbers)
+    {
+        if (mvNumbers.empty())
+        {
+            mvNumbers.assign(static_cast<std::size_t>(mnRows) * mnCols, NumericCell{0, 0.0, 0});
+        }
+
+        pCell = &mvNumbers[static_cast<std::size_t>(mnCurrentRow) * mnCols + nField];
+
+        if (pCell->nParsed & 1)
+        {
+            return pCell->nValue;
+        }
+    }
+
+    long long nValue = parseInt64(fieldValue(nField));
+
+    if (pCell)
+    {
+        pCell->nValue = nValue;
+        pCell->nParsed |= 1;
+    }
+
+    return nValue;
+}
+
+
+double CppSQLite3Table::parseDoubleField(int nField) const
+{
+    NumericCell* pCell = 0;
+
+    if (mbCacheNumbers)
+    {
+        if (mvNumbers.empty())
+        {
+            mvNumbers.assign(static_cast<std::size_t>(mnRows) * mnCols, NumericCell{0, 0.0, 0});
+        }
+
+        pCell = &mvNumbers[static_cast<std::size_t>(mnCurrentRow) * mnCols + nField];
+
+        if (pCell->nParsed & 2)
+        {
+            return pCell->dValue;
+        }
+    }
+
+    double dValue = parseDouble(fieldValue(nField));
+
+    if (pCell)
+    {
+        pCell->dValue = dValue;
+        pCell->nParsed |= 2;
+    }
+
+    return dValue;
+}
+
+
 void CppSQLite3Table::checkResults() const
 {
     if (mpaszResults == 0)
@@ -990,444 +1825,4965 @@ void CppSQLite3Table::checkResults() const
 
 ////////////////////////////////////////////////////////////////////////////////
 
-CppSQLite3Statement::CppSQLite3Statement()
+CppSQLite3ResultSet::CppSQLite3ResultSet()
 {
-    mpDB = 0;
-    mpVM = 0;
+    mnRows = 0;
+    mnCurrentRow = 0;
+    mnReserved = 0;
 }
 
 
-CppSQLite3Statement::CppSQLite3Statement(const CppSQLite3Statement& rStatement)
+int CppSQLite3ResultSet::fetch(CppSQLite3Query& rQuery, int nMaxRows/*=-1*/)
 {
-    mpDB = rStatement.mpDB;
-    mpVM = rStatement.mpVM;
-    // Only one object can own VM
-    const_cast<CppSQLite3Statement&>(rStatement).mpVM = 0;
-}
+    rQuery.checkVM();
 
+    if (mvColumns.empty())
+    {
+        int nCols = sqlite3_column_count(rQuery.mpVM);
+        mvColumns.resize(nCols);
+        mColumns.reset(nCols);
 
-CppSQLite3Statement::CppSQLite3Statement(sqlite3* pDB, sqlite3_stmt* pVM)
-{
-    mpDB = pDB;
-    mpVM = pVM;
+        for (int nCol = 0; nCol < nCols; nCol++)
+        {
+            mvColumns[nCol].sName = sqlite3_column_name(rQuery.mpVM, nCol);
+            mvColumns[nCol].nType = SQLITE_NULL;
+            mColumns.add(mvColumns[nCol].sName, nCol);
+            reserveColumn(mvColumns[nCol]);
+        }
+    }
+    else
+    {
+        int nCols = sqlite3_column_count(rQuery.mpVM);
+        bool bSame = nCols == numFields();
+
+        for (int nCol = 0; bSame && nCol < nCols; nCol++)
+        {
+            const char* szName = sqlite3_column_name(rQuery.mpVM, nCol);
+            bSame = szName && mvColumns[nCol].sName == szName;
+        }
+
+        if (!bSame)
+        {
+            throw CppSQLite3Exception(CPPSQLITE_ERROR,
+                                    "Query columns differ from the result set",
+                                    DONT_DELETE_MSG);
+        }
+    }
+
+    int nFetched = 0;
+
+    while (!rQuery.eof() && (nMaxRows < 0 || nFetched < nMaxRows))
+    {
+        appendRow(rQuery.mpVM);
+        nFetched++;
+        rQuery.nextRow();
+    }
+
+    return nFetched;
 }
 
 
-CppSQLite3Statement::~CppSQLite3Statement()
+void CppSQLite3ResultSet::reserve(int nRows)
 {
-    try
+    mnReserved = nRows;
+
+    for (Column& col : mvColumns)
     {
-        finalize();
+        reserveColumn(col);
     }
-    catch (...)
+}
+
+
+int CppSQLite3ResultSet::numFields() const
+{
+    return static_cast<int>(mvColumns.size());
+}
+
+
+int CppSQLite3ResultSet::numRows() const
+{
+    return mnRows;
+}
+
+
+int CppSQLite3ResultSet::fieldIndex(const char* szField) const
+{
+    if (szField)
     {
+        int nField = mColumns.find(szField);
+
+        if (nField >= 0)
+        {
+            return nField;
+        }
     }
+
+    throw CppSQLite3Exception(CPPSQLITE_ERROR,
+                            "Invalid field name requested",
+                            DONT_DELETE_MSG);
 }
 
 
-CppSQLite3Statement& CppSQLite3Statement::operator=(const CppSQLite3Statement& rStatement)
+const char* CppSQLite3ResultSet::fieldName(int nCol) const
 {
-    mpDB = rStatement.mpDB;
-    mpVM = rStatement.mpVM;
-    // Only one object can own VM
-    const_cast<CppSQLite3Statement&>(rStatement).mpVM = 0;
-    return *this;
+    return column(nCol).sName.c_str();
 }
 
 
-int CppSQLite3Statement::execDML()
+int CppSQLite3ResultSet::fieldDataType(int nCol) const
 {
-    checkDB();
-    checkVM();
+    return column(nCol).nType;
+}
 
-    const char* szError=0;
 
-    int nRet = sqlite3_step(mpVM);
+int CppSQLite3ResultSet::getIntField(int nField, int nNullValue/*=0*/) const
+{
+    const Column& col = column(nField);
+    return isNull(col) ? nNullValue : static_cast<int>(getInt64Field(nField));
+}
 
-    if (nRet == SQLITE_DONE)
-    {
-        int nRowsChanged = sqlite3_changes(mpDB);
 
-        nRet = sqlite3_reset(mpVM);
+int CppSQLite3ResultSet::getIntField(const char* szField, int nNullValue/*=0*/) const
+{
+    return getIntField(fieldIndex(szField), nNullValue);
+}
 
-        if (nRet != SQLITE_OK)
-        {
-            szError = sqlite3_errmsg(mpDB);
-            throw CppSQLite3Exception(nRet, (char*)szError, DONT_DELETE_MSG);
-        }
 
-        return nRowsChanged;
+long long CppSQLite3ResultSet::getInt64Field(int nField, long long nNullValue/*=0*/) const
+{
+    const Column& col = column(nField);
+
+    if (isNull(col))
+    {
+        return nNullValue;
     }
-    else
+
+    switch (col.nType)
     {
-        nRet = sqlite3_reset(mpVM);
-        szError = sqlite3_errmsg(mpDB);
-        throw CppSQLite3Exception(nRet, (char*)szError, DONT_DELETE_MSG);
+        case SQLITE_INTEGER : return col.vInt[mnCurrentRow];
+        case SQLITE_FLOAT   : return static_cast<long long>(col.vDouble[mnCurrentRow]);
+        case SQLITE_TEXT    : return parseInt64(&col.vArena[col.vOffsets[mnCurrentRow]]);
+        default             : return 0;
     }
 }
 
 
-CppSQLite3Query CppSQLite3Statement::execQuery()
+long long CppSQLite3ResultSet::getInt64Field(const char* szField, long long nNullValue/*=0*/) const
 {
-    checkDB();
-    checkVM();
+    return getInt64Field(fieldIndex(szField), nNullValue);
+}
 
-    int nRet = sqlite3_step(mpVM);
 
-    if (nRet == SQLITE_DONE)
+double CppSQLite3ResultSet::getDoubleField(int nField, double dNullValue/*=0.0*/) const
+{
+    const Column& col = column(nField);
+
+    if (isNull(col))
     {
-        // no rows
-        return CppSQLite3Query(mpDB, mpVM, true/*eof*/, false);
+        return dNullValue;
     }
-    else if (nRet == SQLITE_ROW)
+
+    switch (col.nType)
     {
-        // at least 1 row
-        return CppSQLite3Query(mpDB, mpVM, false/*eof*/, false);
+        case SQLITE_INTEGER : return static_cast<double>(col.vInt[mnCurrentRow]);
+        case SQLITE_FLOAT   : return col.vDouble[mnCurrentRow];
+        case SQLITE_TEXT    : return parseDouble(&col.vArena[col.vOffsets[mnCurrentRow]]);
+        default             : return 0.0;
     }
-    else
+}
+
+
+double CppSQLite3ResultSet::getDoubleField(const char* szField, double dNullValue/*=0.0*/) const
+{
+    return getDoubleField(fieldIndex(szField), dNullValue);
+}
+
+
+const char* CppSQLite3ResultSet::getStringField(int nField, const char* szNullValue/*=""*/) const
+{
+    const Column& col = column(nField);
+    std::size_t nLen;
+    return isNull(col) ? szNullValue : bytes(col, nLen);
+}
+
+
+const char* CppSQLite3ResultSet::getStringField(const char* szField, const char* szNullValue/*=""*/) const
+{
+    return getStringField(fieldIndex(szField), szNullValue);
+}
+
+
+const unsigned char* CppSQLite3ResultSet::getBlobField(int nField, int& nLen) const
+{
+    const Column& col = column(nField);
+
+    if (isNull(col))
     {
-        nRet = sqlite3_reset(mpVM);
-        const char* szError = sqlite3_errmsg(mpDB);
-        throw CppSQLite3Exception(nRet, (char*)szError, DONT_DELETE_MSG);
+        nLen = 0;
+        return 0;
     }
+
+    std::size_t nBytes;
+    const char* pValue = bytes(col, nBytes);
+    nLen = static_cast<int>(nBytes);
+    return reinterpret_cast<const unsigned char*>(pValue);
 }
 
 
-void CppSQLite3Statement::bind(int nParam, const char* szValue)
+const unsigned char* CppSQLite3ResultSet::getBlobField(const char* szField, int& nLen) const
 {
-    checkVM();
-    int nRes = sqlite3_bind_text(mpVM, nParam, szValue, -1, SQLITE_TRANSIENT);
+    return getBlobField(fieldIndex(szField), nLen);
+}
 
-    if (nRes != SQLITE_OK)
+
+std::string_view CppSQLite3ResultSet::getStringView(int nField, std::string_view szNullValue/*=std::string_view()*/) const
+{
+    const Column& col = column(nField);
+
+    if (isNull(col))
     {
-        throw CppSQLite3Exception(nRes,
-                                "Error binding string param",
-                                DONT_DELETE_MSG);
+        return szNullValue;
     }
+
+    std::size_t nLen;
+    const char* szValue = bytes(col, nLen);
+    return std::string_view(szValue, nLen);
 }
 
 
-void CppSQLite3Statement::bind(int nParam, const int nValue)
+std::string_view CppSQLite3ResultSet::getStringView(const char* szField, std::string_view szNullValue/*=std::string_view()*/) const
 {
-    checkVM();
-    int nRes = sqlite3_bind_int(mpVM, nParam, nValue);
+    return getStringView(fieldIndex(szField), szNullValue);
+}
 
-    if (nRes != SQLITE_OK)
+
+#if defined(__cpp_lib_span)
+std::span<const std::byte> CppSQLite3ResultSet::getBlobSpan(int nField) const
+{
+    const Column& col = column(nField);
+
+    if (isNull(col))
     {
-        throw CppSQLite3Exception(nRes,
-                                "Error binding int param",
-                                DONT_DELETE_MSG);
+        return std::span<const std::byte>();
     }
+
+    std::size_t nLen;
+    const char* pValue = bytes(col, nLen);
+    return std::span<const std::byte>(reinterpret_cast<const std::byte*>(pValue), nLen);
 }
 
 
-void CppSQLite3Statement::bind(int nParam, const long long nValue)
+std::span<const std::byte> CppSQLite3ResultSet::getBlobSpan(const char* szField) const
 {
-    checkVM();
-    int nRes = sqlite3_bind_int64(mpVM, nParam, nValue);
+    return getBlobSpan(fieldIndex(szField));
+}
+#endif
 
-    if (nRes != SQLITE_OK)
+
+bool CppSQLite3ResultSet::fieldIsNull(int nField) const
+{
+    return isNull(column(nField));
+}
+
+
+bool CppSQLite3ResultSet::fieldIsNull(const char* szField) const
+{
+    return isNull(column(fieldIndex(szField)));
+}
+
+
+void CppSQLite3ResultSet::setRow(int nRow)
+{
+    if (nRow < 0 || nRow > mnRows-1)
     {
-        throw CppSQLite3Exception(nRes,
-                                  "Error binding int64 param",
-                                  DONT_DELETE_MSG);
+        throw CppSQLite3Exception(CPPSQLITE_ERROR,
+                                "Invalid row index requested",
+                                DONT_DELETE_MSG);
     }
+
+    mnCurrentRow = nRow;
+}
+
+
+#if defined(__cpp_lib_span)
+std::span<const long long> CppSQLite3ResultSet::int64Column(int nCol) const
+{
+    const Column& col = column(nCol);
+    return col.nType == SQLITE_INTEGER ? std::span<const long long>(col.vInt)
+                                       : std::span<const long long>();
+}
+
+
+std::span<const double> CppSQLite3ResultSet::doubleColumn(int nCol) const
+{
+    const Column& col = column(nCol);
+    return col.nType == SQLITE_FLOAT ? std::span<const double>(col.vDouble)
+                                     : std::span<const double>();
+}
+
+
+std::span<const std::uint64_t> CppSQLite3ResultSet::nullBitmap(int nCol) const
+{
+    return column(nCol).vNulls;
+}
+
+
+std::span<const std::size_t> CppSQLite3ResultSet::offsetsColumn(int nCol) const
+{
+    return column(nCol).vOffsets;
+}
+
+
+std::span<const char> CppSQLite3ResultSet::arenaColumn(int nCol) const
+{
+    return column(nCol).vArena;
+}
+#endif
+
+
+void CppSQLite3ResultSet::appendRow(sqlite3_stmt* pVM)
+{
+    std::size_t nWord = static_cast<std::size_t>(mnRows) / 64;
+    std::uint64_t nBit = std::uint64_t(1) << (mnRows % 64);
+
+    for (std::size_t nCol = 0; nCol < mvColumns.size(); nCol++)
+    {
+        Column& col = mvColumns[nCol];
+        int nType = sqlite3_column_type(pVM, static_cast<int>(nCol));
+
+        if (col.vNulls.size() <= nWord)
+        {
+            col.vNulls.push_back(0);
+        }
+
+        if (nType == SQLITE_NULL)
+        {
+            col.vNulls[nWord] |= nBit;
+        }
+        else if (col.nType == SQLITE_NULL)
+        {
+            setColumnType(col, nType);
+        }
+        else if (col.nType == SQLITE_INTEGER && nType == SQLITE_FLOAT)
+        {
+            setColumnType(col, SQLITE_FLOAT);
+        }
+        else if ((col.nType == SQLITE_INTEGER || col.nType == SQLITE_FLOAT) &&
+                 (nType == SQLITE_TEXT || nType == SQLITE_BLOB))
+        {
+            // Reading text as a number would lose it
+            setColumnType(col, SQLITE_TEXT);
+        }
+
+        int nField = static_cast<int>(nCol);
+
+        switch (col.nType)
+        {
+            case SQLITE_NULL:
+                // Values are filled in once the type is known
+                break;
+
+            case SQLITE_INTEGER:
+                col.vInt.push_back(nType == SQLITE_NULL ? 0 : sqlite3_column_int64(pVM, nField));
+                break;
+
+            case SQLITE_FLOAT:
+                col.vDouble.push_back(nType == SQLITE_NULL ? 0.0 : sqlite3_column_double(pVM, nField));
+                break;
+
+            default:
+                if (nType != SQLITE_NULL)
+                {
+                    // Fetch the value before its length, text is converted in place
+                    const char* pValue = col.nType == SQLITE_TEXT
+                                ? reinterpret_cast<const char*>(sqlite3_column_text(pVM, nField))
+                                : static_cast<const char*>(sqlite3_column_blob(pVM, nField));
+                    std::size_t nLen = static_cast<std::size_t>(sqlite3_column_bytes(pVM, nField));
+
+                    if (pValue)
+                    {
+                        col.vArena.insert(col.vArena.end(), pValue, pValue + nLen);
+                    }
+                    col.vArena.push_back(0);
+                }
+                col.vOffsets.push_back(col.vArena.size());
+                break;
+        }
+    }
+
+    mnRows++;
+}
+
+
+void CppSQLite3ResultSet::setColumnType(Column& col, int nType)
+{
+    // The rows appended so far were all NULL, or are numbers being widened
+    if (nType == SQLITE_FLOAT && col.nType == SQLITE_INTEGER)
+    {
+        col.vDouble.assign(col.vInt.begin(), col.vInt.end());
+        std::vector<long long>().swap(col.vInt);
+    }
+    else if (nType == SQLITE_INTEGER)
+    {
+        col.vInt.assign(mnRows, 0);
+    }
+    else if (nType == SQLITE_FLOAT)
+    {
+        col.vDouble.assign(mnRows, 0.0);
+    }
+    else if (col.nType == SQLITE_INTEGER || col.nType == SQLITE_FLOAT)
+    {
+        int nCurrentRow = mnCurrentRow;
+        col.vOffsets.assign(1, 0);
+        col.vArena.clear();
+
+        for (mnCurrentRow = 0; mnCurrentRow < mnRows; mnCurrentRow++)
+        {
+            if (!isNull(col))
+            {
+                std::size_t nLen;
+                const char* szValue = bytes(col, nLen);
+                col.vArena.insert(col.vArena.end(), szValue, szValue + nLen + 1);
+            }
+            col.vOffsets.push_back(col.vArena.size());
+        }
+
+        mnCurrentRow = nCurrentRow;
+        std::vector<long long>().swap(col.vInt);
+        std::vector<double>().swap(col.vDouble);
+    }
+    else
+    {
+        col.vOffsets.assign(mnRows + 1, 0);
+    }
+
+    col.nType = nType;
+    col.vTextOffsets.clear();
+    col.vText.clear();
+    reserveColumn(col);
+}
+
+
+void CppSQLite3ResultSet::reserveColumn(Column& col)
+{
+    if (mnReserved <= mnRows)
+    {
+        return;
+    }
+
+    col.vNulls.reserve(mnReserved / 64 + 1);
+
+    switch (col.nType)
+    {
+        case SQLITE_INTEGER : col.vInt.reserve(mnReserved); break;
+        case SQLITE_FLOAT   : col.vDouble.reserve(mnReserved); break;
+        case SQLITE_TEXT    :
+        case SQLITE_BLOB    : col.vOffsets.reserve(mnReserved + 1); break;
+    }
+}
+
+
+const CppSQLite3ResultSet::Column& CppSQLite3ResultSet::column(int nCol) const
+{
+    if (nCol < 0 || nCol >= static_cast<int>(mvColumns.size()))
+    {
+        throw CppSQLite3Exception(CPPSQLITE_ERROR,
+                                "Invalid field index requested",
+                                DONT_DELETE_MSG);
+    }
+
+    return mvColumns[nCol];
+}
+
+
+bool CppSQLite3ResultSet::isNull(const Column& col) const
+{
+    if (mnRows == 0)
+    {
+        throw CppSQLite3Exception(CPPSQLITE_ERROR,
+                                "Invalid row index requested",
+                                DONT_DELETE_MSG);
+    }
+
+    return col.nType == SQLITE_NULL ||
+           (col.vNulls[mnCurrentRow / 64] >> (mnCurrentRow % 64)) & 1;
+}
+
+
+const char* CppSQLite3ResultSet::bytes(const Column& col, std::size_t& nLen) const
+{
+    const std::vector<std::size_t>* pvOffsets = &col.vOffsets;
+    const std::vector<char>* pvArena = &col.vArena;
+
+    if (col.nType == SQLITE_INTEGER || col.nType == SQLITE_FLOAT)
+    {
+        // Formats the rows added since the last call
+        if (col.vTextOffsets.empty())
+        {
+            col.vTextOffsets.push_back(0);
+        }
+
+        for (std::size_t nRow = col.vTextOffsets.size() - 1; nRow < static_cast<std::size_t>(mnRows); nRow++)
+        {
+            if (!((col.vNulls[nRow / 64] >> (nRow % 64)) & 1))
+            {
+                char szValue[32];
+                if (col.nType == SQLITE_INTEGER)
+                {
+                    sqlite3_snprintf(sizeof(szValue), szValue, "%lld", col.vInt[nRow]);
+                }
+                else
+                {
+                    sqlite3_snprintf(sizeof(szValue), szValue, "%!.15g", col.vDouble[nRow]);
+                }
+                col.vText.insert(col.vText.end(), szValue, szValue + strlen(szValue) + 1);
+            }
+            col.vTextOffsets.push_back(col.vText.size());
+        }
+
+        pvOffsets = &col.vTextOffsets;
+        pvArena = &col.vText;
+    }
+
+    std::size_t nOffset = (*pvOffsets)[mnCurrentRow];
+    nLen = (*pvOffsets)[mnCurrentRow+1] - nOffset - 1;
+    return &(*pvArena)[nOffset];
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+
+CppSQLite3Statement::CppSQLite3Statement()
+{
+    mpDB = 0;
+    mpVM = 0;
+    mpEntry = 0;
+}
+
+
+CppSQLite3Statement::CppSQLite3Statement(CppSQLite3Statement&& rStatement) noexcept
+{
+    mpDB = rStatement.mpDB;
+    mpVM = rStatement.mpVM;
+    mpEntry = rStatement.mpEntry;
+    rStatement.mpVM = 0;
+    rStatement.mpEntry = 0;
+    // Moving the containers leaves the bound buffers where they are
+    mvOwnedText = std::move(rStatement.mvOwnedText);
+    mvOwnedBlobs = std::move(rStatement.mvOwnedBlobs);
+    mpMeta = std::move(rStatement.mpMeta);
+}
+
+
+CppSQLite3Statement::CppSQLite3Statement(sqlite3* pDB,
+                                    sqlite3_stmt* pVM,
+                                    detail::StatementCache::Entry* pEntry/*=0*/)
+{
+    mpDB = pDB;
+    mpVM = pVM;
+    mpEntry = pEntry;
+}
+
+
+CppSQLite3Statement::~CppSQLite3Statement()
+{
+    try
+    {
+        finalize();
+    }
+    catch (...)
+    {
+    }
+}
+
+
+CppSQLite3Statement& CppSQLite3Statement::operator=(CppSQLite3Statement&& rStatement) noexcept
+{
+    if (this != &rStatement)
+    {
+        // The handle held so far goes back to the cache or is finalized
+        try
+        {
+            finalize();
+        }
+        catch (...)
+        {
+        }
+        mpDB = rStatement.mpDB;
+        mpVM = rStatement.mpVM;
+        mpEntry = rStatement.mpEntry;
+        rStatement.mpVM = 0;
+        rStatement.mpEntry = 0;
+        mvOwnedText = std::move(rStatement.mvOwnedText);
+        mvOwnedBlobs = std::move(rStatement.mvOwnedBlobs);
+        mpMeta = std::move(rStatement.mpMeta);
+    }
+    return *this;
+}
+
+
+int CppSQLite3Statement::execDML()
+{
+    checkDB();
+    checkVM();
+
+    const char* szError=0;
+
+    int nRet = sqlite3_step(mpVM);
+
+    if (nRet == SQLITE_DONE)
+    {
+        int nRowsChanged = sqlite3_changes(mpDB);
+
+        nRet = sqlite3_reset(mpVM);
+
+        if (nRet != SQLITE_OK)
+        {
+            szError = sqlite3_errmsg(mpDB);
+            throw CppSQLite3Exception(nRet, (char*)szError, DONT_DELETE_MSG);
+        }
+
+        return nRowsChanged;
+    }
+    else
+    {
+        nRet = sqlite3_reset(mpVM);
+        szError = sqlite3_errmsg(mpDB);
+        throw CppSQLite3Exception(nRet, (char*)szError, DONT_DELETE_MSG);
+    }
+}
+
+
+CppSQLite3Query CppSQLite3Statement::execQuery()
+{
+    checkDB();
+    checkVM();
+
+    int nRet = sqlite3_step(mpVM);
+
+    if (nRet == SQLITE_DONE)
+    {
+        // no rows
+        return CppSQLite3Query(mpDB, mpVM, true/*eof*/, false, 0, &meta());
+    }
+    else if (nRet == SQLITE_ROW)
+    {
+        // at least 1 row
+        return CppSQLite3Query(mpDB, mpVM, false/*eof*/, false, 0, &meta());
+    }
+    else
+    {
+        nRet = sqlite3_reset(mpVM);
+        const char* szError = sqlite3_errmsg(mpDB);
+        throw CppSQLite3Exception(nRet, (char*)szError, DONT_DELETE_MSG);
+    }
+}
+
+
+CppSQLite3ResultSet CppSQLite3Statement::execResultSet()
+{
+    CppSQLite3ResultSet results;
+    CppSQLite3Query q = execQuery();
+    results.fetch(q);
+    reset();
+    return results;
+}
+
+
+void CppSQLite3Statement::bind(int nParam, const char* szValue)
+{
+    checkVM();
+    int nRes = sqlite3_bind_text(mpVM, nParam, szValue, -1, SQLITE_TRANSIENT);
+
+    if (nRes != SQLITE_OK)
+    {
+        throw CppSQLite3Exception(nRes,
+                                "Error binding string param",
+                                DONT_DELETE_MSG);
+    }
+
+    releaseOwned(nParam);
+}
+
+
+void CppSQLite3Statement::bind(int nParam, const int nValue)
+{
+    checkVM();
+    int nRes = sqlite3_bind_int(mpVM, nParam, nValue);
+
+    if (nRes != SQLITE_OK)
+    {
+        throw CppSQLite3Exception(nRes,
+                                "Error binding int param",
+                                DONT_DELETE_MSG);
+    }
+
+    releaseOwned(nParam);
+}
+
+
+void CppSQLite3Statement::bind(int nParam, const long long nValue)
+{
+    checkVM();
+    int nRes = sqlite3_bind_int64(mpVM, nParam, nValue);
+
+    if (nRes != SQLITE_OK)
+    {
+        throw CppSQLite3Exception(nRes,
+                                  "Error binding int64 param",
+                                  DONT_DELETE_MSG);
+    }
+
+    releaseOwned(nParam);
+}
+
+
+void CppSQLite3Statement::bind(int nParam, const double dValue)
+{
+    checkVM();
+    int nRes = sqlite3_bind_double(mpVM, nParam, dValue);
+
+    if (nRes != SQLITE_OK)
+    {
+        throw CppSQLite3Exception(nRes,
+                                "Error binding double param",
+                                DONT_DELETE_MSG);
+    }
+
+    releaseOwned(nParam);
+}
+
+
+void CppSQLite3Statement::bind(int nParam, const unsigned char* blobValue, int nLen)
+{
+    checkVM();
+    int nRes = sqlite3_bind_blob(mpVM, nParam,
+                                (const void*)blobValue, nLen, SQLITE_TRANSIENT);
+
+    if (nRes != SQLITE_OK)
+    {
+        throw CppSQLite3Exception(nRes,
+                                "Error binding blob param",
+                                DONT_DELETE_MSG);
+    }
+
+    releaseOwned(nParam);
+}
+
+
+void CppSQLite3Statement::bind(int nParam, std::string_view szValue)
+{
+    checkVM();
+    int nRes = sqlite3_bind_text64(mpVM, nParam, szValue.data(), szValue.size(),
+                                SQLITE_TRANSIENT, SQLITE_UTF8);
+
+    if (nRes != SQLITE_OK)
+    {
+        throw CppSQLite3Exception(nRes,
+                                "Error binding string param",
+                                DONT_DELETE_MSG);
+    }
+
+    releaseOwned(nParam);
+}
+
+
+#if defined(__cpp_lib_span)
+void CppSQLite3Statement::bind(int nParam, std::span<const std::byte> blobValue)
+{
+    checkVM();
+    int nRes = sqlite3_bind_blob64(mpVM, nParam, blobValue.data(), blobValue.size(),
+                                SQLITE_TRANSIENT);
+
+    if (nRes != SQLITE_OK)
+    {
+        throw CppSQLite3Exception(nRes,
+                                "Error binding blob param",
+                                DONT_DELETE_MSG);
+    }
+
+    releaseOwned(nParam);
+}
+#endif
+
+
+void CppSQLite3Statement::bindStatic(int nParam, std::string_view szValue)
+{
+    checkVM();
+    int nRes = sqlite3_bind_text64(mpVM, nParam, szValue.data(), szValue.size(),
+                                SQLITE_STATIC, SQLITE_UTF8);
+
+    if (nRes != SQLITE_OK)
+    {
+        throw CppSQLite3Exception(nRes,
+                                "Error binding string param",
+                                DONT_DELETE_MSG);
+    }
+
+    releaseOwned(nParam);
+}
+
+
+#if defined(__cpp_lib_span)
+void CppSQLite3Statement::bindStatic(int nParam, std::span<const std::byte> blobValue)
+{
+    checkVM();
+    int nRes = sqlite3_bind_blob64(mpVM, nParam, blobValue.data(), blobValue.size(),
+                                SQLITE_STATIC);
+
+    if (nRes != SQLITE_OK)
+    {
+        throw CppSQLite3Exception(nRes,
+                                "Error binding blob param",
+                                DONT_DELETE_MSG);
+    }
+
+    releaseOwned(nParam);
+}
+#endif
+
+
+void CppSQLite3Statement::bind(int nParam, std::string&& sValue)
+{
+    checkVM();
+    reserveOwned(nParam);
+
+    // Short strings live inside the std::string, so it goes on the heap.
+    // The old buffer is kept until the new one is bound, a failed bind
+    // leaves the old binding in place.
+    std::unique_ptr<std::string> pValue(new std::string(std::move(sValue)));
+
+    int nRes = sqlite3_bind_text64(mpVM, nParam, pValue->data(), pValue->size(),
+                                SQLITE_STATIC, SQLITE_UTF8);
+
+    if (nRes != SQLITE_OK)
+    {
+        throw CppSQLite3Exception(nRes,
+                                "Error binding string param",
+                                DONT_DELETE_MSG);
+    }
+
+    releaseOwned(nParam);
+    mvOwnedText[nParam-1] = std::move(pValue);
+}
+
+
+void CppSQLite3Statement::bind(int nParam, std::vector<unsigned char>&& blobValue)
+{
+    checkVM();
+    reserveOwned(nParam);
+
+    // A null pointer would bind NULL rather than an empty blob. Moving the
+    // vector keeps its buffer, so it is bound before the old one goes.
+    int nRes = blobValue.empty()
+             ? sqlite3_bind_zeroblob(mpVM, nParam, 0)
+             : sqlite3_bind_blob64(mpVM, nParam, blobValue.data(), blobValue.size(), SQLITE_STATIC);
+
+    if (nRes != SQLITE_OK)
+    {
+        throw CppSQLite3Exception(nRes,
+                                "Error binding blob param",
+                                DONT_DELETE_MSG);
+    }
+
+    releaseOwned(nParam);
+    mvOwnedBlobs[nParam-1] = std::move(blobValue);
+}
+
+
+int CppSQLite3Statement::bindParameterIndex(std::string_view szName)
+{
+    return bindParameterIndex(CppSQLite3Param{szName, detail::hashName(szName)});
+}
+
+
+int CppSQLite3Statement::bindParameterIndex(const CppSQLite3Param& param)
+{
+    checkVM();
+
+    detail::StatementMeta& meta = paramIndex();
+    bool bBare = detail::stripParamPrefix(param.szName).size() == param.szName.size();
+    int nParam = bBare ? meta.bareParams.find(param.szName, param.nHash)
+                       : meta.params.find(param.szName, param.nHash);
+
+    if (nParam == 0)
+    {
+        throw CppSQLite3Exception(SQLITE_RANGE,
+                                "Ambiguous parameter name, give its prefix",
+                                DONT_DELETE_MSG);
+    }
+
+    if (nParam < 1)
+    {
+        throw CppSQLite3Exception(SQLITE_RANGE,
+                                "Invalid parameter name",
+                                DONT_DELETE_MSG);
+    }
+
+    return nParam;
+}
+
+
+void CppSQLite3Statement::bindNull(int nParam)
+{
+    checkVM();
+    int nRes = sqlite3_bind_null(mpVM, nParam);
+
+    if (nRes != SQLITE_OK)
+    {
+        throw CppSQLite3Exception(nRes,
+                                "Error binding NULL param",
+                                DONT_DELETE_MSG);
+    }
+
+    releaseOwned(nParam);
+}
+
+
+void CppSQLite3Statement::bindZeroBlob(int nParam, sqlite3_uint64 nBytes)
+{
+    checkVM();
+    int nRes = sqlite3_bind_zeroblob64(mpVM, nParam, nBytes);
+
+    if (nRes != SQLITE_OK)
+    {
+        throw CppSQLite3Exception(nRes,
+                                "Error binding zeroblob param",
+                                DONT_DELETE_MSG);
+    }
+
+    releaseOwned(nParam);
+}
+
+
+void CppSQLite3Statement::reset()
+{
+    if (mpVM)
+    {
+        int nRet = sqlite3_reset(mpVM);
+
+        if (nRet != SQLITE_OK)
+        {
+            const char* szError = sqlite3_errmsg(mpDB);
+            throw CppSQLite3Exception(nRet, (char*)szError, DONT_DELETE_MSG);
+        }
+    }
+}
+
+
+void CppSQLite3Statement::finalize()
+{
+    if (mpVM)
+    {
+        int nRet = mpEntry ? mpEntry->pCache->release(mpEntry) : sqlite3_finalize(mpVM);
+        mpVM = 0;
+        mpEntry = 0;
+        mvOwnedText.clear();
+        mvOwnedBlobs.clear();
+        mpMeta.reset();
+
+        if (nRet != SQLITE_OK)
+        {
+            const char* szError = sqlite3_errmsg(mpDB);
+            throw CppSQLite3Exception(nRet, (char*)szError, DONT_DELETE_MSG);
+        }
+    }
+}
+
+
+bool CppSQLite3Statement::beginBatch()
+{
+    // Leave transactions opened by the caller alone
+    if (!sqlite3_get_autocommit(mpDB))
+    {
+        return false;
+    }
+
+    char* szError=0;
+    int nRet = sqlite3_exec(mpDB, "BEGIN", 0, 0, &szError);
+
+    if (nRet != SQLITE_OK)
+    {
+        throw CppSQLite3Exception(nRet, szError);
+    }
+
+    return true;
+}
+
+
+int CppSQLite3Statement::stepBatchRow()
+{
+    int nRet;
+
+    do
+    {
+        nRet = sqlite3_step(mpVM);
+    }
+    while (nRet == SQLITE_ROW);
+
+    if (nRet == SQLITE_DONE)
+    {
+        return sqlite3_reset(mpVM);
+    }
+
+    return nRet;
+}
+
+
+void CppSQLite3Statement::endBatch(bool bContinue)
+{
+    char* szError=0;
+    int nRet = sqlite3_exec(mpDB, bContinue ? "COMMIT; BEGIN" : "COMMIT", 0, 0, &szError);
+
+    if (nRet != SQLITE_OK)
+    {
+        throw CppSQLite3Exception(nRet, szError);
+    }
+}
+
+
+void CppSQLite3Statement::rollbackBatch()
+{
+    if (!sqlite3_get_autocommit(mpDB))
+    {
+        sqlite3_exec(mpDB, "ROLLBACK", 0, 0, 0);
+    }
+}
+
+
+void CppSQLite3Statement::failBatch(long long nRow, int nErr)
+{
+    char* szError = sqlite3_mprintf("Batch failed at row %lld: %s",
+                                    nRow,
+                                    sqlite3_errmsg(mpDB));
+    sqlite3_reset(mpVM);
+    throw CppSQLite3Exception(nErr, szError);
+}
+
+
+void CppSQLite3Statement::checkDB() const
+{
+    if (mpDB == 0)
+    {
+        throw CppSQLite3Exception(CPPSQLITE_ERROR,
+                                "Database not open",
+                                DONT_DELETE_MSG);
+    }
+}
+
+
+void CppSQLite3Statement::checkVM() const
+{
+    if (mpVM == 0)
+    {
+        throw CppSQLite3Exception(CPPSQLITE_ERROR,
+                                "Null Virtual Machine pointer",
+                                DONT_DELETE_MSG);
+    }
+}
+
+
+detail::StatementMeta& CppSQLite3Statement::meta()
+{
+    if (mpEntry)
+    {
+        return mpEntry->meta;
+    }
+
+    if (!mpMeta)
+    {
+        mpMeta.reset(new detail::StatementMeta());
+    }
+
+    return *mpMeta;
+}
+
+
+detail::StatementMeta& CppSQLite3Statement::paramIndex()
+{
+    detail::StatementMeta& meta = this->meta();
+    detail::NameIndex& index = meta.params;
+    detail::NameIndex& bare = meta.bareParams;
+
+    if (!index.built())
+    {
+        // Built once per handle, and kept with it in the statement cache
+        int nParams = sqlite3_bind_parameter_count(mpVM);
+        index.reset(nParams);
+        bare.reset(nParams);
+
+        for (int nParam = 1; nParam <= nParams; nParam++)
+        {
+            const char* szName = sqlite3_bind_parameter_name(mpVM, nParam);
+
+            if (szName)
+            {
+                index.add(szName, nParam);
+
+                std::string_view szBare = detail::stripParamPrefix(szName);
+
+                if (bare.find(szBare) > 0)
+                {
+                    bare.assign(szBare, 0);
+                }
+                else
+                {
+                    bare.add(szBare, nParam);
+                }
+            }
+        }
+    }
+
+    return meta;
+}
+
+
+void CppSQLite3Statement::reserveOwned(int nParam)
+{
+    int nParams = sqlite3_bind_parameter_count(mpVM);
+
+    if (nParam < 1 || nParam > nParams)
+    {
+        throw CppSQLite3Exception(SQLITE_RANGE,
+                                "Invalid parameter index",
+                                DONT_DELETE_MSG);
+    }
+
+    if (static_cast<int>(mvOwnedText.size()) < nParams)
+    {
+        mvOwnedText.resize(nParams);
+        mvOwnedBlobs.resize(nParams);
+    }
+}
+
+
+void CppSQLite3Statement::releaseOwned(int nParam)
+{
+    // Called once the parameter is bound to something else, so its old
+    // buffer is no longer in use
+    if (nParam >= 1 && nParam <= static_cast<int>(mvOwnedText.size()))
+    {
+        mvOwnedText[nParam-1].reset();
+        std::vector<unsigned char>().swap(mvOwnedBlobs[nParam-1]);
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+
+CppSQLite3DB::CppSQLite3DB()
+{
+    mpDB = 0;
+    mnBusyTimeoutMs = 60000; // 60 seconds
+    mCache = std::make_shared<detail::StatementCache>();
+    mTransactionStats = CppSQLite3TransactionStats();
+    mnSavepoints = 0;
+}
+
+
+CppSQLite3DB::CppSQLite3DB(CppSQLite3DB&& db) noexcept
+{
+    mpDB = db.mpDB;
+    mnBusyTimeoutMs = db.mnBusyTimeoutMs;
+    mCache = std::move(db.mCache);
+    mTransactionStats = db.mTransactionStats;
+    mnSavepoints = db.mnSavepoints;
+    db.mpDB = 0;
+}
+
+
+CppSQLite3DB::~CppSQLite3DB()
+{
+    close();
+}
+
+
+CppSQLite3DB& CppSQLite3DB::operator=(CppSQLite3DB&& db) noexcept
+{
+    if (this != &db)
+    {
+        close();
+        mpDB = db.mpDB;
+        mnBusyTimeoutMs = db.mnBusyTimeoutMs;
+        mCache = std::move(db.mCache);
+        mTransactionStats = db.mTransactionStats;
+        mnSavepoints = db.mnSavepoints;
+        db.mpDB = 0;
+    }
+    return *this;
+}
+
+
+void CppSQLite3DB::open(const char* szFile)
+{
+    open(szFile, CppSQLite3OpenOptions());
+}
+
+
+void CppSQLite3DB::open(const char* szFile, const CppSQLite3OpenOptions& options)
+{
+    cache();
+
+    int nFlags = options.bReadOnly || options.bImmutable ? SQLITE_OPEN_READONLY : SQLITE_OPEN_READWRITE;
+
+    if (options.bCreate && !options.bReadOnly && !options.bImmutable)
+    {
+        nFlags |= SQLITE_OPEN_CREATE;
+    }
+
+    nFlags |= options.bSharedCache ? SQLITE_OPEN_SHAREDCACHE : 0;
+    nFlags |= options.nThreading & (SQLITE_OPEN_NOMUTEX | SQLITE_OPEN_FULLMUTEX);
+
+    std::string sFile(szFile);
+
+    if (options.bImmutable)
+    {
+        // immutable is only accepted as a URI parameter
+        if (options.bUri || sFile.compare(0, 5, "file:") == 0)
+        {
+            sFile += sFile.find('?') == std::string::npos ? "?immutable=1" : "&immutable=1";
+        }
+        else
+        {
+            sFile = fileUri(sFile) + "?immutable=1";
+        }
+        nFlags |= SQLITE_OPEN_URI;
+    }
+    else if (options.bUri)
+    {
+        nFlags |= SQLITE_OPEN_URI;
+    }
+
+    int nRet = sqlite3_open_v2(sFile.c_str(), &mpDB, nFlags, 0);
+
+    if (nRet != SQLITE_OK)
+    {
+        // A handle is returned even on failure and must be closed
+        CppSQLite3Exception e(nRet, mpDB ? sqlite3_errmsg(mpDB) : "Out of memory", DONT_DELETE_MSG);
+        sqlite3_close(mpDB);
+        mpDB = 0;
+        throw e;
+    }
+
+    setBusyTimeout(mnBusyTimeoutMs);
+
+    try
+    {
+        applyProfile(options.profile);
+    }
+    catch (CppSQLite3Exception&)
+    {
+        close();
+        throw;
+    }
+}
+
+
+void CppSQLite3DB::close()
+{
+    if (mpDB)
+    {
+        // Cached handles would otherwise keep the connection open, and one
+        // still checked out closes it when finalized
+        mCache->clear();
+        sqlite3_close_v2(mpDB);
+        mpDB = 0;
+    }
+}
+
+
+CppSQLite3Statement CppSQLite3DB::compileStatement(const char* szSQL)
+{
+    return compileStatement(std::string_view(szSQL));
+}
+
+
+CppSQLite3Statement CppSQLite3DB::compileStatement(std::string_view szSQL)
+{
+    checkDB();
+
+    detail::StatementCache::Entry* pEntry;
+    sqlite3_stmt* pVM = compile(szSQL, pEntry);
+    return CppSQLite3Statement(mpDB, pVM, pEntry);
+}
+
+
+bool CppSQLite3DB::tableExists(const char* szTable)
+{
+    checkDB();
+
+    CppSQLite3Buffer sql;
+    sql.format( "select count(*) from sqlite_master where type='table' and name=%Q",
+                szTable );
+    long long nRet = parseInt64(execUncached(sql).value_or("0").c_str());
+    return (nRet > 0);
+}
+
+
+int CppSQLite3DB::execDML(const char* szSQL)
+{
+    return execDML(std::string_view(szSQL));
+}
+
+
+int CppSQLite3DB::execDML(std::string_view szSQL)
+{
+    checkDB();
+
+    detail::StatementCache::Entry* pEntry;
+    const char* szTail=0;
+    sqlite3_stmt* pVM = compile(szSQL, pEntry, &szTail);
+
+    if (pVM)
+    {
+        runToCompletion(pVM, pEntry);
+    }
+
+    const char* szEnd = szSQL.data() + szSQL.size();
+
+    if (szTail && szTail < szEnd)
+    {
+        execScript(std::string_view(szTail, szEnd - szTail));
+    }
+
+    return sqlite3_changes(mpDB);
+}
+
+
+int CppSQLite3DB::execScript(std::string_view szSQL)
+{
+    checkDB();
+
+    int nTotalChanges = sqlite3_total_changes(mpDB);
+
+    const char* szPos = szSQL.data();
+    const char* szEnd = szPos + szSQL.size();
+
+    while (szPos < szEnd)
+    {
+        const char* szTail=0;
+        sqlite3_stmt* pVM = prepare(std::string_view(szPos, szEnd - szPos), 0, &szTail);
+
+        if (pVM)
+        {
+            runToCompletion(pVM, 0);
+        }
+
+        if (!szTail || szTail <= szPos)
+        {
+            break;
+        }
+
+        szPos = szTail;
+    }
+
+    return sqlite3_total_changes(mpDB) - nTotalChanges;
+}
+
+
+CppSQLite3Query CppSQLite3DB::execQuery(const char* szSQL)
+{
+    return execQuery(std::string_view(szSQL));
+}
+
+
+CppSQLite3Query CppSQLite3DB::execQuery(std::string_view szSQL)
+{
+    checkDB();
+
+    detail::StatementCache::Entry* pEntry;
+    sqlite3_stmt* pVM = compile(szSQL, pEntry);
+
+    int nRet = sqlite3_step(pVM);
+
+    if (nRet == SQLITE_DONE)
+    {
+        // no rows
+        return CppSQLite3Query(mpDB, pVM, true/*eof*/, true, pEntry);
+    }
+    else if (nRet == SQLITE_ROW)
+    {
+        // at least 1 row
+        return CppSQLite3Query(mpDB, pVM, false/*eof*/, true, pEntry);
+    }
+    else
+    {
+        nRet = pEntry ? mCache->release(pEntry) : sqlite3_finalize(pVM);
+        const char* szError= sqlite3_errmsg(mpDB);
+        throw CppSQLite3Exception(nRet, (char*)szError, DONT_DELETE_MSG);
+    }
+}
+
+
+int CppSQLite3DB::execScalar(const char* szSQL)
+{
+    return execScalar<int>(std::string_view(szSQL));
+}
+
+
+CppSQLite3Table CppSQLite3DB::getTable(const char* szSQL)
+{
+    checkDB();
+
+    char* szError=0;
+    char** paszResults=0;
+    int nRet;
+    int nRows(0);
+    int nCols(0);
+
+    nRet = sqlite3_get_table(mpDB, szSQL, &paszResults, &nRows, &nCols, &szError);
+
+    if (nRet == SQLITE_OK)
+    {
+        return CppSQLite3Table(paszResults, nRows, nCols);
+    }
+    else
+    {
+        throw CppSQLite3Exception(nRet, szError);
+    }
+}
+
+
+CppSQLite3ResultSet CppSQLite3DB::getResultSet(const char* szSQL)
+{
+    return getResultSet(std::string_view(szSQL));
+}
+
+
+CppSQLite3ResultSet CppSQLite3DB::getResultSet(std::string_view szSQL)
+{
+    CppSQLite3ResultSet results;
+    CppSQLite3Query q = execQuery(szSQL);
+    results.fetch(q);
+    return results;
+}
+
+
+sqlite_int64 CppSQLite3DB::lastRowId() const
+{
+    return sqlite3_last_insert_rowid(mpDB);
+}
+
+
+void CppSQLite3DB::setBusyTimeout(int nMillisecs)
+{
+    mnBusyTimeoutMs = nMillisecs;
+    sqlite3_busy_timeout(mpDB, mnBusyTimeoutMs);
+}
+
+
+void CppSQLite3DB::setStatementCacheLimits(int nMaxEntries, long long nMaxBytes)
+{
+    cache().setLimits(nMaxEntries, nMaxBytes);
+}
+
+
+CppSQLite3StatementCacheStats CppSQLite3DB::statementCacheStats() const
+{
+    return mCache ? mCache->stats() : CppSQLite3StatementCacheStats();
+}
+
+
+void CppSQLite3DB::clearStatementCache()
+{
+    if (mCache)
+    {
+        mCache->clear();
+    }
+}
+
+
+CppSQLite3Profile CppSQLite3Profile::walBalanced()
+{
+    CppSQLite3Profile profile;
+    profile.szJournalMode = "wal";
+    profile.nSynchronous = 1;
+    profile.nMmapSize = 256LL * 1024 * 1024;
+    profile.nCacheSize = -64 * 1024;
+    profile.nTempStore = 2;
+    profile.nPageSize = 4096;
+    profile.nWalAutocheckpoint = 1000;
+    return profile;
+}
+
+
+CppSQLite3Profile CppSQLite3Profile::walDurable()
+{
+    CppSQLite3Profile profile = walBalanced();
+    profile.nSynchronous = 2;
+    return profile;
+}
+
+
+CppSQLite3Profile CppSQLite3Profile::bulkLoad()
+{
+    CppSQLite3Profile profile = walBalanced();
+    profile.nSynchronous = 0;
+    profile.nCacheSize = -256 * 1024;
+    profile.nWalAutocheckpoint = 10000;
+    return profile;
+}
+
+
+void CppSQLite3DB::applyProfile(const CppSQLite3Profile& profile)
+{
+    // Journal mode and page size belong to the file, not the connection
+    bool bWritable = sqlite3_db_readonly(mpDB, "main") == 0;
+    const char* szFile = sqlite3_db_filename(mpDB, "main");
+    bool bInMemory = !szFile || !*szFile;
+
+    // The page size is fixed once the database has content, and must be
+    // set before switching to WAL
+    if (profile.nPageSize && bWritable && parseInt64(execUncached("pragma page_count").value_or("0").c_str()) == 0)
+    {
+        setPragma("page_size", *profile.nPageSize);
+    }
+
+    if (profile.szJournalMode && bWritable)
+    {
+        CppSQLite3Buffer sql;
+        sql.format("pragma journal_mode=%Q", profile.szJournalMode);
+        std::string sMode = execUncached(static_cast<const char*>(sql)).value_or("");
+
+        // In-memory databases always report memory
+        if (!bInMemory && sqlite3_stricmp(sMode.c_str(), profile.szJournalMode) != 0)
+        {
+            throw CppSQLite3Exception(CPPSQLITE_ERROR,
+                                    "pragma journal_mode was not applied",
+                                    DONT_DELETE_MSG);
+        }
+    }
+
+    if (profile.nSynchronous)
+    {
+        setPragma("synchronous", *profile.nSynchronous);
+    }
+
+    if (profile.nMmapSize)
+    {
+        CppSQLite3Buffer sql;
+        sql.format("pragma mmap_size=%lld", *profile.nMmapSize);
+        std::optional<std::string> sMmapSize = execUncached(static_cast<const char*>(sql));
+        std::optional<long long> nMmapSize;
+        if (sMmapSize)
+        {
+            nMmapSize = parseInt64(sMmapSize->c_str());
+        }
+
+        // No row when memory mapping is compiled out, and the size is
+        // capped by SQLITE_MAX_MMAP_SIZE
+        if (nMmapSize && (*nMmapSize > *profile.nMmapSize || (*nMmapSize == 0 && *profile.nMmapSize > 0)))
+        {
+            throw CppSQLite3Exception(CPPSQLITE_ERROR,
+                                    "pragma mmap_size was not applied",
+                                    DONT_DELETE_MSG);
+        }
+    }
+
+    if (profile.nCacheSize)
+    {
+        setPragma("cache_size", *profile.nCacheSize);
+    }
+
+    if (profile.nTempStore)
+    {
+        setPragma("temp_store", *profile.nTempStore);
+    }
+
+    if (profile.nWalAutocheckpoint)
+    {
+        setPragma("wal_autocheckpoint", *profile.nWalAutocheckpoint);
+    }
+}
+
+
+void CppSQLite3DB::setPragma(const char* szPragma, long long nValue)
+{
+    CppSQLite3Buffer sql;
+    sql.format("pragma %s=%lld", szPragma, nValue);
+    execUncached(static_cast<const char*>(sql));
+
+    sql.format("pragma %s", szPragma);
+
+    if (parseInt64(execUncached(static_cast<const char*>(sql)).value_or("").c_str()) != nValue)
+    {
+        sql.format("pragma %s was not applied", szPragma);
+        throw CppSQLite3Exception(CPPSQLITE_ERROR,
+                                static_cast<const char*>(sql),
+                                DONT_DELETE_MSG);
+    }
+}
+
+
+std::optional<std::string> CppSQLite3DB::execUncached(const char* szSQL)
+{
+    sqlite3_stmt* pVM = prepare(szSQL, 0, 0);
+    std::optional<std::string> sValue;
+    int nRet;
+
+    while ((nRet = sqlite3_step(pVM)) == SQLITE_ROW)
+    {
+        if (!sValue)
+        {
+            const char* szValue = reinterpret_cast<const char*>(sqlite3_column_text(pVM, 0));
+            sValue = szValue ? szValue : "";
+        }
+    }
+
+    if (nRet != SQLITE_DONE)
+    {
+        CppSQLite3Exception e(nRet, sqlite3_errmsg(mpDB), DONT_DELETE_MSG);
+        sqlite3_finalize(pVM);
+        throw e;
+    }
+
+    sqlite3_finalize(pVM);
+    return sValue;
+}
+
+
+detail::StatementCache& CppSQLite3DB::cache()
+{
+    // A DB that has been moved from gets a new cache when used again
+    if (!mCache)
+    {
+        mCache = std::make_shared<detail::StatementCache>();
+    }
+
+    return *mCache;
+}
+
+
+void CppSQLite3DB::checkDB() const
+{
+    if (!mpDB)
+    {
+        throw CppSQLite3Exception(CPPSQLITE_ERROR,
+                                "Database not open",
+                                DONT_DELETE_MSG);
+    }
+}
+
+
+sqlite3_stmt* CppSQLite3DB::compile(std::string_view szSQL,
+                                detail::StatementCache::Entry*& pEntry,
+                                const char** pszTail/*=0*/)
+{
+    checkDB();
+
+    pEntry = mCache->acquire(szSQL);
+
+    if (pEntry)
+    {
+        // Only single statements are cached, so nothing is left over
+        if (pszTail)
+        {
+            *pszTail = szSQL.data() + szSQL.size();
+        }
+        return pEntry->pVM;
+    }
+
+    // Handles that may be cached are expected to be long lived
+    unsigned int nFlags = mCache->enabled() ? SQLITE_PREPARE_PERSISTENT : 0;
+
+    const char* szTail=0;
+    sqlite3_stmt* pVM = prepare(szSQL, nFlags, &szTail);
+
+    const char* szEnd = szSQL.data() + szSQL.size();
+    while (szTail < szEnd && std::isspace(static_cast<unsigned char>(*szTail)))
+    {
+        szTail++;
+    }
+
+    if (szTail == szEnd)
+    {
+        pEntry = mCache->insert(szSQL, pVM);
+    }
+
+    if (pszTail)
+    {
+        *pszTail = szTail;
+    }
+
+    return pVM;
+}
+
+
+sqlite3_stmt* CppSQLite3DB::prepare(std::string_view szSQL,
+                                unsigned int nFlags,
+                                const char** pszTail)
+{
+    checkDB();
+
+    if (szSQL.size() > static_cast<size_t>(INT_MAX))
+    {
+        throw CppSQLite3Exception(SQLITE_TOOBIG,
+                                "SQL statement too long",
+                                DONT_DELETE_MSG);
+    }
+
+    sqlite3_stmt* pVM=0;
+
+    // prepare_v3 handles re-preparing on SQLITE_SCHEMA when stepped
+    int nRet = sqlite3_prepare_v3(mpDB,
+                                szSQL.data(),
+                                static_cast<int>(szSQL.size()),
+                                nFlags,
+                                &pVM,
+                                pszTail);
+
+    if (nRet != SQLITE_OK)
+    {
+        const char* szError = sqlite3_errmsg(mpDB);
+        throw CppSQLite3Exception(nRet, (char*)szError, DONT_DELETE_MSG);
+    }
+
+    return pVM;
+}
+
+
+void CppSQLite3DB::runToCompletion(sqlite3_stmt* pVM,
+                                detail::StatementCache::Entry* pEntry)
+{
+    int nRet;
+
+    do
+    {
+        nRet = sqlite3_step(pVM);
+    }
+    while (nRet == SQLITE_ROW);
+
+    if (nRet == SQLITE_DONE)
+    {
+        nRet = pEntry ? mCache->release(pEntry) : sqlite3_finalize(pVM);
+    }
+    else
+    {
+        // The message must be read before the handle is finalized
+        CppSQLite3Exception e(nRet, sqlite3_errmsg(mpDB), DONT_DELETE_MSG);
+        if (pEntry)
+        {
+            mCache->release(pEntry);
+        }
+        else
+        {
+            sqlite3_finalize(pVM);
+        }
+        throw e;
+    }
+
+    if (nRet != SQLITE_OK)
+    {
+        const char* szError = sqlite3_errmsg(mpDB);
+        throw CppSQLite3Exception(nRet, (char*)szError, DONT_DELETE_MSG);
+    }
+}
+
+
+sqlite3_stmt* CppSQLite3DB::compileScalar(std::string_view szSQL,
+                                        detail::StatementCache::Entry*& pEntry)
+{
+    sqlite3_stmt* pVM = compile(szSQL, pEntry);
+
+    if (pVM && sqlite3_column_count(pVM) > 0)
+    {
+        return pVM;
+    }
+
+    if (pVM)
+    {
+        releaseScalar(pVM, pEntry);
+    }
+
+    throw CppSQLite3Exception(CPPSQLITE_ERROR,
+                            "Invalid scalar query",
+                            DONT_DELETE_MSG);
+}
+
+
+bool CppSQLite3DB::stepScalar(sqlite3_stmt* pVM,
+                            detail::StatementCache::Entry* pEntry,
+                            int nBindRet)
+{
+    if (nBindRet != SQLITE_OK)
+    {
+        releaseScalar(pVM, pEntry);
+        throw CppSQLite3Exception(nBindRet,
+                                "Error binding param",
+                                DONT_DELETE_MSG);
+    }
+
+    int nRet = sqlite3_step(pVM);
+
+    if (nRet == SQLITE_ROW || nRet == SQLITE_DONE)
+    {
+        return (nRet == SQLITE_ROW);
+    }
+
+    CppSQLite3Exception e(nRet, sqlite3_errmsg(mpDB), DONT_DELETE_MSG);
+    releaseScalar(pVM, pEntry);
+    throw e;
+}
+
+
+void CppSQLite3DB::releaseScalar(sqlite3_stmt* pVM,
+                                detail::StatementCache::Entry* pEntry)
+{
+    if (pEntry)
+    {
+        mCache->release(pEntry);
+    }
+    else
+    {
+        sqlite3_finalize(pVM);
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Fixed statements, so each is prepared once and then served by the cache.
+// Savepoints are named after their nesting depth, which keeps the names
+// of open ones distinct and the cached statements few.
+static const char* const BEGIN_SQL[] = { "begin deferred", "begin immediate", "begin exclusive" };
+
+
+CppSQLite3Transaction::CppSQLite3Transaction(CppSQLite3DB& db, Mode eMode/*=IMMEDIATE*/) :
+    mDB(db),
+    mbActive(false)
+{
+    mDB.execDML(BEGIN_SQL[eMode]);
+    mbActive = true;
+    mDB.mTransactionStats.nBegins++;
+    mDB.mnSavepoints = 0;
+}
+
+
+CppSQLite3Transaction::~CppSQLite3Transaction()
+{
+    try
+    {
+        rollback();
+    }
+    catch (...)
+    {
+    }
+}
+
+
+void CppSQLite3Transaction::commit()
+{
+    if (!mbActive)
+    {
+        throw CppSQLite3Exception(CPPSQLITE_ERROR,
+                                "Transaction is not active",
+                                DONT_DELETE_MSG);
+    }
+
+    std::chrono::steady_clock::time_point tStart = std::chrono::steady_clock::now();
+
+    try
+    {
+        mDB.execDML("commit");
+    }
+    catch (CppSQLite3Exception&)
+    {
+        // SQLite rolls back on some errors, then there is nothing to retry
+        mbActive = mDB.inTransaction();
+        if (!mbActive)
+        {
+            mDB.mTransactionStats.nRollbacks++;
+        }
+        throw;
+    }
+
+    mbActive = false;
+
+    long long nMicros = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - tStart).count();
+
+    CppSQLite3TransactionStats& stats = mDB.mTransactionStats;
+    stats.nCommits++;
+    stats.nCommitMicros += nMicros;
+    stats.nMaxCommitMicros = std::max(stats.nMaxCommitMicros, nMicros);
+}
+
+
+void CppSQLite3Transaction::rollback()
+{
+    if (!mbActive)
+    {
+        return;
+    }
+
+    mbActive = false;
+    mDB.mTransactionStats.nRollbacks++;
+
+    if (mDB.inTransaction())
+    {
+        mDB.execDML("rollback");
+    }
+}
+
+
+CppSQLite3Savepoint::CppSQLite3Savepoint(CppSQLite3DB& db) :
+    mDB(db),
+    mnLevel(0),
+    mbActive(false)
+{
+    // Savepoints left over from a transaction that has ended are gone
+    if (!mDB.inTransaction())
+    {
+        mDB.mnSavepoints = 0;
+    }
+
+    mnLevel = mDB.mnSavepoints;
+    exec("savepoint");
+    mbActive = true;
+    mDB.mnSavepoints = mnLevel + 1;
+    mDB.mTransactionStats.nSavepoints++;
+}
+
+
+CppSQLite3Savepoint::~CppSQLite3Savepoint()
+{
+    try
+    {
+        rollback();
+    }
+    catch (...)
+    {
+    }
+}
+
+
+void CppSQLite3Savepoint::release()
+{
+    if (!mbActive)
+    {
+        throw CppSQLite3Exception(CPPSQLITE_ERROR,
+                                "Savepoint is not active",
+                                DONT_DELETE_MSG);
+    }
+
+    exec("release");
+    mbActive = false;
+
+    // Releasing also ends any savepoints opened inside this one
+    mDB.mnSavepoints = mnLevel;
+}
+
+
+void CppSQLite3Savepoint::rollback()
+{
+    if (!mbActive)
+    {
+        return;
+    }
+
+    mbActive = false;
+    mDB.mTransactionStats.nSavepointRollbacks++;
+
+    // Nothing is left to undo if SQLite already rolled the transaction
+    // back, or an enclosing savepoint has been ended
+    if (mDB.inTransaction() && mnLevel < mDB.mnSavepoints)
+    {
+        mDB.mnSavepoints = mnLevel;
+        exec("rollback to");
+        exec("release");
+    }
+}
+
+
+void CppSQLite3Savepoint::exec(const char* szVerb)
+{
+    CppSQLite3Buffer sql;
+    sql.format("%s cppsqlite_savepoint_%d", szVerb, mnLevel);
+    mDB.execDML(static_cast<const char*>(sql));
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+
+CppSQLite3Backup::CppSQLite3Backup(CppSQLite3DB& dest,
+                                CppSQLite3DB& source,
+                                const char* szDestName/*="main"*/,
+                                const char* szSourceName/*="main"*/) :
+    mpBackup(0),
+    mpDest(0),
+    mnPageSize(0),
+    mnPagesPerStep(100),
+    mnPauseMicros(0),
+    mnBytesPerSecond(0),
+    mbCancel(false)
+{
+    dest.checkDB();
+    init(dest.mpDB, szDestName, source, szSourceName);
+}
+
+
+CppSQLite3Backup::CppSQLite3Backup(const char* szDestFile,
+                                CppSQLite3DB& source,
+                                const char* szSourceName/*="main"*/) :
+    mpBackup(0),
+    mpDest(0),
+    mnPageSize(0),
+    mnPagesPerStep(100),
+    mnPauseMicros(0),
+    mnBytesPerSecond(0),
+    mbCancel(false)
+{
+    source.checkDB();
+    mOwnDest.open(szDestFile);
+    init(mOwnDest.mpDB, "main", source, szSourceName);
+}
+
+
+CppSQLite3Backup::~CppSQLite3Backup()
+{
+    cancel();
+
+    if (mThread.joinable())
+    {
+        mThread.join();
+    }
+
+    if (mpBackup)
+    {
+        sqlite3_backup_finish(mpBackup);
+    }
+}
+
+
+void CppSQLite3Backup::setProgressHandler(std::function<void(const CppSQLite3BackupProgress&)> fnProgress)
+{
+    mfnProgress = std::move(fnProgress);
+}
+
+
+bool CppSQLite3Backup::step()
+{
+    if (mbDone.load())
+    {
+        return true;
+    }
+
+    if (!mpBackup)
+    {
+        throw CppSQLite3Exception(CPPSQLITE_ERROR,
+                                "Backup is not active",
+                                DONT_DELETE_MSG);
+    }
+
+    // The page count stays 0 until a step has run
+    bool bStarted = mnPageCount.load() > 0;
+    int nCopied = mnPageCount.load() - mnRemaining.load();
+    int nPages = mnPagesPerStep.load();
+
+    int nRet = sqlite3_backup_step(mpBackup, nPages);
+    mnSteps++;
+
+    if (nRet == SQLITE_BUSY || nRet == SQLITE_LOCKED)
+    {
+        mnBusyRetries++;
+    }
+    else if (nRet == SQLITE_OK || nRet == SQLITE_DONE)
+    {
+        int nRemaining = sqlite3_backup_remaining(mpBackup);
+        int nPageCount = sqlite3_backup_pagecount(mpBackup);
+
+        // Pages are copied in order and a step copies nPages unless it
+        // reaches the end, so fewer copied than that means the copy went
+        // back to the first page. The source may have grown or shrunk.
+        if (bStarted && nPages >= 0)
+        {
+            long long nExpected = std::min(static_cast<long long>(nCopied) + nPages,
+                                        static_cast<long long>(nPageCount));
+
+            if (nPageCount < nCopied || nPageCount - nRemaining < nExpected)
+            {
+                mnRestarts++;
+            }
+        }
+
+        mnRemaining.store(nRemaining);
+        mnPageCount.store(nPageCount);
+
+        if (nRet == SQLITE_DONE)
+        {
+            finish();
+            mbDone.store(true);
+        }
+    }
+    else
+    {
+        sqlite3_backup_finish(mpBackup);
+        mpBackup = 0;
+        throw CppSQLite3Exception(nRet, (char*)sqlite3_errmsg(mpDest), DONT_DELETE_MSG);
+    }
+
+    if (mfnProgress)
+    {
+        mfnProgress(progress());
+    }
+
+    return mbDone.load();
+}
+
+
+void CppSQLite3Backup::run()
+{
+    for (;;)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            if (mbCancel)
+            {
+                return;
+            }
+        }
+
+        std::chrono::steady_clock::time_point tStart = std::chrono::steady_clock::now();
+        long long nRetries = mnBusyRetries.load();
+
+        if (step())
+        {
+            return;
+        }
+
+        // Settings are read once per step, they may change meanwhile
+        std::chrono::microseconds wait(mnPauseMicros.load());
+        long long nBytesPerSecond = mnBytesPerSecond.load();
+        int nPages = mnPagesPerStep.load();
+
+        if (mnBusyRetries.load() != nRetries)
+        {
+            // Give the lock holder time to finish rather than spinning
+            wait = std::max(wait, std::chrono::microseconds(1000));
+        }
+        else if (nBytesPerSecond > 0 && nPages > 0)
+        {
+            long long nBytes = static_cast<long long>(nPages) * mnPageSize;
+            std::chrono::microseconds budget(nBytes * 1000000 / nBytesPerSecond);
+            budget -= std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - tStart);
+            wait = std::max(wait, budget);
+        }
+
+        if (wait.count() > 0)
+        {
+            pause(wait);
+        }
+    }
+}
+
+
+void CppSQLite3Backup::start()
+{
+    if (mThread.joinable())
+    {
+        throw CppSQLite3Exception(CPPSQLITE_ERROR,
+                                "Backup is already running",
+                                DONT_DELETE_MSG);
+    }
+
+    mThread = std::thread([this]
+    {
+        try
+        {
+            run();
+        }
+        catch (...)
+        {
+            mpError = std::current_exception();
+        }
+    });
+}
+
+
+void CppSQLite3Backup::wait()
+{
+    if (mThread.joinable())
+    {
+        mThread.join();
+    }
+
+    if (mpError)
+    {
+        std::exception_ptr pError = mpError;
+        mpError = nullptr;
+        std::rethrow_exception(pError);
+    }
+}
+
+
+void CppSQLite3Backup::cancel()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mbCancel = true;
+    mCancelled.notify_all();
+}
+
+
+CppSQLite3BackupProgress CppSQLite3Backup::progress() const
+{
+    CppSQLite3BackupProgress progress;
+    progress.nRemaining = mnRemaining.load();
+    progress.nPageCount = mnPageCount.load();
+    progress.nSteps = mnSteps.load();
+    progress.nRestarts = mnRestarts.load();
+    progress.nBusyRetries = mnBusyRetries.load();
+    return progress;
+}
+
+
+void CppSQLite3Backup::init(sqlite3* pDest,
+                            const char* szDestName,
+                            CppSQLite3DB& source,
+                            const char* szSourceName)
+{
+    source.checkDB();
+
+    CppSQLite3Buffer sql;
+    sql.format("pragma \"%w\".page_size", szSourceName);
+    mnPageSize = static_cast<int>(parseInt64(source.execUncached(sql).value_or("0").c_str()));
+
+    mpDest = pDest;
+    mpBackup = sqlite3_backup_init(pDest, szDestName, source.mpDB, szSourceName);
+
+    if (!mpBackup)
+    {
+        throw CppSQLite3Exception(sqlite3_errcode(pDest),
+                                (char*)sqlite3_errmsg(pDest),
+                                DONT_DELETE_MSG);
+    }
+}
+
+
+void CppSQLite3Backup::finish()
+{
+    int nRet = sqlite3_backup_finish(mpBackup);
+    mpBackup = 0;
+
+    if (nRet != SQLITE_OK)
+    {
+        throw CppSQLite3Exception(nRet, (char*)sqlite3_errmsg(mpDest), DONT_DELETE_MSG);
+    }
+}
+
+
+void CppSQLite3Backup::pause(std::chrono::microseconds wait)
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    mCancelled.wait_for(lock, wait, [this] { return mbCancel; });
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+
+CppSQLite3BlobStream::CppSQLite3BlobStream()
+{
+    mpDB = 0;
+    mbWritable = false;
+    release();
+}
+
+
+CppSQLite3BlobStream::CppSQLite3BlobStream(CppSQLite3DB& db,
+                                        const char* szTable,
+                                        const char* szColumn,
+                                        sqlite_int64 nRowId,
+                                        bool bWritable/*=false*/,
+                                        const char* szDBName/*="main"*/)
+{
+    mpDB = 0;
+    mbWritable = false;
+    release();
+    open(db, szTable, szColumn, nRowId, bWritable, szDBName);
+}
+
+
+CppSQLite3BlobStream::CppSQLite3BlobStream(CppSQLite3BlobStream&& blob) noexcept
+{
+    mpDB = blob.mpDB;
+    mpBlob = blob.mpBlob;
+    mnSize = blob.mnSize;
+    mnPos = blob.mnPos;
+    msTable = std::move(blob.msTable);
+    msColumn = std::move(blob.msColumn);
+    msDBName = std::move(blob.msDBName);
+    mbWritable = blob.mbWritable;
+    blob.release();
+}
+
+
+CppSQLite3BlobStream& CppSQLite3BlobStream::operator=(CppSQLite3BlobStream&& blob) noexcept
+{
+    if (this != &blob)
+    {
+        try
+        {
+            close();
+        }
+        catch (...)
+        {
+        }
+        mpDB = blob.mpDB;
+        mpBlob = blob.mpBlob;
+        mnSize = blob.mnSize;
+        mnPos = blob.mnPos;
+        msTable = std::move(blob.msTable);
+        msColumn = std::move(blob.msColumn);
+        msDBName = std::move(blob.msDBName);
+        mbWritable = blob.mbWritable;
+        blob.release();
+    }
+    return *this;
+}
+
+
+CppSQLite3BlobStream::~CppSQLite3BlobStream()
+{
+    try
+    {
+        close();
+    }
+    catch (...)
+    {
+    }
+}
+
+
+void CppSQLite3BlobStream::open(CppSQLite3DB& db,
+                                const char* szTable,
+                                const char* szColumn,
+                                sqlite_int64 nRowId,
+                                bool bWritable/*=false*/,
+                                const char* szDBName/*="main"*/)
+{
+    db.checkDB();
+    close();
+
+    mpDB = db.mpDB;
+    msTable = szTable;
+    msColumn = szColumn;
+    msDBName = szDBName;
+    mbWritable = bWritable;
+    openBlob(nRowId);
+}
+
+
+void CppSQLite3BlobStream::reopen(sqlite_int64 nRowId)
+{
+    checkBlob();
+
+    int nRet = sqlite3_blob_reopen(mpBlob, nRowId);
+
+    if (nRet == SQLITE_ABORT)
+    {
+        // An expired handle cannot be moved, only replaced
+        sqlite3_blob_close(mpBlob);
+        release();
+        openBlob(nRowId);
+        return;
+    }
+
+    if (nRet != SQLITE_OK)
+    {
+        throw CppSQLite3Exception(nRet, (char*)sqlite3_errmsg(mpDB), DONT_DELETE_MSG);
+    }
+
+    mnSize = sqlite3_blob_bytes(mpBlob);
+    mnPos = 0;
+}
+
+
+void CppSQLite3BlobStream::close()
+{
+    if (mpBlob)
+    {
+        int nRet = sqlite3_blob_close(mpBlob);
+        release();
+
+        if (nRet != SQLITE_OK)
+        {
+            throw CppSQLite3Exception(nRet, (char*)sqlite3_errmsg(mpDB), DONT_DELETE_MSG);
+        }
+    }
+}
+
+
+void CppSQLite3BlobStream::seek(int nPos)
+{
+    checkBlob();
+
+    if (nPos < 0 || nPos > mnSize)
+    {
+        throw CppSQLite3Exception(CPPSQLITE_ERROR,
+                                "Seek outside the blob",
+                                DONT_DELETE_MSG);
+    }
+
+    mnPos = nPos;
+}
+
+
+int CppSQLite3BlobStream::read(void* pBuf, int nLen)
+{
+    checkBlob();
+
+    int nRead = std::min(nLen, mnSize - mnPos);
+
+    if (nRead <= 0)
+    {
+        return 0;
+    }
+
+    int nRet = sqlite3_blob_read(mpBlob, pBuf, nRead, mnPos);
+
+    if (nRet != SQLITE_OK)
+    {
+        throw CppSQLite3Exception(nRet, (char*)sqlite3_errmsg(mpDB), DONT_DELETE_MSG);
+    }
+
+    mnPos += nRead;
+    return nRead;
+}
+
+
+void CppSQLite3BlobStream::write(const void* pBuf, int nLen)
+{
+    checkBlob();
+
+    if (nLen < 0 || nLen > mnSize - mnPos)
+    {
+        throw CppSQLite3Exception(CPPSQLITE_ERROR,
+                                "Write past the end of the blob",
+                                DONT_DELETE_MSG);
+    }
+
+    int nRet = sqlite3_blob_write(mpBlob, pBuf, nLen, mnPos);
+
+    if (nRet != SQLITE_OK)
+    {
+        throw CppSQLite3Exception(nRet, (char*)sqlite3_errmsg(mpDB), DONT_DELETE_MSG);
+    }
+
+    mnPos += nLen;
+}
+
+
+void CppSQLite3BlobStream::openBlob(sqlite_int64 nRowId)
+{
+    sqlite3_blob* pBlob = 0;
+    int nRet = sqlite3_blob_open(mpDB,
+                                msDBName.c_str(),
+                                msTable.c_str(),
+                                msColumn.c_str(),
+                                nRowId,
+                                mbWritable ? 1 : 0,
+                                &pBlob);
+
+    if (nRet != SQLITE_OK)
+    {
+        throw CppSQLite3Exception(nRet, (char*)sqlite3_errmsg(mpDB), DONT_DELETE_MSG);
+    }
+
+    mpBlob = pBlob;
+    mnSize = sqlite3_blob_bytes(pBlob);
+    mnPos = 0;
+}
+
+
+void CppSQLite3BlobStream::checkBlob() const
+{
+    if (!mpBlob)
+    {
+        throw CppSQLite3Exception(CPPSQLITE_ERROR,
+                                "Blob not open",
+                                DONT_DELETE_MSG);
+    }
+}
+
+
+void CppSQLite3BlobStream::release() noexcept
+{
+    // Keeps mpDB, for the message of an error on close
+    mpBlob = 0;
+    mnSize = 0;
+    mnPos = 0;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+
+CppSQLite3BlobBuf::CppSQLite3BlobBuf(CppSQLite3BlobStream& blob, std::size_t nChunk/*=65536*/) :
+    mBlob(blob),
+    mvBuffer(nChunk > 0 ? nChunk : 1),
+    mnOffset(blob.tell())
+{
+}
+
+
+CppSQLite3BlobBuf::~CppSQLite3BlobBuf()
+{
+    try
+    {
+        flush();
+    }
+    catch (...)
+    {
+    }
+}
+
+
+CppSQLite3BlobBuf::int_type CppSQLite3BlobBuf::underflow()
+{
+    if (gptr() < egptr())
+    {
+        return traits_type::to_int_type(*gptr());
+    }
+
+    flush();
+
+    int nLen = static_cast<int>(std::min<long long>(static_cast<long long>(mvBuffer.size()),
+                                                    mBlob.size() - mnOffset));
+    if (nLen <= 0)
+    {
+        return traits_type::eof();
+    }
+
+    char* pBuf = mvBuffer.data();
+    mBlob.seek(mnOffset);
+    nLen = mBlob.read(pBuf, nLen);
+    setg(pBuf, pBuf, pBuf + nLen);
+
+    return traits_type::to_int_type(*gptr());
+}
+
+
+CppSQLite3BlobBuf::int_type CppSQLite3BlobBuf::overflow(int_type c)
+{
+    flush();
+
+    int nLen = static_cast<int>(std::min<long long>(static_cast<long long>(mvBuffer.size()),
+                                                    mBlob.size() - mnOffset));
+    if (nLen <= 0)
+    {
+        return traits_type::eof();
+    }
+
+    char* pBuf = mvBuffer.data();
+    setp(pBuf, pBuf + nLen);
+
+    if (!traits_type::eq_int_type(c, traits_type::eof()))
+    {
+        *pptr() = traits_type::to_char_type(c);
+        pbump(1);
+    }
+
+    return traits_type::not_eof(c);
+}
+
+
+int CppSQLite3BlobBuf::sync()
+{
+    flush();
+    return 0;
+}
+
+
+CppSQLite3BlobBuf::pos_type CppSQLite3BlobBuf::seekoff(off_type nOffset,
+                                                    std::ios_base::seekdir eDir,
+                                                    std::ios_base::openmode /*eMode*/)
+{
+    flush();
+
+    off_type nBase = eDir == std::ios_base::beg ? 0 :
+                     eDir == std::ios_base::cur ? mnOffset :
+                     mBlob.size();
+    off_type nPos = nBase + nOffset;
+
+    if (nPos < 0 || nPos > mBlob.size())
+    {
+        return pos_type(off_type(-1));
+    }
+
+    mnOffset = static_cast<int>(nPos);
+    return pos_type(nPos);
+}
+
+
+CppSQLite3BlobBuf::pos_type CppSQLite3BlobBuf::seekpos(pos_type nPos, std::ios_base::openmode eMode)
+{
+    return seekoff(off_type(nPos), std::ios_base::beg, eMode);
+}
+
+
+int CppSQLite3BlobBuf::position() const
+{
+    if (pbase())
+    {
+        return mnOffset + static_cast<int>(pptr() - pbase());
+    }
+
+    if (eback())
+    {
+        return mnOffset + static_cast<int>(gptr() - eback());
+    }
+
+    return mnOffset;
+}
+
+
+void CppSQLite3BlobBuf::flush()
+{
+    // Writes back pending output and leaves neither area set up, with
+    // mnOffset at the current position
+    int nPos = position();
+
+    if (pbase() && pptr() > pbase())
+    {
+        mBlob.seek(mnOffset);
+        mBlob.write(pbase(), static_cast<int>(pptr() - pbase()));
+    }
+
+    setg(0, 0, 0);
+    setp(0, 0);
+    mnOffset = nPos;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+
+CppSQLite3PagedTable::CppSQLite3PagedTable(CppSQLite3DB& db,
+                                        std::string_view szSQL,
+                                        const char* szKeyColumn,
+                                        int nPageSize/*=1000*/) :
+    mpDB(&db),
+    mnPageSize(nPageSize > 0 ? nPageSize : 1),
+    mnKeyCol(-1),
+    mnCursorRow(0),
+    mnCols(0),
+    mnPageStart(0),
+    mnPageRows(0),
+    mnCurrentRow(0),
+    mnRows(-1)
+{
+    if (!szKeyColumn || !*szKeyColumn)
+    {
+        throw CppSQLite3Exception(CPPSQLITE_ERROR,
+                                "Key column required",
+                                DONT_DELETE_MSG);
+    }
+
+    // The query is used as a subquery, so whatever follows its end, a ;
+    // or comments, has to go, and anything but comments is refused
+    const char* szTail = 0;
+    sqlite3_finalize(db.prepare(szSQL, 0, &szTail));
+    std::string_view szRest(szTail, szSQL.data() + szSQL.size() - szTail);
+    szSQL.remove_suffix(szRest.size());
+
+    if (sqlite3_stmt* pVM = db.prepare(szRest, 0, 0))
+    {
+        sqlite3_finalize(pVM);
+        throw CppSQLite3Exception(CPPSQLITE_ERROR,
+                                "Paged query must be a single statement",
+                                DONT_DELETE_MSG);
+    }
+
+    while (!szSQL.empty() &&
+           (szSQL.back() == ';' || std::isspace(static_cast<unsigned char>(szSQL.back()))))
+    {
+        szSQL.remove_suffix(1);
+    }
+    msSQL.assign(szSQL.data(), szSQL.size());
+
+    // The newline ends a -- comment left at the end of the statement
+    CppSQLite3Buffer sql;
+    sql.format("select * from (%s\n) order by \"%w\"", msSQL.c_str(), szKeyColumn);
+    mFirst = db.compileStatement(static_cast<const char*>(sql));
+    sql.format("select * from (%s\n) where \"%w\" > ? order by \"%w\"",
+               msSQL.c_str(), szKeyColumn, szKeyColumn);
+    mSeek = db.compileStatement(static_cast<const char*>(sql));
+
+    mCursor = mFirst.execQuery();
+
+    mnCols = mCursor.numFields();
+    mColumns.reset(mnCols);
+    for (int nCol = 0; nCol < mnCols; nCol++)
+    {
+        mvNames.push_back(mCursor.fieldName(nCol));
+        mColumns.add(mvNames.back(), nCol);
+    }
+
+    mnKeyCol = mColumns.find(szKeyColumn);
+
+    if (mnKeyCol < 0)
+    {
+        throw CppSQLite3Exception(CPPSQLITE_ERROR,
+                                "Key column is not part of the result",
+                                DONT_DELETE_MSG);
+    }
+
+    loadPage();
+}
+
+
+int CppSQLite3PagedTable::numFields() const
+{
+    checkResults();
+    return mnCols;
+}
+
+
+int CppSQLite3PagedTable::numRows() const
+{
+    checkResults();
+
+    if (mnRows < 0)
+    {
+        CppSQLite3Buffer sql;
+        sql.format("select count(*) from (%s\n)", msSQL.c_str());
+        mnRows = static_cast<int>(parseInt64(mpDB->execUncached(sql).value_or("0").c_str()));
+    }
+
+    return mnRows;
+}
+
+
+int CppSQLite3PagedTable::fieldIndex(const char* szField) const
+{
+    checkResults();
+
+    if (szField)
+    {
+        int nField = mColumns.find(szField);
+
+        if (nField >= 0)
+        {
+            return nField;
+        }
+    }
+
+    throw CppSQLite3Exception(CPPSQLITE_ERROR,
+                            "Invalid field name requested",
+                            DONT_DELETE_MSG);
+}
+
+
+const char* CppSQLite3PagedTable::fieldName(int nCol) const
+{
+    checkResults();
+
+    if (nCol < 0 || nCol > mnCols-1)
+    {
+        throw CppSQLite3Exception(CPPSQLITE_ERROR,
+                                "Invalid field index requested",
+                                DONT_DELETE_MSG);
+    }
+
+    return mvNames[nCol].c_str();
+}
+
+
+const char* CppSQLite3PagedTable::fieldValue(int nField) const
+{
+    long long nOffset = mvCells[cell(nField)];
+    return nOffset < 0 ? 0 : &mvArena[static_cast<std::size_t>(nOffset)];
+}
+
+
+const char* CppSQLite3PagedTable::fieldValue(const char* szField) const
+{
+    return fieldValue(fieldIndex(szField));
+}
+
+
+int CppSQLite3PagedTable::getIntField(int nField, int nNullValue/*=0*/) const
+{
+    const char* szValue = fieldValue(nField);
+    return szValue ? static_cast<int>(parseInt64(szValue)) : nNullValue;
+}
+
+
+int CppSQLite3PagedTable::getIntField(const char* szField, int nNullValue/*=0*/) const
+{
+    return getIntField(fieldIndex(szField), nNullValue);
+}
+
+
+float CppSQLite3PagedTable::getFloatField(int nField, float fNullValue/*=0.0f*/) const
+{
+    const char* szValue = fieldValue(nField);
+    return szValue ? static_cast<float>(parseDouble(szValue)) : fNullValue;
+}
+
+
+float CppSQLite3PagedTable::getFloatField(const char* szField, float fNullValue/*=0.0f*/) const
+{
+    return getFloatField(fieldIndex(szField), fNullValue);
+}
+
+
+double CppSQLite3PagedTable::getDoubleField(int nField, double dNullValue/*=0.0*/) const
+{
+    const char* szValue = fieldValue(nField);
+    return szValue ? parseDouble(szValue) : dNullValue;
+}
+
+
+double CppSQLite3PagedTable::getDoubleField(const char* szField, double dNullValue/*=0.0*/) const
+{
+    return getDoubleField(fieldIndex(szField), dNullValue);
+}
+
+
+const char* CppSQLite3PagedTable::getStringField(int nField, const char* szNullValue/*=""*/) const
+{
+    const char* szValue = fieldValue(nField);
+    return szValue ? szValue : szNullValue;
+}
+
+
+const char* CppSQLite3PagedTable::getStringField(const char* szField, const char* szNullValue/*=""*/) const
+{
+    return getStringField(fieldIndex(szField), szNullValue);
+}
+
+
+std::string_view CppSQLite3PagedTable::getStringView(int nField, std::string_view szNullValue/*=std::string_view()*/) const
+{
+    std::size_t nCell = cell(nField);
+    long long nOffset = mvCells[nCell];
+    return nOffset < 0 ? szNullValue
+                       : std::string_view(&mvArena[static_cast<std::size_t>(nOffset)], mvLengths[nCell]);
+}
+
+
+std::string_view CppSQLite3PagedTable::getStringView(const char* szField, std::string_view szNullValue/*=std::string_view()*/) const
+{
+    return getStringView(fieldIndex(szField), szNullValue);
+}
+
+
+#if defined(__cpp_lib_span)
+std::span<const std::byte> CppSQLite3PagedTable::getBlobSpan(int nField) const
+{
+    std::string_view value = getStringView(nField);
+    return std::span<const std::byte>(reinterpret_cast<const std::byte*>(value.data()), value.size());
+}
+
+
+std::span<const std::byte> CppSQLite3PagedTable::getBlobSpan(const char* szField) const
+{
+    return getBlobSpan(fieldIndex(szField));
+}
+#endif
+
+
+bool CppSQLite3PagedTable::fieldIsNull(int nField) const
+{
+    return (fieldValue(nField) == 0);
+}
+
+
+bool CppSQLite3PagedTable::fieldIsNull(const char* szField) const
+{
+    return (fieldValue(szField) == 0);
+}
+
+
+void CppSQLite3PagedTable::setRow(int nRow)
+{
+    checkResults();
+
+    if (nRow < 0 || (mnRows >= 0 && nRow > mnRows-1))
+    {
+        throw CppSQLite3Exception(CPPSQLITE_ERROR,
+                                "Invalid row index requested",
+                                DONT_DELETE_MSG);
+    }
+
+    int nPage = nRow / mnPageSize;
+
+    if (nRow < mnPageStart)
+    {
+        seek(nPage);
+    }
+
+    while (nRow >= mnPageStart + mnPageRows)
+    {
+        if (!loadPage())
+        {
+            throw CppSQLite3Exception(CPPSQLITE_ERROR,
+                                    "Invalid row index requested",
+                                    DONT_DELETE_MSG);
+        }
+    }
+
+    mnCurrentRow = nRow;
+}
+
+
+void CppSQLite3PagedTable::finalize()
+{
+    mCursor.finalize();
+    mFirst.finalize();
+    mSeek.finalize();
+    mnCols = 0;
+    mnPageRows = 0;
+    std::vector<char>().swap(mvArena);
+    std::vector<long long>().swap(mvCells);
+    std::vector<std::size_t>().swap(mvLengths);
+    mvPageKeys.clear();
+}
+
+
+void CppSQLite3PagedTable::seek(int nPage)
+{
+    mCursor.finalize();
+
+    if (nPage == 0)
+    {
+        mFirst.reset();
+        mCursor = mFirst.execQuery();
+    }
+    else
+    {
+        // Continue after the last key of the page before
+        const Key& key = mvPageKeys[nPage-1];
+        mSeek.reset();
+
+        switch (key.nType)
+        {
+            case SQLITE_INTEGER : mSeek.bind(1, key.nValue); break;
+            case SQLITE_FLOAT   : mSeek.bind(1, key.dValue); break;
+            case SQLITE_BLOB    : mSeek.bind(1, reinterpret_cast<const unsigned char*>(key.sValue.data()),
+                                            static_cast<int>(key.sValue.size())); break;
+            // Copied, mvPageKeys may move the text as it grows
+            default             : mSeek.bind(1, std::string_view(key.sValue)); break;
+        }
+
+        mCursor = mSeek.execQuery();
+    }
+
+    mnCursorRow = nPage * mnPageSize;
+    mnPageStart = mnCursorRow;
+    mnPageRows = 0;
+}
+
+
+bool CppSQLite3PagedTable::loadPage()
+{
+    if (mCursor.eof())
+    {
+        mnRows = mnCursorRow;
+        return false;
+    }
+
+    mvArena.clear();
+    mvCells.clear();
+    mvLengths.clear();
+    mnPageStart = mnCursorRow;
+    mnPageRows = 0;
+
+    while (!mCursor.eof() && mnPageRows < mnPageSize)
+    {
+        for (int nCol = 0; nCol < mnCols; nCol++)
+        {
+            if (mCursor.fieldIsNull(nCol))
+            {
+                mvCells.push_back(-1);
+                mvLengths.push_back(0);
+            }
+            else
+            {
+                std::string_view value = mCursor.getStringView(nCol);
+                mvCells.push_back(static_cast<long long>(mvArena.size()));
+                mvLengths.push_back(value.size());
+                mvArena.insert(mvArena.end(), value.begin(), value.end());
+                mvArena.push_back('\0');
+            }
+        }
+
+        if (mnPageRows == mnPageSize-1)
+        {
+            // Remember where the page ends so it can be found again
+            int nPage = mnCursorRow / mnPageSize;
+
+            if (static_cast<int>(mvPageKeys.size()) <= nPage)
+            {
+                Key key;
+                key.nType = mCursor.fieldDataType(mnKeyCol);
+                key.nValue = mCursor.getInt64Field(mnKeyCol);
+                key.dValue = mCursor.getDoubleField(mnKeyCol);
+
+                if (key.nType == SQLITE_TEXT || key.nType == SQLITE_BLOB)
+                {
+                    int nLen;
+                    const unsigned char* pValue = mCursor.getBlobField(mnKeyCol, nLen);
+                    key.sValue.assign(reinterpret_cast<const char*>(pValue), nLen);
+                }
+
+                mvPageKeys.push_back(std::move(key));
+            }
+        }
+
+        mnPageRows++;
+        mnCursorRow++;
+        mCursor.nextRow();
+    }
+
+    if (mCursor.eof())
+    {
+        mnRows = mnCursorRow;
+    }
+
+    return mnPageRows > 0;
+}
+
+
+void CppSQLite3PagedTable::checkResults() const
+{
+    if (mnCols == 0)
+    {
+        throw CppSQLite3Exception(CPPSQLITE_ERROR,
+                                "Null Results pointer",
+                                DONT_DELETE_MSG);
+    }
+}
+
+
+std::size_t CppSQLite3PagedTable::cell(int nField) const
+{
+    checkResults();
+
+    if (nField < 0 || nField > mnCols-1)
+    {
+        throw CppSQLite3Exception(CPPSQLITE_ERROR,
+                                "Invalid field index requested",
+                                DONT_DELETE_MSG);
+    }
+
+    if (mnPageRows == 0)
+    {
+        throw CppSQLite3Exception(CPPSQLITE_ERROR,
+                                "Invalid row index requested",
+                                DONT_DELETE_MSG);
+    }
+
+    return static_cast<std::size_t>(mnCurrentRow - mnPageStart) * mnCols + nField;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+
+CppSQLite3Pool::Lease::Lease(CppSQLite3Pool* pPool, CppSQLite3DB* pDB, int nSlot) :
+    mpPool(pPool),
+    mpDB(pDB),
+    mnSlot(nSlot),
+    mtLeased(std::chrono::steady_clock::now())
+{
+}
+
+
+CppSQLite3Pool::Lease::Lease(Lease&& rLease) noexcept :
+    mpPool(rLease.mpPool),
+    mpDB(rLease.mpDB),
+    mnSlot(rLease.mnSlot),
+    mtLeased(rLease.mtLeased)
+{
+    rLease.mpDB = 0;
+}
+
+
+CppSQLite3Pool::Lease& CppSQLite3Pool::Lease::operator=(Lease&& rLease) noexcept
+{
+    if (this != &rLease)
+    {
+        release();
+        mpPool = rLease.mpPool;
+        mpDB = rLease.mpDB;
+        mnSlot = rLease.mnSlot;
+        mtLeased = rLease.mtLeased;
+        rLease.mpDB = 0;
+    }
+    return *this;
+}
+
+
+void CppSQLite3Pool::Lease::release() noexcept
+{
+    if (mpDB)
+    {
+        long long nBusyMicros = microsSince(mtLeased);
+
+        if (mnSlot < 0)
+        {
+            mpPool->releaseWriter(nBusyMicros);
+        }
+        else
+        {
+            mpPool->releaseReader(mnSlot, nBusyMicros);
+        }
+
+        mpDB = 0;
+    }
+}
+
+
+CppSQLite3Pool::CppSQLite3Pool(const char* szFile,
+                            int nReaders,
+                            std::function<void(CppSQLite3DB&)> fnConfigure/*=nullptr*/) :
+    CppSQLite3Pool(szFile, nReaders, CppSQLite3OpenOptions(), std::move(fnConfigure))
+{
+}
+
+
+CppSQLite3Pool::CppSQLite3Pool(const char* szFile,
+                            int nReaders,
+                            const CppSQLite3OpenOptions& options,
+                            std::function<void(CppSQLite3DB&)> fnConfigure/*=nullptr*/) :
+    mnReaders(nReaders > 0 ? nReaders : 1),
+    mpReaders(new Slot[nReaders > 0 ? nReaders : 1]),
+    mtCreated(std::chrono::steady_clock::now())
+{
+    CppSQLite3OpenOptions writerOptions = options;
+    writerOptions.bReadOnly = false;
+    writerOptions.bImmutable = false;
+    if (!writerOptions.nThreading)
+    {
+        writerOptions.nThreading = SQLITE_OPEN_NOMUTEX;
+    }
+
+    // Readers only run alongside the writer in WAL mode
+    writerOptions.profile.szJournalMode = "wal";
+
+    mWriter.open(szFile, writerOptions);
+    if (fnConfigure)
+    {
+        fnConfigure(mWriter);
+    }
+
+    CppSQLite3OpenOptions readerOptions = writerOptions;
+    readerOptions.profile.szJournalMode = 0;
+    readerOptions.profile.nPageSize.reset();
+
+    for (int nSlot = 0; nSlot < mnReaders; nSlot++)
+    {
+        CppSQLite3DB& db = mpReaders[nSlot].db;
+        db.open(szFile, readerOptions);
+        db.execDML("pragma query_only=1");
+        if (fnConfigure)
+        {
+            fnConfigure(db);
+        }
+    }
+}
+
+
+CppSQLite3Pool::Lease CppSQLite3Pool::reader()
+{
+    int nSlot = tryAcquireReader();
+
+    if (nSlot < 0)
+    {
+        std::chrono::steady_clock::time_point tStart = std::chrono::steady_clock::now();
+
+        std::unique_lock<std::mutex> lock(mMutex);
+        mnReaderWaiters++;
+        mReaderFree.wait(lock, [&] { return (nSlot = tryAcquireReader()) >= 0; });
+        mnReaderWaiters--;
+        lock.unlock();
+
+        mnReadWaits.fetch_add(1, std::memory_order_relaxed);
+        mnReadWaitMicros.fetch_add(microsSince(tStart), std::memory_order_relaxed);
+    }
+
+    mnReadLeases.fetch_add(1, std::memory_order_relaxed);
+    return Lease(this, &mpReaders[nSlot].db, nSlot);
+}
+
+
+CppSQLite3Pool::Lease CppSQLite3Pool::tryReader()
+{
+    int nSlot = tryAcquireReader();
+
+    if (nSlot < 0)
+    {
+        return Lease();
+    }
+
+    mnReadLeases.fetch_add(1, std::memory_order_relaxed);
+    return Lease(this, &mpReaders[nSlot].db, nSlot);
+}
+
+
+CppSQLite3Pool::Lease CppSQLite3Pool::tryWriter()
+{
+    // Takes a ticket only if it would be served at once, serving never
+    // passes the next ticket so an equal pair means nobody holds or waits
+    unsigned long long nServing = mnWriterServing.load();
+
+    if (!mnWriterTicket.compare_exchange_strong(nServing, nServing + 1))
+    {
+        return Lease();
+    }
+
+    mnWriteLeases.fetch_add(1, std::memory_order_relaxed);
+    return Lease(this, &mWriter, -1);
+}
+
+
+CppSQLite3Pool::Lease CppSQLite3Pool::writer()
+{
+    unsigned long long nTicket = mnWriterTicket.fetch_add(1);
+
+    if (mnWriterServing.load() != nTicket)
+    {
+        std::chrono::steady_clock::time_point tStart = std::chrono::steady_clock::now();
+
+        std::unique_lock<std::mutex> lock(mMutex);
+        mWriterFree.wait(lock, [&] { return mnWriterServing.load() == nTicket; });
+        lock.unlock();
+
+        mnWriteWaits.fetch_add(1, std::memory_order_relaxed);
+        mnWriteWaitMicros.fetch_add(microsSince(tStart), std::memory_order_relaxed);
+    }
+
+    mnWriteLeases.fetch_add(1, std::memory_order_relaxed);
+    return Lease(this, &mWriter, -1);
+}
+
+
+CppSQLite3PoolStats CppSQLite3Pool::stats() const
+{
+    CppSQLite3PoolStats stats;
+    stats.nReadLeases = mnReadLeases.load(std::memory_order_relaxed);
+    stats.nWriteLeases = mnWriteLeases.load(std::memory_order_relaxed);
+    stats.nReadWaits = mnReadWaits.load(std::memory_order_relaxed);
+    stats.nWriteWaits = mnWriteWaits.load(std::memory_order_relaxed);
+    stats.nReadWaitMicros = mnReadWaitMicros.load(std::memory_order_relaxed);
+    stats.nWriteWaitMicros = mnWriteWaitMicros.load(std::memory_order_relaxed);
+    stats.nReadBusyMicros = mnReadBusyMicros.load(std::memory_order_relaxed);
+    stats.nWriteBusyMicros = mnWriteBusyMicros.load(std::memory_order_relaxed);
+    stats.nUptimeMicros = microsSince(mtCreated);
+    stats.nReaders = mnReaders;
+    stats.nReadersInUse = 0;
+
+    for (int nSlot = 0; nSlot < mnReaders; nSlot++)
+    {
+        stats.nReadersInUse += mpReaders[nSlot].bBusy.load(std::memory_order_relaxed) ? 1 : 0;
+    }
+
+    return stats;
+}
+
+
+int CppSQLite3Pool::tryAcquireReader()
+{
+    unsigned int nStart = mnNextReader.fetch_add(1, std::memory_order_relaxed);
+
+    for (int n = 0; n < mnReaders; n++)
+    {
+        int nSlot = static_cast<int>((nStart + n) % mnReaders);
+        std::atomic<bool>& bBusy = mpReaders[nSlot].bBusy;
+
+        // Look before writing so busy slots are not bounced between cores
+        if (!bBusy.load(std::memory_order_relaxed) && !bBusy.exchange(true))
+        {
+            return nSlot;
+        }
+    }
+
+    return -1;
+}
+
+
+void CppSQLite3Pool::releaseReader(int nSlot, long long nBusyMicros) noexcept
+{
+    mnReadBusyMicros.fetch_add(nBusyMicros, std::memory_order_relaxed);
+    mpReaders[nSlot].bBusy.store(false);
+
+    // Both sides are sequentially consistent, so either the waiter sees
+    // the free slot or this sees the waiter
+    if (mnReaderWaiters.load() > 0)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mReaderFree.notify_one();
+    }
+}
+
+
+void CppSQLite3Pool::releaseWriter(long long nBusyMicros) noexcept
+{
+    mnWriteBusyMicros.fetch_add(nBusyMicros, std::memory_order_relaxed);
+    unsigned long long nServing = mnWriterServing.fetch_add(1) + 1;
+
+    if (mnWriterTicket.load() != nServing)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mWriterFree.notify_all();
+    }
+}
+
+
+long long CppSQLite3Pool::microsSince(std::chrono::steady_clock::time_point t)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t).count();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+
+CppSQLite3ParallelQuery::CppSQLite3ParallelQuery(CppSQLite3Pool& pool,
+                                                std::string_view szSQL,
+                                                std::string_view szBoundsSQL,
+                                                int nPartitions/*=0*/,
+                                                Mode eMode/*=SNAPSHOT*/) :
+    mPool(pool),
+    msSQL(szSQL),
+    msBoundsSQL(szBoundsSQL),
+    mnPartitions(nPartitions > 0 ? nPartitions : std::max(pool.numReaders(), 1)),
+    meMode(eMode),
+    mnLastReaders(0)
+{
+}
+
+
+void CppSQLite3ParallelQuery::run(const std::function<void(CppSQLite3Query&, int)>& fnPartition)
+{
+    CppSQLite3Pool::Lease lease = mPool.reader();
+    CppSQLite3DB& db = lease.db();
+
+    std::vector<Range> vRanges;
+    std::vector<std::future<void>> vWorkers;
+    std::atomic<int> nNext(0);
+    std::exception_ptr pError;
+
+    // Readers take the next partition until none are left, or one fails
+    auto work = [&](CppSQLite3DB& workerDB)
+    {
+        int nRanges = static_cast<int>(vRanges.size());
+
+        try
+        {
+            for (int n; (n = nNext.fetch_add(1)) < nRanges; )
+            {
+                runPartition(workerDB, vRanges[n], n, fnPartition);
+            }
+        }
+        catch (...)
+        {
+            nNext.store(nRanges);
+            throw;
+        }
+    };
+
+    // The read transaction on this connection covers the bounds and the
+    // partitions run here, and keeps the snapshot alive
+#if defined(SQLITE_ENABLE_SNAPSHOT)
+    sqlite3_snapshot* pSnapshot = 0;
+#endif
+    mnLastReaders = 1;
+    db.execDML("begin");
+
+    try
+    {
+        vRanges = split(db);
+
+        int nWorkers = 0;
+
+        if (meMode != SERIAL && vRanges.size() > 1)
+        {
+            nWorkers = std::min(mPool.numReaders(), static_cast<int>(vRanges.size())) - 1;
+        }
+
+        if (nWorkers > 0 && meMode == SNAPSHOT)
+        {
+#if defined(SQLITE_ENABLE_SNAPSHOT)
+            // Fails unless the database is in WAL mode
+            int nRet = sqlite3_snapshot_get(db.mpDB, "main", &pSnapshot);
+
+            if (nRet != SQLITE_OK)
+            {
+                throw CppSQLite3Exception(nRet, "Could not take a WAL snapshot", DONT_DELETE_MSG);
+            }
+#else
+            throw CppSQLite3Exception(CPPSQLITE_ERROR,
+                                    "WAL snapshots need SQLITE_ENABLE_SNAPSHOT, use INDEPENDENT or SERIAL",
+                                    DONT_DELETE_MSG);
+#endif
+        }
+
+        for (int i = 0; i < nWorkers; i++)
+        {
+            vWorkers.push_back(std::async(std::launch::async, [&]
+            {
+                CppSQLite3Pool::Lease worker = mPool.reader();
+
+                worker->execDML("begin");
+
+                try
+                {
+#if defined(SQLITE_ENABLE_SNAPSHOT)
+                    int nRet = pSnapshot ? sqlite3_snapshot_open(worker->mpDB, "main", pSnapshot) : SQLITE_OK;
+
+                    if (nRet != SQLITE_OK)
+                    {
+                        throw CppSQLite3Exception(nRet, "Could not open the WAL snapshot", DONT_DELETE_MSG);
+                    }
+#endif
+
+                    work(worker.db());
+                }
+                catch (...)
+                {
+                    rollback(worker.db());
+                    throw;
+                }
+
+                worker->execDML("commit");
+            }));
+        }
+
+        mnLastReaders = nWorkers + 1;
+        work(db);
+    }
+    catch (...)
+    {
+        pError = std::current_exception();
+        nNext.store(static_cast<int>(vRanges.size()));
+    }
+
+    for (std::future<void>& worker : vWorkers)
+    {
+        try
+        {
+            worker.get();
+        }
+        catch (...)
+        {
+            if (!pError)
+            {
+                pError = std::current_exception();
+            }
+        }
+    }
+
+#if defined(SQLITE_ENABLE_SNAPSHOT)
+    if (pSnapshot)
+    {
+        sqlite3_snapshot_free(pSnapshot);
+    }
+#endif
+
+    if (pError)
+    {
+        // The first error is the one reported
+        rollback(db);
+        std::rethrow_exception(pError);
+    }
+
+    db.execDML("commit");
+}
+
+
+void CppSQLite3ParallelQuery::rollback(CppSQLite3DB& db) noexcept
+{
+    try
+    {
+        if (db.inTransaction())
+        {
+            db.execDML("rollback");
+        }
+    }
+    catch (CppSQLite3Exception&)
+    {
+    }
+}
+
+
+std::vector<CppSQLite3ParallelQuery::Range> CppSQLite3ParallelQuery::split(CppSQLite3DB& db)
+{
+    std::vector<Range> vRanges;
+
+    CppSQLite3Query q = db.execQuery(msBoundsSQL);
+    checkColumns(q, 2);
+
+    if (q.eof() || q.fieldIsNull(0) || q.fieldIsNull(1))
+    {
+        return vRanges;
+    }
+
+    long long nLow = q.getInt64Field(0);
+    long long nHigh = q.getInt64Field(1);
+    q.finalize();
+
+    if (nHigh < nLow)
+    {
+        return vRanges;
+    }
+
+    // Keys in the range, less one, so the full 64 bit range still fits
+    unsigned long long nSpan = static_cast<unsigned long long>(nHigh) - static_cast<unsigned long long>(nLow);
+    unsigned long long nParts = static_cast<unsigned long long>(mnPartitions);
+
+    if (nSpan < nParts - 1)
+    {
+        nParts = nSpan + 1;
+    }
+
+    // The first nLonger partitions hold nStep+1 keys, the rest nStep.
+    // nStep+1 itself is never formed: it wraps to 0 for one partition
+    // over every key.
+    unsigned long long nStep = nSpan / nParts;
+    unsigned long long nLonger = nSpan % nParts + 1;
+
+    unsigned long long nFirst = static_cast<unsigned long long>(nLow);
+
+    for (unsigned long long n = 0; n < nParts; n++)
+    {
+        unsigned long long nLast = nFirst + nStep - (n < nLonger ? 0 : 1);
+        vRanges.push_back(Range{static_cast<long long>(nFirst), static_cast<long long>(nLast)});
+        nFirst = nLast + 1;
+    }
+
+    return vRanges;
+}
+
+
+void CppSQLite3ParallelQuery::runPartition(CppSQLite3DB& db,
+                                        const Range& range,
+                                        int nPartition,
+                                        const std::function<void(CppSQLite3Query&, int)>& fnPartition)
+{
+    CppSQLite3Statement stmt = db.compileStatement(msSQL);
+    stmt.bindAll(range.nLow, range.nHigh);
+
+    CppSQLite3Query q = stmt.execQuery();
+    fnPartition(q, nPartition);
+}
+
+
+void CppSQLite3ParallelQuery::checkColumns(CppSQLite3Query& q, int nCols)
+{
+    if (q.numFields() != nCols)
+    {
+        throw CppSQLite3Exception(CPPSQLITE_ERROR,
+                                "Column count does not match statement",
+                                DONT_DELETE_MSG);
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+
+CppSQLite3WriteQueue::CppSQLite3WriteQueue(CppSQLite3DB&& db,
+                                        int nMaxBatch/*=256*/,
+                                        std::chrono::microseconds maxLatency/*=5ms*/) :
+    mDB(std::move(db)),
+    mnMaxBatch(nMaxBatch > 0 ? nMaxBatch : 1),
+    mMaxLatency(maxLatency),
+    mbStop(false),
+    mnFlushWaiters(0),
+    mnSubmitted(0),
+    mnFinished(0),
+    mnFailed(0),
+    mnTransactions(0)
+{
+    mThread = std::thread(&CppSQLite3WriteQueue::writerLoop, this);
+}
+
+
+CppSQLite3WriteQueue::~CppSQLite3WriteQueue()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mbStop = true;
+    }
+    mHasWork.notify_one();
+    mThread.join();
+}
+
+
+void CppSQLite3WriteQueue::flush()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    long long nTarget = mnSubmitted;
+
+    // Close the current window early rather than wait out its latency
+    mnFlushWaiters++;
+    mHasWork.notify_one();
+    mFinished.wait(lock, [&] { return mnFinished >= nTarget; });
+    mnFlushWaiters--;
+}
+
+
+CppSQLite3WriteQueueStats CppSQLite3WriteQueue::stats() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    CppSQLite3WriteQueueStats stats;
+    stats.nSubmitted = mnSubmitted;
+    stats.nCommitted = mnFinished - mnFailed;
+    stats.nFailed = mnFailed;
+    stats.nTransactions = mnTransactions;
+    return stats;
+}
+
+
+void CppSQLite3WriteQueue::push(std::unique_ptr<Item> pItem)
+{
+    pItem->tSubmitted = std::chrono::steady_clock::now();
+    std::size_t nQueued;
+
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        if (mbStop)
+        {
+            throw CppSQLite3Exception(CPPSQLITE_ERROR,
+                                    "Write queue is stopped",
+                                    DONT_DELETE_MSG);
+        }
+
+        mQueue.push_back(std::move(pItem));
+        mnSubmitted++;
+        nQueued = mQueue.size();
+    }
+
+    // The writer only needs waking to start a window or to close a full one
+    if (nQueued == 1 || nQueued >= static_cast<std::size_t>(mnMaxBatch))
+    {
+        mHasWork.notify_one();
+    }
+}
+
+
+void CppSQLite3WriteQueue::writerLoop()
+{
+    std::vector<std::unique_ptr<Item>> vBatch;
+
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mHasWork.wait(lock, [&] { return mbStop || !mQueue.empty(); });
+
+            if (mQueue.empty())
+            {
+                return;
+            }
+
+            std::chrono::steady_clock::time_point tDeadline = mQueue.front()->tSubmitted + mMaxLatency;
+            mHasWork.wait_until(lock, tDeadline, [&]
+            {
+                return mbStop || mnFlushWaiters > 0 ||
+                       mQueue.size() >= static_cast<std::size_t>(mnMaxBatch);
+            });
+
+            while (!mQueue.empty() && vBatch.size() < static_cast<std::size_t>(mnMaxBatch))
+            {
+                vBatch.push_back(std::move(mQueue.front()));
+                mQueue.pop_front();
+            }
+        }
+
+        runBatch(vBatch);
+
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mnFinished += static_cast<long long>(vBatch.size());
+            mnTransactions++;
+        }
+        mFinished.notify_all();
+        vBatch.clear();
+    }
+}
+
+
+void CppSQLite3WriteQueue::runBatch(std::vector<std::unique_ptr<Item>>& vBatch)
+{
+    // Writes that succeeded, waiting for the commit
+    std::vector<Item*> vDone;
+    long long nFailed = 0;
+    bool bBegun = false;
+
+    for (std::unique_ptr<Item>& pItem : vBatch)
+    {
+        try
+        {
+            if (!bBegun)
+            {
+                mDB.execDML("begin immediate");
+                bBegun = true;
+            }
+
+            mDB.execDML("savepoint cppsqlite_write");
+            pItem->run(mDB);
+            mDB.execDML("release cppsqlite_write");
+            vDone.push_back(pItem.get());
+        }
+        catch (...)
+        {
+            std::exception_ptr e = std::current_exception();
+
+            if (mDB.inTransaction())
+            {
+                try
+                {
+                    mDB.execDML("rollback to cppsqlite_write");
+                    mDB.execDML("release cppsqlite_write");
+                }
+                catch (...)
+                {
+                }
+            }
+
+            pItem->fail(e);
+            nFailed++;
+
+            // Some errors roll back the whole transaction, taking the
+            // writes before this one with them
+            if (bBegun && !mDB.inTransaction())
+            {
+                for (Item* pDone : vDone)
+                {
+                    pDone->fail(e);
+                }
+                nFailed += static_cast<long long>(vDone.size());
+                vDone.clear();
+                bBegun = false;
+            }
+        }
+    }
+
+    if (bBegun)
+    {
+        try
+        {
+            mDB.execDML("commit");
+        }
+        catch (...)
+        {
+            std::exception_ptr e = std::current_exception();
+
+            try
+            {
+                mDB.execDML("rollback");
+            }
+            catch (...)
+            {
+            }
+
+            for (Item* pDone : vDone)
+            {
+                pDone->fail(e);
+            }
+            nFailed += static_cast<long long>(vDone.size());
+            vDone.clear();
+        }
+    }
+
+    for (Item* pDone : vDone)
+    {
+        pDone->commit();
+    }
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    mnFailed += nFailed;
+}
+
+
+#if defined(CPPSQLITE_HAS_COROUTINES)
+
+////////////////////////////////////////////////////////////////////////////////
+
+CppSQLite3RowStream::CppSQLite3RowStream(CppSQLite3AsyncDB* pAsync, int nBatchRows) :
+    mpAsync(pAsync),
+    mnRow(-1),
+    mnBatchRows(nBatchRows)
+{
+}
+
+
+CppSQLite3RowStream& CppSQLite3RowStream::operator=(CppSQLite3RowStream&& rStream) noexcept
+{
+    if (this != &rStream)
+    {
+        // The old query must be done before its reader goes back
+        release();
+        mpAsync = rStream.mpAsync;
+        mLease = std::move(rStream.mLease);
+        mStatement = std::move(rStream.mStatement);
+        mQuery = std::move(rStream.mQuery);
+        mRows = std::move(rStream.mRows);
+        mnRow = rStream.mnRow;
+        mnBatchRows = rStream.mnBatchRows;
+        mException = std::move(rStream.mException);
+    }
+    return *this;
+}
+
+
+CppSQLite3RowStream::~CppSQLite3RowStream()
+{
+    release();
+}
+
+
+void CppSQLite3RowStream::release() noexcept
+{
+    try
+    {
+        mQuery.finalize();
+        mStatement.finalize();
+    }
+    catch (CppSQLite3Exception&)
+    {
+    }
+
+    if (mLease)
+    {
+        mLease.release();
+        mpAsync->retryParked();
+    }
+}
+
+
+void CppSQLite3RowStream::fetch()
+{
+    mRows = CppSQLite3ResultSet();
+    mRows.reserve(mnBatchRows);
+    mRows.fetch(mQuery, mnBatchRows);
+    mnRow = -1;
+}
+
+
+bool CppSQLite3RowStream::Next::await_ready()
+{
+    // Rows left in the batch, or nothing more to step
+    return mpStream->mnRow + 1 < mpStream->mRows.numRows() || mpStream->mQuery.eof();
+}
+
+
+void CppSQLite3RowStream::Next::await_suspend(std::coroutine_handle<> hCoroutine)
+{
+    CppSQLite3RowStream* pStream = mpStream;
+
+    pStream->mpAsync->post([pStream, hCoroutine]
+    {
+        try
+        {
+            pStream->fetch();
+        }
+        catch (...)
+        {
+            pStream->mException = std::current_exception();
+        }
+
+        pStream->mpAsync->resume(hCoroutine);
+    });
+}
+
+
+bool CppSQLite3RowStream::Next::await_resume()
+{
+    if (mpStream->mException)
+    {
+        std::exception_ptr e = mpStream->mException;
+        mpStream->mException = nullptr;
+        std::rethrow_exception(e);
+    }
+
+    if (mpStream->mnRow + 1 >= mpStream->mRows.numRows())
+    {
+        return false;
+    }
+
+    mpStream->mRows.setRow(++mpStream->mnRow);
+    return true;
+}
+
+
+CppSQLite3AsyncDB::CppSQLite3AsyncDB(CppSQLite3Pool& pool,
+                                    int nThreads/*=0*/,
+                                    std::function<void(std::coroutine_handle<>)> fnResume/*=nullptr*/) :
+    mPool(pool),
+    mnBatchRows(256),
+    mfnResume(std::move(fnResume)),
+    mbStop(false)
+{
+    if (nThreads <= 0)
+    {
+        nThreads = pool.numReaders() + 1;
+    }
+
+    for (int n = 0; n < nThreads; n++)
+    {
+        mvThreads.emplace_back(&CppSQLite3AsyncDB::workerLoop, this);
+    }
+}
+
+
+CppSQLite3AsyncDB::~CppSQLite3AsyncDB()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mbStop = true;
+    }
+    mHasWork.notify_all();
+
+    for (std::thread& thread : mvThreads)
+    {
+        thread.join();
+    }
+}
+
+
+CppSQLite3Awaitable<int> CppSQLite3AsyncDB::execDML(CppSQLite3Statement& stmt)
+{
+    return CppSQLite3Awaitable<int>(this, [&stmt] { return stmt.execDML(); });
+}
+
+
+CppSQLite3Awaitable<CppSQLite3RowStream> CppSQLite3AsyncDB::execQuery(CppSQLite3Statement& stmt)
+{
+    return CppSQLite3Awaitable<CppSQLite3RowStream>(this, [this, &stmt]
+    {
+        CppSQLite3RowStream stream(this, mnBatchRows);
+        stream.mQuery = stmt.execQuery();
+        stream.fetch();
+        return stream;
+    });
+}
+
+
+void CppSQLite3AsyncDB::post(std::function<void()> fnJob)
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mJobs.push_back(std::move(fnJob));
+    }
+    mHasWork.notify_one();
+}
+
+
+void CppSQLite3AsyncDB::postRead(std::function<void(CppSQLite3Pool::Lease)> fnJob)
+{
+    post([this, fnJob = std::move(fnJob)] { tryRead(fnJob); });
+}
+
+
+void CppSQLite3AsyncDB::postWrite(std::function<void(CppSQLite3Pool::Lease)> fnJob)
+{
+    post([this, fnJob = std::move(fnJob)] { tryWrite(fnJob); });
+}
+
+
+void CppSQLite3AsyncDB::retryParked()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        if (mParked.empty())
+        {
+            return;
+        }
+
+        for (std::function<void()>& fnRetry : mParked)
+        {
+            mJobs.push_back(std::move(fnRetry));
+        }
+        mParked.clear();
+    }
+    mHasWork.notify_all();
+}
+
+
+void CppSQLite3AsyncDB::tryRead(std::function<void(CppSQLite3Pool::Lease)> fnJob)
+{
+    CppSQLite3Pool::Lease lease = mPool.tryReader();
+
+    if (!lease)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        if (!mbStop)
+        {
+            mParked.push_back([this, fnJob = std::move(fnJob)] { tryRead(fnJob); });
+            return;
+        }
+    }
+
+    fnJob(std::move(lease));
+}
+
+
+void CppSQLite3AsyncDB::tryWrite(std::function<void(CppSQLite3Pool::Lease)> fnJob)
+{
+    CppSQLite3Pool::Lease lease = mPool.tryWriter();
+
+    if (!lease)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        if (!mbStop)
+        {
+            mParked.push_back([this, fnJob = std::move(fnJob)] { tryWrite(fnJob); });
+            return;
+        }
+    }
+
+    fnJob(std::move(lease));
+    // In case the job ended without handing the writer back itself
+    retryParked();
+}
+
+
+void CppSQLite3AsyncDB::resume(std::coroutine_handle<> hCoroutine)
+{
+    if (mfnResume)
+    {
+        mfnResume(hCoroutine);
+    }
+    else
+    {
+        hCoroutine.resume();
+    }
+}
+
+
+void CppSQLite3AsyncDB::workerLoop()
+{
+    for (;;)
+    {
+        std::function<void()> fnJob;
+
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+
+            while (mJobs.empty())
+            {
+                if (!mParked.empty())
+                {
+                    // Connections returned by other users of the pool are
+                    // not signalled, so parked jobs are retried now and then
+                    if (mbStop ||
+                        !mHasWork.wait_for(lock, std::chrono::milliseconds(1), [&] { return !mJobs.empty(); }))
+                    {
+                        for (std::function<void()>& fnRetry : mParked)
+                        {
+                            mJobs.push_back(std::move(fnRetry));
+                        }
+                        mParked.clear();
+                    }
+                }
+                else if (mbStop)
+                {
+                    return;
+                }
+                else
+                {
+                    mHasWork.wait(lock);
+                }
+            }
+
+            fnJob = std::move(mJobs.front());
+            mJobs.pop_front();
+        }
+
+        fnJob();
+    }
+}
+
+#endif
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Size-class pool allocator for CppSQLite3Runtime::installAllocator(). Each
+// block has an 8 byte header holding its class. Classes are 16 bytes apart
+// up to 128, then four to each power of two up to 64K. Threads keep a few
+// free blocks of each class and trade them with the shared lists in batches.
+////////////////////////////////////////////////////////////////////////////////
+
+namespace detail
+{
+
+struct PoolHeader
+{
+    std::uint32_t nClass;
+    // Requested size, for large blocks
+    std::uint32_t nSize;
+};
+
+struct PoolBlock
+{
+    PoolBlock* pNext;
+};
+
+static const int POOL_CLASSES = 44;
+static const std::size_t POOL_MAX_BLOCK = 65536;
+static const std::uint32_t POOL_LARGE = 0xffffffff;
+
+
+static int poolClass(std::size_t nBytes)
+{
+    if (nBytes <= 128)
+    {
+        return static_cast<int>((nBytes + 15) / 16) - 1;
+    }
+
+    int nLog = 0;
+    for (std::size_t n = nBytes - 1; n > 1; n >>= 1)
+    {
+        nLog++;
+    }
+
+    return 8 + (nLog - 7) * 4 + static_cast<int>((nBytes - 1) >> (nLog - 2)) - 4;
+}
+
+
+static std::size_t poolClassSize(int nClass)
+{
+    if (nClass < 8)
+    {
+        return static_cast<std::size_t>(nClass + 1) * 16;
+    }
+
+    int nGroup = (nClass - 8) / 4;
+    int nStep = (nClass - 8) % 4;
+    return (std::size_t(1) << (7 + nGroup)) + (nStep + 1) * (std::size_t(1) << (5 + nGroup));
+}
+
+
+// Blocks moved between a thread and the shared list at a time
+static int poolBatch(int nClass)
+{
+    return static_cast<int>(std::max<std::size_t>(2, std::min<std::size_t>(64, 16384 / poolClassSize(nClass))));
+}
+
+
+struct PoolClass
+{
+    std::mutex mutex;
+    PoolBlock* pFree = nullptr;
+    long long nFree = 0;
+    std::atomic<long long> nBlocks{0};
+};
+
+
+struct PoolThreadCache;
+
+class PoolAllocator
+{
+public:
+
+    // Never destroyed, SQLite may free memory during static destruction
+    static PoolAllocator& instance()
+    {
+        static PoolAllocator* pInstance = new PoolAllocator();
+        return *pInstance;
+    }
+
+    void* allocate(int nBytes);
+    void release(void* p);
+    void* reallocate(void* p, int nBytes);
+    int size(void* p) const;
+    int roundup(int nBytes) const;
+
+    // Fills the thread cache list of nClass, false when out of memory
+    bool refill(PoolThreadCache& cache, int nClass);
+    // Gives back a batch from a thread cache list that has grown too long
+    void drain(PoolThreadCache& cache, int nClass, int nKeep);
+
+    void attach(PoolThreadCache* pCache);
+    void detach(PoolThreadCache* pCache);
+
+    CppSQLite3AllocatorStats stats();
+
+private:
+
+    // Carves a new span into blocks, under the class mutex
+    bool grow(int nClass);
+    PoolBlock* takeShared(int nClass);
+    void giveShared(int nClass, PoolBlock* pFirst, PoolBlock* pLast, int nCount);
+
+    PoolClass maClasses[POOL_CLASSES];
+
+    // Live thread caches, and the counts of those that have exited or
+    // of threads past their cache
+    std::mutex mThreadsMutex;
+    std::vector<PoolThreadCache*> mvThreads;
+    std::atomic<long long> maRetiredAllocs[POOL_CLASSES] = {};
+    std::atomic<long long> maRetiredFrees[POOL_CLASSES] = {};
+
+    std::atomic<long long> mnLargeAllocs{0};
+    std::atomic<long long> mnLargeFrees{0};
+    std::atomic<long long> mnLargeBytes{0};
+    std::atomic<long long> mnPoolBytes{0};
+};
+
+
+struct PoolThreadCache
+{
+    PoolThreadCache() { PoolAllocator::instance().attach(this); }
+    ~PoolThreadCache();
+
+    PoolBlock* apFree[POOL_CLASSES] = {};
+    int anFree[POOL_CLASSES] = {};
+    // Only written by the owning thread, read by stats()
+    std::atomic<long long> anAllocs[POOL_CLASSES] = {};
+    std::atomic<long long> anFrees[POOL_CLASSES] = {};
+};
+
+
+static thread_local bool tbPoolCacheGone = false;
+
+static PoolThreadCache* poolThreadCache()
+{
+    // Frees from later thread_local destructors go to the shared lists
+    if (tbPoolCacheGone)
+    {
+        return nullptr;
+    }
+
+    static thread_local PoolThreadCache cache;
+    return &cache;
+}
+
+
+PoolThreadCache::~PoolThreadCache()
+{
+    PoolAllocator::instance().detach(this);
+    tbPoolCacheGone = true;
+}
+
+
+static void bump(std::atomic<long long>& nCount)
+{
+    nCount.store(nCount.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+
+void* PoolAllocator::allocate(int nBytes)
+{
+    std::size_t nTotal = sizeof(PoolHeader) + static_cast<std::size_t>(nBytes > 0 ? nBytes : 1);
+
+    if (nTotal > POOL_MAX_BLOCK)
+    {
+        PoolHeader* pHeader = static_cast<PoolHeader*>(malloc(nTotal));
+        if (!pHeader)
+        {
+            return 0;
+        }
+
+        pHeader->nClass = POOL_LARGE;
+        pHeader->nSize = static_cast<std::uint32_t>(nBytes);
+        mnLargeAllocs.fetch_add(1, std::memory_order_relaxed);
+        mnLargeBytes.fetch_add(nBytes, std::memory_order_relaxed);
+        return pHeader + 1;
+    }
+
+    int nClass = poolClass(nTotal);
+    PoolThreadCache* pCache = poolThreadCache();
+    PoolBlock* pBlock;
+
+    if (pCache)
+    {
+        if (!pCache->apFree[nClass] && !refill(*pCache, nClass))
+        {
+            return 0;
+        }
+
+        pBlock = pCache->apFree[nClass];
+        pCache->apFree[nClass] = pBlock->pNext;
+        pCache->anFree[nClass]--;
+        bump(pCache->anAllocs[nClass]);
+    }
+    else
+    {
+        pBlock = takeShared(nClass);
+        if (!pBlock)
+        {
+            return 0;
+        }
+
+        maRetiredAllocs[nClass].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    PoolHeader* pHeader = reinterpret_cast<PoolHeader*>(pBlock);
+    pHeader->nClass = static_cast<std::uint32_t>(nClass);
+    pHeader->nSize = static_cast<std::uint32_t>(nBytes);
+    return pHeader + 1;
+}
+
+
+void PoolAllocator::release(void* p)
+{
+    if (!p)
+    {
+        return;
+    }
+
+    PoolHeader* pHeader = static_cast<PoolHeader*>(p) - 1;
+
+    if (pHeader->nClass == POOL_LARGE)
+    {
+        mnLargeFrees.fetch_add(1, std::memory_order_relaxed);
+        mnLargeBytes.fetch_sub(pHeader->nSize, std::memory_order_relaxed);
+        free(pHeader);
+        return;
+    }
+
+    int nClass = static_cast<int>(pHeader->nClass);
+    PoolBlock* pBlock = reinterpret_cast<PoolBlock*>(pHeader);
+    PoolThreadCache* pCache = poolThreadCache();
+
+    if (pCache)
+    {
+        pBlock->pNext = pCache->apFree[nClass];
+        pCache->apFree[nClass] = pBlock;
+        bump(pCache->anFrees[nClass]);
+
+        int nBatch = poolBatch(nClass);
+        if (++pCache->anFree[nClass] > 2 * nBatch)
+        {
+            drain(*pCache, nClass, nBatch);
+        }
+    }
+    else
+    {
+        giveShared(nClass, pBlock, pBlock, 1);
+        maRetiredFrees[nClass].fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+
+void* PoolAllocator::reallocate(void* p, int nBytes)
+{
+    PoolHeader* pHeader = static_cast<PoolHeader*>(p) - 1;
+    std::size_t nTotal = sizeof(PoolHeader) + static_cast<std::size_t>(nBytes > 0 ? nBytes : 1);
+
+    // Stay in place while the size class is unchanged
+    if (pHeader->nClass != POOL_LARGE &&
+        nTotal <= POOL_MAX_BLOCK &&
+        poolClass(nTotal) == static_cast<int>(pHeader->nClass))
+    {
+        pHeader->nSize = static_cast<std::uint32_t>(nBytes);
+        return p;
+    }
+
+    void* pNew = allocate(nBytes);
+    if (pNew)
+    {
+        memcpy(pNew, p, std::min(size(p), nBytes));
+        release(p);
+    }
+    return pNew;
+}
+
+
+int PoolAllocator::size(void* p) const
+{
+    const PoolHeader* pHeader = static_cast<const PoolHeader*>(p) - 1;
+
+    if (pHeader->nClass == POOL_LARGE)
+    {
+        return static_cast<int>(pHeader->nSize);
+    }
+
+    return static_cast<int>(poolClassSize(static_cast<int>(pHeader->nClass)) - sizeof(PoolHeader));
+}
+
+
+int PoolAllocator::roundup(int nBytes) const
+{
+    std::size_t nTotal = sizeof(PoolHeader) + static_cast<std::size_t>(nBytes > 0 ? nBytes : 1);
+
+    if (nTotal > POOL_MAX_BLOCK)
+    {
+        return (nBytes + 7) & ~7;
+    }
+
+    return static_cast<int>(poolClassSize(poolClass(nTotal)) - sizeof(PoolHeader));
+}
+
+
+bool PoolAllocator::refill(PoolThreadCache& cache, int nClass)
+{
+    PoolClass& shared = maClasses[nClass];
+    int nBatch = poolBatch(nClass);
+
+    std::lock_guard<std::mutex> lock(shared.mutex);
+
+    if (!shared.pFree && !grow(nClass))
+    {
+        return false;
+    }
+
+    while (shared.pFree && cache.anFree[nClass] < nBatch)
+    {
+        PoolBlock* pBlock = shared.pFree;
+        shared.pFree = pBlock->pNext;
+        shared.nFree--;
+
+        pBlock->pNext = cache.apFree[nClass];
+        cache.apFree[nClass] = pBlock;
+        cache.anFree[nClass]++;
+    }
+
+    return true;
 }
 
 
-void CppSQLite3Statement::bind(int nParam, const double dValue)
+void PoolAllocator::drain(PoolThreadCache& cache, int nClass, int nKeep)
 {
-    checkVM();
-    int nRes = sqlite3_bind_double(mpVM, nParam, dValue);
+    int nGive = cache.anFree[nClass] - nKeep;
+    if (nGive <= 0)
+    {
+        return;
+    }
 
-    if (nRes != SQLITE_OK)
+    PoolBlock* pFirst = cache.apFree[nClass];
+    PoolBlock* pLast = pFirst;
+    for (int i = 1; i < nGive; i++)
     {
-        throw CppSQLite3Exception(nRes,
-                                "Error binding double param",
-                                DONT_DELETE_MSG);
+        pLast = pLast->pNext;
     }
+
+    cache.apFree[nClass] = pLast->pNext;
+    cache.anFree[nClass] = nKeep;
+    giveShared(nClass, pFirst, pLast, nGive);
 }
 
 
-void CppSQLite3Statement::bind(int nParam, const unsigned char* blobValue, int nLen)
+void PoolAllocator::attach(PoolThreadCache* pCache)
 {
-    checkVM();
-    int nRes = sqlite3_bind_blob(mpVM, nParam,
-                                (const void*)blobValue, nLen, SQLITE_TRANSIENT);
-
-    if (nRes != SQLITE_OK)
-    {
-        throw CppSQLite3Exception(nRes,
-                                "Error binding blob param",
-                                DONT_DELETE_MSG);
-    }
+    std::lock_guard<std::mutex> lock(mThreadsMutex);
+    mvThreads.push_back(pCache);
 }
 
 
-void CppSQLite3Statement::bindNull(int nParam)
+void PoolAllocator::detach(PoolThreadCache* pCache)
 {
-    checkVM();
-    int nRes = sqlite3_bind_null(mpVM, nParam);
+    for (int nClass = 0; nClass < POOL_CLASSES; nClass++)
+    {
+        drain(*pCache, nClass, 0);
+    }
 
-    if (nRes != SQLITE_OK)
+    std::lock_guard<std::mutex> lock(mThreadsMutex);
+
+    for (int nClass = 0; nClass < POOL_CLASSES; nClass++)
     {
-        throw CppSQLite3Exception(nRes,
-                                "Error binding NULL param",
-                                DONT_DELETE_MSG);
+        maRetiredAllocs[nClass].fetch_add(pCache->anAllocs[nClass].load(), std::memory_order_relaxed);
+        maRetiredFrees[nClass].fetch_add(pCache->anFrees[nClass].load(), std::memory_order_relaxed);
     }
+
+    mvThreads.erase(std::find(mvThreads.begin(), mvThreads.end(), pCache));
 }
 
 
-void CppSQLite3Statement::reset()
+CppSQLite3AllocatorStats PoolAllocator::stats()
 {
-    if (mpVM)
+    CppSQLite3AllocatorStats stats;
+    stats.vClasses.resize(POOL_CLASSES);
+
     {
-        int nRet = sqlite3_reset(mpVM);
+        std::lock_guard<std::mutex> lock(mThreadsMutex);
 
-        if (nRet != SQLITE_OK)
+        for (int nClass = 0; nClass < POOL_CLASSES; nClass++)
         {
-            const char* szError = sqlite3_errmsg(mpDB);
-            throw CppSQLite3Exception(nRet, (char*)szError, DONT_DELETE_MSG);
+            CppSQLite3SizeClassStats& classStats = stats.vClasses[nClass];
+            classStats.nSize = static_cast<int>(poolClassSize(nClass));
+            classStats.nAllocs = maRetiredAllocs[nClass].load(std::memory_order_relaxed);
+            classStats.nFrees = maRetiredFrees[nClass].load(std::memory_order_relaxed);
+
+            for (PoolThreadCache* pCache : mvThreads)
+            {
+                classStats.nAllocs += pCache->anAllocs[nClass].load(std::memory_order_relaxed);
+                classStats.nFrees += pCache->anFrees[nClass].load(std::memory_order_relaxed);
+            }
         }
     }
+
+    for (int nClass = 0; nClass < POOL_CLASSES; nClass++)
+    {
+        PoolClass& shared = maClasses[nClass];
+        std::lock_guard<std::mutex> lock(shared.mutex);
+        stats.vClasses[nClass].nBlocks = shared.nBlocks.load(std::memory_order_relaxed);
+        stats.vClasses[nClass].nSharedFree = shared.nFree;
+    }
+
+    stats.nLargeAllocs = mnLargeAllocs.load(std::memory_order_relaxed);
+    stats.nLargeFrees = mnLargeFrees.load(std::memory_order_relaxed);
+    stats.nLargeBytes = mnLargeBytes.load(std::memory_order_relaxed);
+    stats.nPoolBytes = mnPoolBytes.load(std::memory_order_relaxed);
+    return stats;
 }
 
 
-void CppSQLite3Statement::finalize()
+bool PoolAllocator::grow(int nClass)
 {
-    if (mpVM)
+    std::size_t nSize = poolClassSize(nClass);
+    std::size_t nCount = std::max<std::size_t>(POOL_MAX_BLOCK / nSize, 2 * poolBatch(nClass));
+    char* pSpan = static_cast<char*>(malloc(nSize * nCount));
+
+    if (!pSpan)
     {
-        int nRet = sqlite3_finalize(mpVM);
-        mpVM = 0;
+        return false;
+    }
 
-        if (nRet != SQLITE_OK)
-        {
-            const char* szError = sqlite3_errmsg(mpDB);
-            throw CppSQLite3Exception(nRet, (char*)szError, DONT_DELETE_MSG);
-        }
+    PoolClass& shared = maClasses[nClass];
+
+    for (std::size_t i = 0; i < nCount; i++)
+    {
+        PoolBlock* pBlock = reinterpret_cast<PoolBlock*>(pSpan + i * nSize);
+        pBlock->pNext = shared.pFree;
+        shared.pFree = pBlock;
     }
+
+    shared.nFree += static_cast<long long>(nCount);
+    shared.nBlocks.fetch_add(static_cast<long long>(nCount), std::memory_order_relaxed);
+    mnPoolBytes.fetch_add(static_cast<long long>(nSize * nCount), std::memory_order_relaxed);
+    return true;
 }
 
 
-void CppSQLite3Statement::checkDB() const
+PoolBlock* PoolAllocator::takeShared(int nClass)
 {
-    if (mpDB == 0)
+    PoolClass& shared = maClasses[nClass];
+    std::lock_guard<std::mutex> lock(shared.mutex);
+
+    if (!shared.pFree && !grow(nClass))
     {
-        throw CppSQLite3Exception(CPPSQLITE_ERROR,
-                                "Database not open",
-                                DONT_DELETE_MSG);
+        return 0;
     }
+
+    PoolBlock* pBlock = shared.pFree;
+    shared.pFree = pBlock->pNext;
+    shared.nFree--;
+    return pBlock;
 }
 
 
-void CppSQLite3Statement::checkVM() const
+void PoolAllocator::giveShared(int nClass, PoolBlock* pFirst, PoolBlock* pLast, int nCount)
 {
-    if (mpVM == 0)
+    PoolClass& shared = maClasses[nClass];
+    std::lock_guard<std::mutex> lock(shared.mutex);
+
+    pLast->pNext = shared.pFree;
+    shared.pFree = pFirst;
+    shared.nFree += nCount;
+}
+
+} // namespace detail
+
+
+void CppSQLite3Runtime::installAllocator(bool bMemStatus/*=true*/)
+{
+    static const sqlite3_mem_methods methods =
     {
-        throw CppSQLite3Exception(CPPSQLITE_ERROR,
-                                "Null Virtual Machine pointer",
+        [](int nBytes) { return detail::PoolAllocator::instance().allocate(nBytes); },
+        [](void* p) { detail::PoolAllocator::instance().release(p); },
+        [](void* p, int nBytes) { return detail::PoolAllocator::instance().reallocate(p, nBytes); },
+        [](void* p) { return detail::PoolAllocator::instance().size(p); },
+        [](int nBytes) { return detail::PoolAllocator::instance().roundup(nBytes); },
+        [](void*) { return SQLITE_OK; },
+        [](void*) {},
+        0
+    };
+
+    int nRet = sqlite3_config(SQLITE_CONFIG_MEMSTATUS, bMemStatus ? 1 : 0);
+
+    if (nRet != SQLITE_OK)
+    {
+        throw CppSQLite3Exception(nRet,
+                                "Allocator must be installed before SQLite is initialised",
                                 DONT_DELETE_MSG);
     }
-}
 
+    installAllocator(methods);
+}
 
-////////////////////////////////////////////////////////////////////////////////
 
-CppSQLite3DB::CppSQLite3DB()
+void CppSQLite3Runtime::installAllocator(const sqlite3_mem_methods& methods)
 {
-    mpDB = 0;
-    mnBusyTimeoutMs = 60000; // 60 seconds
+    int nRet = sqlite3_config(SQLITE_CONFIG_MALLOC, &methods);
+
+    if (nRet != SQLITE_OK)
+    {
+        throw CppSQLite3Exception(nRet,
+                                "Allocator must be installed before SQLite is initialised",
+                                DONT_DELETE_MSG);
+    }
 }
 
 
-CppSQLite3DB::CppSQLite3DB(const CppSQLite3DB& db)
+CppSQLite3AllocatorStats CppSQLite3Runtime::allocatorStats()
 {
-    mpDB = db.mpDB;
-    mnBusyTimeoutMs = 60000; // 60 seconds
+    return detail::PoolAllocator::instance().stats();
 }
 
 
-CppSQLite3DB::~CppSQLite3DB()
+////////////////////////////////////////////////////////////////////////////////
+// Kernels for sqlite3_encode_binary() and sqlite3_decode_binary(). On x86-64
+// the SSE2 or AVX2 version is picked at run time, elsewhere or when built with
+// CPPSQLITE_NO_SIMD the portable versions are used. Every version produces
+// exactly the output of the original encode.c loops.
+////////////////////////////////////////////////////////////////////////////////
+
+// Second byte of the escape for each value after the offset, 0 if none
+static const unsigned char* binaryEscapes()
 {
-    close();
+    static const struct Table
+    {
+        unsigned char code[256];
+        Table() : code()
+        {
+            code[0] = 1;
+            code[1] = 2;
+            code['\''] = 3;
+        }
+    } table;
+    return table.code;
 }
 
 
-CppSQLite3DB& CppSQLite3DB::operator=(const CppSQLite3DB& db)
+// Value of each byte following an escape, 0x100 marks a malformed escape
+static const unsigned short* binaryUnescapes()
 {
-    mpDB = db.mpDB;
-    mnBusyTimeoutMs = 60000; // 60 seconds
-    return *this;
+    static const struct Table
+    {
+        unsigned short value[256];
+        Table()
+        {
+            for (int i = 0; i < 256; i++)
+            {
+                value[i] = 0x100;
+            }
+            value[1] = 0;
+            value[2] = 1;
+            value[3] = '\'';
+        }
+    } table;
+    return table.value;
 }
 
 
-void CppSQLite3DB::open(const char* szFile)
+// Adds the byte counts of in to cnt
+static void binaryHistogram(const unsigned char* in, int n, int* cnt)
 {
-    int nRet = sqlite3_open(szFile, &mpDB);
+    // Four tables so runs of one byte value do not serialise on one counter
+    int part[4][256];
+    std::memset(part, 0, sizeof(part));
 
-    if (nRet != SQLITE_OK)
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
     {
-        const char* szError = sqlite3_errmsg(mpDB);
-        throw CppSQLite3Exception(nRet, (char*)szError, DONT_DELETE_MSG);
+        part[0][in[i]]++;
+        part[1][in[i+1]]++;
+        part[2][in[i+2]]++;
+        part[3][in[i+3]]++;
+    }
+    for (; i < n; i++)
+    {
+        part[0][in[i]]++;
     }
 
-    setBusyTimeout(mnBusyTimeoutMs);
+    for (int c = 0; c < 256; c++)
+    {
+        cnt[c] += part[0][c] + part[1][c] + part[2][c] + part[3][c];
+    }
 }
 
 
-void CppSQLite3DB::close()
+// Encodes in[i..n) into out[j..). Writes one byte beyond the last
+// escape-free byte, so out needs room for one more.
+static int encodeBinaryScalar(const unsigned char* in, int i, int n, unsigned char* out, int j, int e)
 {
-    if (mpDB)
+    const unsigned char* escapes = binaryEscapes();
+
+    for (; i < n; i++)
     {
-        sqlite3_close(mpDB);
-        mpDB = 0;
+        unsigned char c = static_cast<unsigned char>(in[i] - e);
+        unsigned char code = escapes[c];
+        out[j] = code ? 1 : c;
+        out[j+1] = code;
+        j += code ? 2 : 1;
     }
+
+    return j;
 }
 
 
-CppSQLite3Statement CppSQLite3DB::compileStatement(const char* szSQL)
+// Decodes in[i..nEnd) into out[j..), reading one byte further when in[nEnd-1]
+// starts an escape, which the terminator makes safe. Malformed escapes set
+// 0x100 in nBad. Returns the new output position.
+static int decodeBinaryScalar(const unsigned char* in, int& i, int nEnd, unsigned char* out, int j, int e, unsigned int& nBad)
 {
-    checkDB();
+    const unsigned short* unescapes = binaryUnescapes();
 
-    sqlite3_stmt* pVM = compile(szSQL);
-    return CppSQLite3Statement(mpDB, pVM);
-}
+    // Stores to out may alias i and nBad, which would then be reloaded for
+    // every byte, so the loop works on local pointers
+    const unsigned char* pIn = in + i;
+    const unsigned char* pEnd = in + nEnd;
+    unsigned char* pOut = out + j;
+    unsigned int nFlags = 0;
 
+    while (pIn < pEnd)
+    {
+        unsigned int c = *pIn++;
+        if (c == 1)
+        {
+            c = unescapes[*pIn++];
+            nFlags |= c;
+        }
+        *pOut++ = static_cast<unsigned char>(c + e);
+    }
 
-bool CppSQLite3DB::tableExists(const char* szTable)
-{
-    CppSQLite3Buffer sql;
-    sql.format( "select count(*) from sqlite_master where type='table' and name=%Q",
-                szTable );
-    int nRet = execScalar(sql);
-    return (nRet > 0);
+    i = static_cast<int>(pIn - in);
+    nBad |= nFlags;
+    return static_cast<int>(pOut - out);
 }
 
 
-int CppSQLite3DB::execDML(const char* szSQL)
-{
-    checkDB();
+#if defined(CPPSQLITE_X86_SIMD)
 
-    char* szError=0;
+static int encodeBinarySSE2(const unsigned char* in, int n, unsigned char* out, int e)
+{
+    const __m128i vOffset = _mm_set1_epi8(static_cast<char>(e));
+    const __m128i vOne = _mm_set1_epi8(1);
+    const __m128i vQuote = _mm_set1_epi8('\'');
 
-    int nRet = sqlite3_exec(mpDB, szSQL, 0, 0, &szError);
+    int i = 0;
+    int j = 0;
 
-    if (nRet == SQLITE_OK)
+    for (; i + 16 <= n; i += 16)
     {
-        return sqlite3_changes(mpDB);
-    }
-    else
-    {
-        throw CppSQLite3Exception(nRet, szError);
+        __m128i c = _mm_sub_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i)), vOffset);
+        // c <= 1 is min(c, 1) == c
+        __m128i vEscape = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(c, vOne), c),
+                                       _mm_cmpeq_epi8(c, vQuote));
+
+        if (_mm_movemask_epi8(vEscape) == 0)
+        {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + j), c);
+            j += 16;
+        }
+        else
+        {
+            j = encodeBinaryScalar(in, i, i + 16, out, j, e);
+        }
     }
+
+    return encodeBinaryScalar(in, i, n, out, j, e);
 }
 
 
-CppSQLite3Query CppSQLite3DB::execQuery(const char* szSQL)
+static int decodeBinarySSE2(const unsigned char* in, int n, unsigned char* out, int e, int* pnRead)
 {
-    checkDB();
+    const __m128i vOffset = _mm_set1_epi8(static_cast<char>(e));
+    const __m128i vOne = _mm_set1_epi8(1);
 
-    sqlite3_stmt* pVM = compile(szSQL);
+    int i = 0;
+    int j = 0;
+    unsigned int nBad = 0;
 
-    int nRet = sqlite3_step(pVM);
-
-    if (nRet == SQLITE_DONE)
-    {
-        // no rows
-        return CppSQLite3Query(mpDB, pVM, true/*eof*/);
-    }
-    else if (nRet == SQLITE_ROW)
-    {
-        // at least 1 row
-        return CppSQLite3Query(mpDB, pVM, false/*eof*/);
-    }
-    else
+    while (i + 16 <= n)
     {
-        nRet = sqlite3_finalize(pVM);
-        const char* szError= sqlite3_errmsg(mpDB);
-        throw CppSQLite3Exception(nRet, (char*)szError, DONT_DELETE_MSG);
+        __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(c, vOne)) == 0)
+        {
+            // Output never runs ahead of input, so decoding in place is safe
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + j), _mm_add_epi8(c, vOffset));
+            i += 16;
+            j += 16;
+        }
+        else
+        {
+            j = decodeBinaryScalar(in, i, i + 16, out, j, e, nBad);
+        }
     }
+
+    j = decodeBinaryScalar(in, i, n, out, j, e, nBad);
+    *pnRead = i;
+    return (nBad & 0x100) ? -1 : j;
 }
 
 
-int CppSQLite3DB::execScalar(const char* szSQL)
+CPPSQLITE_TARGET_AVX2
+static int encodeBinaryAVX2(const unsigned char* in, int n, unsigned char* out, int e)
 {
-    CppSQLite3Query q = execQuery(szSQL);
+    const __m256i vOffset = _mm256_set1_epi8(static_cast<char>(e));
+    const __m256i vOne = _mm256_set1_epi8(1);
+    const __m256i vQuote = _mm256_set1_epi8('\'');
+
+    int i = 0;
+    int j = 0;
 
-    if (q.eof() || q.numFields() < 1)
+    for (; i + 32 <= n; i += 32)
     {
-        throw CppSQLite3Exception(CPPSQLITE_ERROR,
-                                "Invalid scalar query",
-                                DONT_DELETE_MSG);
+        __m256i c = _mm256_sub_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i)), vOffset);
+        __m256i vEscape = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(c, vOne), c),
+                                          _mm256_cmpeq_epi8(c, vQuote));
+
+        if (_mm256_movemask_epi8(vEscape) == 0)
+        {
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + j), c);
+            j += 32;
+        }
+        else
+        {
+            j = encodeBinaryScalar(in, i, i + 32, out, j, e);
+        }
     }
 
-    return atoi(q.fieldValue(0));
+    return encodeBinaryScalar(in, i, n, out, j, e);
 }
 
 
-CppSQLite3Table CppSQLite3DB::getTable(const char* szSQL)
+CPPSQLITE_TARGET_AVX2
+static int decodeBinaryAVX2(const unsigned char* in, int n, unsigned char* out, int e, int* pnRead)
 {
-    checkDB();
-
-    char* szError=0;
-    char** paszResults=0;
-    int nRet;
-    int nRows(0);
-    int nCols(0);
+    const __m256i vOffset = _mm256_set1_epi8(static_cast<char>(e));
+    const __m256i vOne = _mm256_set1_epi8(1);
 
-    nRet = sqlite3_get_table(mpDB, szSQL, &paszResults, &nRows, &nCols, &szError);
+    int i = 0;
+    int j = 0;
+    unsigned int nBad = 0;
 
-    if (nRet == SQLITE_OK)
+    while (i + 32 <= n)
     {
-        return CppSQLite3Table(paszResults, nRows, nCols);
+        __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(c, vOne)) == 0)
+        {
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + j), _mm256_add_epi8(c, vOffset));
+            i += 32;
+            j += 32;
+        }
+        else
+        {
+            j = decodeBinaryScalar(in, i, i + 32, out, j, e, nBad);
+        }
     }
-    else
+
+    j = decodeBinaryScalar(in, i, n, out, j, e, nBad);
+    *pnRead = i;
+    return (nBad & 0x100) ? -1 : j;
+}
+
+
+static bool cpuHasAVX2()
+{
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
     {
-        throw CppSQLite3Exception(nRet, szError);
+        return false;
     }
+
+    // The OS must also save the YMM registers
+    __cpuid(info, 1);
+    bool bOSSaves = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6;
+
+    __cpuidex(info, 7, 0);
+    return bOSSaves && (info[1] & (1 << 5));
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
 }
 
+#else
 
-sqlite_int64 CppSQLite3DB::lastRowId() const
+static int encodeBinaryPortable(const unsigned char* in, int n, unsigned char* out, int e)
 {
-    return sqlite3_last_insert_rowid(mpDB);
+    return encodeBinaryScalar(in, 0, n, out, 0, e);
 }
 
 
-void CppSQLite3DB::setBusyTimeout(int nMillisecs)
+static int decodeBinaryPortable(const unsigned char* in, int n, unsigned char* out, int e, int* pnRead)
 {
-    mnBusyTimeoutMs = nMillisecs;
-    sqlite3_busy_timeout(mpDB, mnBusyTimeoutMs);
+    int i = 0;
+    unsigned int nBad = 0;
+    int j = decodeBinaryScalar(in, i, n, out, 0, e, nBad);
+    *pnRead = i;
+    return (nBad & 0x100) ? -1 : j;
 }
 
+#endif
 
-void CppSQLite3DB::checkDB() const
+
+// encode() writes the body after the offset byte. decode() takes the body
+// after the offset byte, reads in[n] if in[n-1] starts an escape, and sets
+// *pnRead to the bytes consumed.
+struct BinaryCodec
 {
-    if (!mpDB)
+    int (*encode)(const unsigned char* in, int n, unsigned char* out, int e);
+    int (*decode)(const unsigned char* in, int n, unsigned char* out, int e, int* pnRead);
+};
+
+
+static const BinaryCodec& binaryCodec()
+{
+    static const BinaryCodec codec = []
     {
-        throw CppSQLite3Exception(CPPSQLITE_ERROR,
-                                "Database not open",
-                                DONT_DELETE_MSG);
-    }
+#if defined(CPPSQLITE_X86_SIMD)
+        if (cpuHasAVX2())
+        {
+            return BinaryCodec{encodeBinaryAVX2, decodeBinaryAVX2};
+        }
+        return BinaryCodec{encodeBinarySSE2, decodeBinarySSE2};
+#else
+        return BinaryCodec{encodeBinaryPortable, decodeBinaryPortable};
+#endif
+    }();
+    return codec;
 }
 
 
-sqlite3_stmt* CppSQLite3DB::compile(const char* szSQL)
+static int binaryOffset(const int* cnt, int n)
 {
-    checkDB();
+    // As in encode.c, the first offset needing the fewest escapes
+    int nOffset = 1;
+    int nMin = n;
 
-    char* szError=0;
-    const char* szTail=0;
-    sqlite3_stmt* pVM;
+    for (int i = 1; i < 256; i++)
+    {
+        if (i == '\'')
+        {
+            continue;
+        }
 
-    int nRet = sqlite3_prepare(mpDB, szSQL, -1, &pVM, &szTail);
+        int nSum = cnt[i] + cnt[(i+1) & 0xff] + cnt[(i+'\'') & 0xff];
 
-    if (nRet != SQLITE_OK)
-    {
-        throw CppSQLite3Exception(nRet, szError);
+        if (nSum < nMin)
+        {
+            nMin = nSum;
+            nOffset = i;
+
+            if (nMin == 0)
+            {
+                break;
+            }
+        }
     }
 
-    return pVM;
+    return nOffset;
+}
+
+
+static int encodeBinaryBody(const unsigned char* in, int n, unsigned char* out, int e)
+{
+    return binaryCodec().encode(in, n, out, e);
+}
+
+
+static int decodeBinaryBody(const unsigned char* in, int n, unsigned char* out, int e, int* pnRead)
+{
+    return binaryCodec().decode(in, n, out, e, pnRead);
 }
 
 
@@ -1553,43 +6909,20 @@ sqlite3_stmt* CppSQLite3DB::compile(const char* szSQL)
 ** string, excluding the "\000" terminator.
 */
 int sqlite3_encode_binary(const unsigned char *in, int n, unsigned char *out){
-  int i, j, e, m;
   int cnt[256];
+  int e, j;
   if( n<=0 ){
     out[0] = 'x';
     out[1] = 0;
     return 1;
   }
   memset(cnt, 0, sizeof(cnt));
-  for(i=n-1; i>=0; i--){ cnt[in[i]]++; }
-  m = n;
-  for(i=1; i<256; i++){
-    int sum;
-    if( i=='\'' ) continue;
-    sum = cnt[i] + cnt[(i+1)&0xff] + cnt[(i+'\'')&0xff];
-    if( sum<m ){
-      m = sum;
-      e = i;
-      if( m==0 ) break;
-    }
-  }
+  binaryHistogram(in, n, cnt);
+  e = binaryOffset(cnt, n);
+  /* The kernels read ahead of what they write, so "in" may sit at the end
+  ** of "out" for an encode in place */
+  j = 1 + encodeBinaryBody(in, n, out+1, e);
   out[0] = e;
-  j = 1;
-  for(i=0; i<n; i++){
-    int c = (in[i] - e)&0xff;
-    if( c==0 ){
-      out[j++] = 1;
-      out[j++] = 1;
-    }else if( c==1 ){
-      out[j++] = 1;
-      out[j++] = 2;
-    }else if( c=='\'' ){
-      out[j++] = 1;
-      out[j++] = 3;
-    }else{
-      out[j++] = c;
-    }
-  }
   out[j] = 0;
   return j;
 }
@@ -1605,23 +6938,11 @@ int sqlite3_encode_binary(const unsigned char *in, int n, unsigned char *out){
 ** to decode a string in place.
 */
 int sqlite3_decode_binary(const unsigned char *in, unsigned char *out){
-  int i, c, e;
-  e = *(in++);
-  i = 0;
-  while( (c = *(in++))!=0 ){
-    if( c==1 ){
-      c = *(in++);
-      if( c==1 ){
-        c = 0;
-      }else if( c==2 ){
-        c = 1;
-      }else if( c==3 ){
-        c = '\'';
-      }else{
-        return -1;
-      }
-    }
-    out[i++] = (c + e)&0xff;
+  /* The kernels read whole blocks, so they are given the length */
+  int n = (int)strlen((const char*)in);
+  int nRead;
+  if( n==0 ){
+    return 0;
   }
-  return i;
+  return decodeBinaryBody(in+1, n-1, out, in[0], &nRead);
 }
@@ -11,10 +11,173 @@
 #include <sqlite3.h>
 #include <cstdio>
 #include <cstring>
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <exception>
+#include <functional>
+#include <future>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <streambuf>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#if __has_include(<span>)
+#include <span>
+#endif
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#define CPPSQLITE_HAS_COROUTINES 1
+#endif
 
 #define CPPSQLITE_ERROR 1000
 
+// Default budget for the per-connection prepared statement cache
+#define CPPSQLITE_STATEMENT_CACHE_ENTRIES 64
+#define CPPSQLITE_STATEMENT_CACHE_BYTES (8*1024*1024)
+
+// CppSQLite3Query::Unchecked keeps its index and row checks unless this is 0,
+// which it is by default under NDEBUG. Its accessors are inline, so every
+// translation unit must see the same value.
+#ifndef CPPSQLITE_CHECK_UNCHECKED
+#ifdef NDEBUG
+#define CPPSQLITE_CHECK_UNCHECKED 0
+#else
+#define CPPSQLITE_CHECK_UNCHECKED 1
+#endif
+#endif
+
+
+struct CppSQLite3BatchResult
+{
+    long long nRows;
+    long long nChanges;
+};
+
+
+struct CppSQLite3StatementCacheStats
+{
+    long long nHits;
+    long long nMisses;
+    long long nEvictions;
+    int nEntries;
+    long long nBytes;
+};
+
+
+// Counts transactions run through CppSQLite3Transaction and
+// CppSQLite3Savepoint. Commit times are in microseconds.
+struct CppSQLite3TransactionStats
+{
+    long long nBegins;
+    long long nCommits;
+    long long nRollbacks;
+    long long nSavepoints;
+    long long nSavepointRollbacks;
+    long long nCommitMicros;
+    long long nMaxCommitMicros;
+};
+
+
+struct CppSQLite3SizeClassStats
+{
+    // Block size, including an 8 byte header
+    int nSize;
+    long long nAllocs;
+    long long nFrees;
+    long long nBlocks;
+    // Free blocks not held by any thread
+    long long nSharedFree;
+};
+
+
+// Allocations too large for a size class go straight to malloc()
+struct CppSQLite3AllocatorStats
+{
+    std::vector<CppSQLite3SizeClassStats> vClasses;
+    long long nLargeAllocs;
+    long long nLargeFrees;
+    long long nLargeBytes;
+    long long nPoolBytes;
+};
+
+
+// Connection settings applied and read back by CppSQLite3DB::open().
+// Unset fields are left alone. Named profiles are starting points.
+struct CppSQLite3Profile
+{
+    const char* szJournalMode = 0;
+    // 0 OFF, 1 NORMAL, 2 FULL, 3 EXTRA
+    std::optional<int> nSynchronous;
+    std::optional<long long> nMmapSize;
+    // Pages, or KiB if negative, as for the pragma
+    std::optional<int> nCacheSize;
+    // 0 DEFAULT, 1 FILE, 2 MEMORY
+    std::optional<int> nTempStore;
+    // Only applied while the database is still empty
+    std::optional<int> nPageSize;
+    std::optional<int> nWalAutocheckpoint;
+
+    // WAL with synchronous=NORMAL, which may lose the last transactions
+    // on power loss but never corrupts
+    static CppSQLite3Profile walBalanced();
+    // WAL with synchronous=FULL
+    static CppSQLite3Profile walDurable();
+    // Large cache and no syncs, for loading data that can be rebuilt
+    static CppSQLite3Profile bulkLoad();
+};
+
+
+struct CppSQLite3OpenOptions
+{
+    bool bReadOnly = false;
+    bool bCreate = true;
+    // Treat the file name as a URI, e.g. "file:data.db?mode=ro"
+    bool bUri = false;
+    // Adds immutable=1: the file is opened read-only and never locked or
+    // checked for changes, for media that cannot change
+    bool bImmutable = false;
+    bool bSharedCache = false;
+    // SQLITE_OPEN_NOMUTEX or SQLITE_OPEN_FULLMUTEX, 0 for the build default.
+    // FULLMUTEX lets threads share the CppSQLite3DB, but each query,
+    // statement and transaction guard stays with the thread that made it.
+    int nThreading = 0;
+    CppSQLite3Profile profile;
+};
+
+
+// Times are in microseconds. Busy time is the total time leases were held,
+// so reader utilization is nReadBusyMicros / (nUptimeMicros * nReaders).
+struct CppSQLite3PoolStats
+{
+    long long nReadLeases;
+    long long nWriteLeases;
+    long long nReadWaits;
+    long long nWriteWaits;
+    long long nReadWaitMicros;
+    long long nWriteWaitMicros;
+    long long nReadBusyMicros;
+    long long nWriteBusyMicros;
+    long long nUptimeMicros;
+    int nReaders;
+    int nReadersInUse;
+};
+
 namespace detail
 {
     /**
@@ -57,6 +220,364 @@ namespace detail
         int mnBufferLen;
         void* mpBuf;
     };
+
+    // A parameter name given without its :, @, $ or ? prefix is looked up
+    // among the names stripped of theirs
+    constexpr std::string_view stripParamPrefix(std::string_view szName)
+    {
+        if (!szName.empty() &&
+            (szName[0] == ':' || szName[0] == '@' || szName[0] == '$' || szName[0] == '?'))
+        {
+            szName.remove_prefix(1);
+        }
+        return szName;
+    }
+
+    // 32-bit FNV-1a, usable at compile time
+    constexpr std::uint32_t hashName(std::string_view szName)
+    {
+        std::uint32_t nHash = 2166136261u;
+        for (char c : szName)
+        {
+            nHash = (nHash ^ static_cast<unsigned char>(c)) * 16777619u;
+        }
+        return nHash;
+    }
+
+    /**
+     * Open-addressing hash table from names to column or parameter indexes,
+     * built once per prepared statement. Names are copied, so the table
+     * stays valid when SQLite re-prepares the statement.
+    */
+    class NameIndex
+    {
+    public:
+
+        NameIndex();
+
+        bool built() const { return mbBuilt; }
+
+        // Starts a new table of nNames entries
+        void reset(int nNames);
+        // Adds a name, the first index added for a name wins
+        void add(std::string_view szName, int nIndex) { insert(szName, nIndex, false); }
+        // Adds a name or replaces its index
+        void assign(std::string_view szName, int nIndex) { insert(szName, nIndex, true); }
+
+        // Returns -1 if the name is not present
+        int find(std::string_view szName) const { return find(szName, hashName(szName)); }
+        int find(std::string_view szName, std::uint32_t nHash) const;
+
+    private:
+
+        void insert(std::string_view szName, int nIndex, bool bReplace);
+
+        struct Slot
+        {
+            std::uint32_t nHash;
+            std::uint32_t nOffset;
+            std::uint32_t nLen;
+            int nIndex;
+        };
+
+        std::vector<Slot> mvSlots;
+        std::string msNames;
+        bool mbBuilt;
+    };
+
+    // Lookup tables shared by every user of a prepared statement handle
+    struct StatementMeta
+    {
+        // Parameters by their full name, and by the name without its prefix
+        // where 0 marks a name shared by several parameters (:a and @a)
+        NameIndex params;
+        NameIndex bareParams;
+        NameIndex columns;
+        // SQLITE_STMTSTATUS_REPREPARE when columns was built, a re-prepare
+        // after a schema change may alter the result columns
+        int nColumnsPrepared;
+    };
+
+    /**
+     * Per-connection cache of prepared statements keyed by SQL text.
+     * Handles are checked out by CppSQLite3Query/CppSQLite3Statement and
+     * returned (reset, bindings cleared) when those are finalized. Idle
+     * handles are evicted least recently used first once the entry or
+     * memory budget is exceeded. A checked out handle keeps the cache
+     * alive, so one released after its CppSQLite3DB is destroyed or moved
+     * over is just finalized. The cache is locked, an entry and its meta
+     * belong to whoever has it checked out.
+    */
+    class StatementCache : public std::enable_shared_from_this<StatementCache>
+    {
+    public:
+
+        struct Entry
+        {
+            // Set while checked out
+            std::shared_ptr<StatementCache> pCache;
+            std::string sSQL;
+            sqlite3_stmt* pVM;
+            int nBytes;
+            bool bInUse;
+            bool bOrphaned;
+            StatementMeta meta;
+        };
+
+        StatementCache();
+        ~StatementCache();
+
+        StatementCache(StatementCache const&) = delete;
+        StatementCache& operator=(StatementCache const&) = delete;
+
+        // Checks out the idle handle cached for szSQL, or returns null
+        Entry* acquire(std::string_view szSQL);
+        // Adopts a freshly prepared handle, returned checked out. Returns
+        // null if the handle cannot be cached (caller keeps ownership).
+        Entry* insert(std::string_view szSQL, sqlite3_stmt* pVM);
+        // Returns a checked out handle, result is that of sqlite3_reset()
+        int release(Entry* pEntry);
+
+        // Finalizes idle handles, handles still checked out are finalized
+        // when they are released
+        void clear();
+
+        bool enabled() const { return mnMaxEntries > 0; }
+
+        void setLimits(int nMaxEntries, long long nMaxBytes);
+
+        CppSQLite3StatementCacheStats stats() const;
+
+    private:
+
+        void evict();
+        void erase(std::list<Entry>::iterator it);
+
+        mutable std::mutex mMutex;
+        std::list<Entry> mEntries;
+        std::unordered_map<std::string_view, std::list<Entry>::iterator> mIndex;
+        std::atomic<int> mnMaxEntries;
+        long long mnMaxBytes;
+        long long mnBytes;
+        long long mnHits;
+        long long mnMisses;
+        long long mnEvictions;
+    };
+
+    template <typename T>
+    struct is_optional : std::false_type {};
+
+    template <typename T>
+    struct is_optional<std::optional<T>> : std::true_type {};
+
+    template <typename T>
+    struct dependent_false : std::false_type {};
+
+    /**
+     * Binds a single value with the sqlite3_bind_* call matching its type,
+     * without any of the checks done by CppSQLite3Statement::bind().
+     * Returns the SQLite result code.
+    */
+    template <typename T>
+    int bindValue(sqlite3_stmt* pVM, int nParam, const T& value)
+    {
+        if constexpr (std::is_same_v<T, std::nullptr_t> || std::is_same_v<T, std::nullopt_t>)
+        {
+            return sqlite3_bind_null(pVM, nParam);
+        }
+        else if constexpr (is_optional<T>::value)
+        {
+            return value ? bindValue(pVM, nParam, *value) : sqlite3_bind_null(pVM, nParam);
+        }
+        else if constexpr (std::is_integral_v<T>)
+        {
+            if constexpr (sizeof(T) < sizeof(int) || (sizeof(T) == sizeof(int) && std::is_signed_v<T>))
+            {
+                return sqlite3_bind_int(pVM, nParam, static_cast<int>(value));
+            }
+            else
+            {
+                return sqlite3_bind_int64(pVM, nParam, static_cast<sqlite3_int64>(value));
+            }
+        }
+        else if constexpr (std::is_floating_point_v<T>)
+        {
+            return sqlite3_bind_double(pVM, nParam, static_cast<double>(value));
+        }
+        else if constexpr (std::is_convertible_v<const T&, const char*>)
+        {
+            return sqlite3_bind_text(pVM, nParam, value, -1, SQLITE_TRANSIENT);
+        }
+        else if constexpr (std::is_convertible_v<const T&, std::string_view>)
+        {
+            std::string_view text(value);
+            return sqlite3_bind_text64(pVM, nParam, text.data(), text.size(),
+                                    SQLITE_TRANSIENT, SQLITE_UTF8);
+        }
+        else
+        {
+            static_assert(dependent_false<T>::value, "Unsupported parameter type");
+        }
+    }
+
+    // Type a parameter is kept as when it is bound later, on another
+    // thread: text is copied, everything else is kept by value
+    template <typename T>
+    using owned_value_t = std::conditional_t<!std::is_same_v<T, std::nullptr_t> &&
+                                            (std::is_convertible_v<const T&, const char*> ||
+                                             std::is_same_v<T, std::string_view>),
+                                            std::string,
+                                            T>;
+
+    /**
+     * Reads column nCol of the current row straight into a T using the
+     * matching sqlite3_column_* call. NULL reads as 0 or an empty string
+     * unless T is a std::optional. A std::string_view or const char* is
+     * only valid until the statement is stepped, reset or finalized.
+    */
+    template <typename T>
+    T columnValue(sqlite3_stmt* pVM, int nCol)
+    {
+        if constexpr (is_optional<T>::value)
+        {
+            if (sqlite3_column_type(pVM, nCol) == SQLITE_NULL)
+            {
+                return std::nullopt;
+            }
+            return columnValue<typename T::value_type>(pVM, nCol);
+        }
+        else if constexpr (std::is_same_v<T, bool>)
+        {
+            return sqlite3_column_int64(pVM, nCol) != 0;
+        }
+        else if constexpr (std::is_integral_v<T>)
+        {
+            if constexpr (sizeof(T) < sizeof(int) || (sizeof(T) == sizeof(int) && std::is_signed_v<T>))
+            {
+                return static_cast<T>(sqlite3_column_int(pVM, nCol));
+            }
+            else
+            {
+                return static_cast<T>(sqlite3_column_int64(pVM, nCol));
+            }
+        }
+        else if constexpr (std::is_floating_point_v<T>)
+        {
+            return static_cast<T>(sqlite3_column_double(pVM, nCol));
+        }
+        else if constexpr (std::is_same_v<T, const char*>)
+        {
+            return reinterpret_cast<const char*>(sqlite3_column_text(pVM, nCol));
+        }
+        else if constexpr (std::is_same_v<T, std::string> || std::is_same_v<T, std::string_view>)
+        {
+            // Text must be fetched before its length
+            const char* szValue = reinterpret_cast<const char*>(sqlite3_column_text(pVM, nCol));
+            std::size_t nLen = static_cast<std::size_t>(sqlite3_column_bytes(pVM, nCol));
+            return szValue ? T(szValue, nLen) : T();
+        }
+        else
+        {
+            static_assert(dependent_false<T>::value, "Unsupported column type");
+        }
+    }
+
+    template <typename T, typename = void>
+    struct is_tuple_like : std::false_type {};
+
+    template <typename T>
+    struct is_tuple_like<T, std::void_t<decltype(std::tuple_size<T>::value)>> : std::true_type {};
+
+    template <typename Row, std::size_t... I>
+    Row readRow(sqlite3_stmt* pVM, std::index_sequence<I...>)
+    {
+        // Braced initialisation reads the columns left to right
+        return Row{columnValue<std::tuple_element_t<I, Row>>(pVM, static_cast<int>(I))...};
+    }
+
+    template <typename Row>
+    Row readRow(sqlite3_stmt* pVM)
+    {
+        if constexpr (is_tuple_like<Row>::value)
+        {
+            return readRow<Row>(pVM, std::make_index_sequence<std::tuple_size<Row>::value>());
+        }
+        else
+        {
+            return columnValue<Row>(pVM, 0);
+        }
+    }
+
+    template <typename Row>
+    constexpr int rowColumnCount()
+    {
+        if constexpr (std::is_void_v<Row>)
+        {
+            return 0;
+        }
+        else if constexpr (is_tuple_like<Row>::value)
+        {
+            return static_cast<int>(std::tuple_size<Row>::value);
+        }
+        else
+        {
+            return 1;
+        }
+    }
+
+    template <typename T>
+    constexpr bool columnBorrows()
+    {
+        if constexpr (is_optional<T>::value)
+        {
+            return columnBorrows<typename T::value_type>();
+        }
+        else
+        {
+            return std::is_same_v<T, std::string_view> || std::is_same_v<T, const char*>;
+        }
+    }
+
+    template <typename Row, std::size_t... I>
+    constexpr bool rowBorrows(std::index_sequence<I...>)
+    {
+        return (columnBorrows<std::tuple_element_t<I, Row>>() || ...);
+    }
+
+    // True if a Row from readRow() points into the statement, and so is
+    // only valid until it is next stepped or reset
+    template <typename Row>
+    constexpr bool rowBorrows()
+    {
+        if constexpr (is_tuple_like<Row>::value)
+        {
+            return rowBorrows<Row>(std::make_index_sequence<std::tuple_size<Row>::value>());
+        }
+        else
+        {
+            return columnBorrows<Row>();
+        }
+    }
+}
+
+
+// A parameter name hashed at compile time, see CppSQLite3Literals
+struct CppSQLite3Param
+{
+    std::string_view szName;
+    std::uint32_t nHash;
+};
+
+
+namespace CppSQLite3Literals
+{
+    // ":name"_p names the parameter :name, "name"_p whichever one of
+    // :name, @name or $name the statement uses
+    constexpr CppSQLite3Param operator""_p(const char* szName, std::size_t nLen)
+    {
+        return CppSQLite3Param{std::string_view(szName, nLen),
+                            detail::hashName(std::string_view(szName, nLen))};
+    }
 }
 
 
@@ -108,22 +629,38 @@ public:
 
     CppSQLite3Binary();
 
+    CppSQLite3Binary(CppSQLite3Binary&& binary) noexcept;
+    CppSQLite3Binary& operator=(CppSQLite3Binary&& binary) noexcept;
+
+    CppSQLite3Binary(const CppSQLite3Binary&) = delete;
+    CppSQLite3Binary& operator=(const CppSQLite3Binary&) = delete;
+
     ~CppSQLite3Binary();
 
     void setBinary(const unsigned char* pBuf, int nLen);
     void setEncoded(const unsigned char* pBuf);
+    void setEncoded(const unsigned char* pBuf, int nLen);
 
+    // Encoding and decoding happen in place in the buffer
     const unsigned char* getEncoded();
     const unsigned char* getBinary();
 
     int getBinaryLength();
+    int getEncodedLength();
+
+    // The buffer is kept and only grows, so after reserve() for the largest
+    // value, setBinary() and getEncoded() in a loop do not allocate
+    void reserve(int nLen);
 
     unsigned char* allocBuffer(int nLen);
 
+    // Frees the buffer
     void clear();
 
 private:
 
+    void growBuffer(int nBytes);
+
     unsigned char* mpBuf;
     int mnBinaryLen;
     int mnBufferLen;
@@ -132,28 +669,192 @@ private:
 };
 
 
+/**
+ * Encodes a value passed in chunks, producing the same string as
+ * CppSQLite3Binary::getEncoded(). The offset written first depends on every
+ * byte, so each chunk is given to scan() and then, in order, to encode().
+ * Only one chunk of input and of output is needed at a time.
+*/
+class CppSQLite3BinaryEncoder
+{
+public:
+
+    CppSQLite3BinaryEncoder();
+
+    void scan(const unsigned char* pBuf, int nLen);
+
+    // Returns the bytes written to pOut, which must hold chunkBound(nLen)
+    int encode(const unsigned char* pBuf, int nLen, unsigned char* pOut);
+
+    // Writes the end of the string including its terminator, at most 2
+    // bytes, and returns the length written before the terminator
+    int finish(unsigned char* pOut);
+
+    void reset();
+
+    // One chunk may be all escapes, unlike a whole value
+    static int chunkBound(int nLen) { return 2*nLen + 2; }
+
+private:
+
+    int mnCounts[256];
+    int mnScanned;
+    // -1 until the first encode()
+    int mnOffset;
+};
+
+
+/**
+ * Decodes a string made by CppSQLite3Binary::getEncoded() that is passed in
+ * chunks, which may split an escape. The terminator is not passed.
+*/
+class CppSQLite3BinaryDecoder
+{
+public:
+
+    CppSQLite3BinaryDecoder();
+
+    // Returns the bytes written to pOut, which must hold nLen
+    int decode(const unsigned char* pBuf, int nLen, unsigned char* pOut);
+
+    // Throws if the input stopped inside an escape
+    void finish();
+
+    void reset();
+
+private:
+
+    // -1 until the first byte
+    int mnOffset;
+    bool mbEscape;
+};
+
+
 class CppSQLite3Query
 {
 public:
 
+    /**
+     * View of the current row whose accessors go straight to the
+     * sqlite3_column_* calls and skip the validation done by the query's
+     * own accessors, for scan loops. It follows the query as it steps.
+     * The checks are compiled back in by CPPSQLITE_CHECK_UNCHECKED.
+    */
+    class Unchecked
+    {
+    public:
+
+        int numFields() const { return mnCols; }
+
+        int fieldDataType(int nField) const
+        {
+            return sqlite3_column_type(mpVM, field(nField));
+        }
+
+        bool fieldIsNull(int nField) const
+        {
+            return sqlite3_column_type(mpVM, field(nField)) == SQLITE_NULL;
+        }
+
+        int getIntField(int nField, int nNullValue=0) const
+        {
+            nField = field(nField);
+            return sqlite3_column_type(mpVM, nField) == SQLITE_NULL ? nNullValue : sqlite3_column_int(mpVM, nField);
+        }
+
+        long long getInt64Field(int nField, long long nNullValue=0) const
+        {
+            nField = field(nField);
+            return sqlite3_column_type(mpVM, nField) == SQLITE_NULL ? nNullValue : sqlite3_column_int64(mpVM, nField);
+        }
+
+        double getDoubleField(int nField, double dNullValue=0.0) const
+        {
+            nField = field(nField);
+            return sqlite3_column_type(mpVM, nField) == SQLITE_NULL ? dNullValue : sqlite3_column_double(mpVM, nField);
+        }
+
+        const char* getStringField(int nField, const char* szNullValue="") const
+        {
+            // NULL comes back as a null pointer and reads as szNullValue
+            const unsigned char* szValue = sqlite3_column_text(mpVM, field(nField));
+            return szValue ? reinterpret_cast<const char*>(szValue) : szNullValue;
+        }
+
+        const unsigned char* getBlobField(int nField, int& nLen) const
+        {
+            // The value must be fetched before its length
+            nField = field(nField);
+            const unsigned char* pBlob = static_cast<const unsigned char*>(sqlite3_column_blob(mpVM, nField));
+            nLen = sqlite3_column_bytes(mpVM, nField);
+            return pBlob;
+        }
+
+        std::string_view getStringView(int nField, std::string_view szNullValue=std::string_view()) const
+        {
+            nField = field(nField);
+            const unsigned char* szValue = sqlite3_column_text(mpVM, nField);
+            return szValue ? std::string_view(reinterpret_cast<const char*>(szValue),
+                                            static_cast<std::size_t>(sqlite3_column_bytes(mpVM, nField)))
+                           : szNullValue;
+        }
+
+#if defined(__cpp_lib_span)
+        std::span<const std::byte> getBlobSpan(int nField) const
+        {
+            nField = field(nField);
+            const std::byte* pBlob = static_cast<const std::byte*>(sqlite3_column_blob(mpVM, nField));
+            return pBlob ? std::span<const std::byte>(pBlob, static_cast<std::size_t>(sqlite3_column_bytes(mpVM, nField)))
+                         : std::span<const std::byte>();
+        }
+#endif
+
+    private:
+
+        friend class CppSQLite3Query;
+
+        explicit Unchecked(const CppSQLite3Query& rQuery) :
+            mpQuery(&rQuery), mpVM(rQuery.mpVM), mnCols(rQuery.mnCols) {}
+
+        int field(int nField) const
+        {
+#if CPPSQLITE_CHECK_UNCHECKED
+            check(nField);
+#endif
+            return nField;
+        }
+
+        void check(int nField) const;
+
+        const CppSQLite3Query* mpQuery;
+        sqlite3_stmt* mpVM;
+        int mnCols;
+    };
+
     CppSQLite3Query();
 
-    CppSQLite3Query(const CppSQLite3Query& rQuery);
+    CppSQLite3Query(CppSQLite3Query&& rQuery) noexcept;
 
     CppSQLite3Query(sqlite3* pDB,
                 sqlite3_stmt* pVM,
                 bool bEof,
-                bool bOwnVM=true);
+                bool bOwnVM=true,
+                detail::StatementCache::Entry* pEntry=0,
+                detail::StatementMeta* pMeta=0);
 
-    CppSQLite3Query& operator=(const CppSQLite3Query& rQuery);
+    CppSQLite3Query& operator=(CppSQLite3Query&& rQuery) noexcept;
 
-    virtual ~CppSQLite3Query();
+    ~CppSQLite3Query();
 
     int numFields() const;
 
     int fieldIndex(const char* szField) const;
     const char* fieldName(int nCol) const;
 
+    // Resolves a column name once, for use with the by-index accessors in
+    // tight loops. Valid for the lifetime of the query.
+    int columnHandle(const char* szField) const { return fieldIndex(szField); }
+
     const char* fieldDeclType(int nCol) const;
     int fieldDataType(int nCol) const;
 
@@ -178,6 +879,16 @@ public:
     const unsigned char* getBlobField(int nField, int& nLen) const;
     const unsigned char* getBlobField(const char* szField, int& nLen) const;
 
+    // Text with its length, valid until the query moves to the next row
+    std::string_view getStringView(int nField, std::string_view szNullValue=std::string_view()) const;
+    std::string_view getStringView(const char* szField, std::string_view szNullValue=std::string_view()) const;
+
+#if defined(__cpp_lib_span)
+    // NULL reads as an empty span
+    std::span<const std::byte> getBlobSpan(int nField) const;
+    std::span<const std::byte> getBlobSpan(const char* szField) const;
+#endif
+
     bool fieldIsNull(int nField) const;
     bool fieldIsNull(const char* szField) const;
 
@@ -187,15 +898,29 @@ public:
 
     void finalize();
 
+    // Checked once here. The view must not outlive the query.
+    Unchecked unchecked() const;
+
 private:
 
+    friend class CppSQLite3ResultSet;
+    friend class CppSQLite3ParallelQuery;
+
     void checkVM() const;
+    void release() noexcept;
+
+    const detail::NameIndex& columnIndex() const;
 
     sqlite3* mpDB;
     sqlite3_stmt* mpVM;
     bool mbEof;
     int mnCols;
     bool mbOwnVM;
+    detail::StatementCache::Entry* mpEntry;
+
+    // Lookup tables, shared with the owning statement or cache entry
+    mutable detail::StatementMeta* mpMeta;
+    mutable std::unique_ptr<detail::StatementMeta> mpOwnMeta;
 };
 
 
@@ -205,18 +930,19 @@ public:
 
     CppSQLite3Table();
 
-    CppSQLite3Table(const CppSQLite3Table& rTable);
+    CppSQLite3Table(CppSQLite3Table&& rTable) noexcept;
 
     CppSQLite3Table(char** paszResults, int nRows, int nCols);
 
-    virtual ~CppSQLite3Table();
+    ~CppSQLite3Table();
 
-    CppSQLite3Table& operator=(const CppSQLite3Table& rTable);
+    CppSQLite3Table& operator=(CppSQLite3Table&& rTable) noexcept;
 
     int numFields() const;
 
     int numRows() const;
 
+    int fieldIndex(const char* szField) const;
     const char* fieldName(int nCol) const;
 
     const char* fieldValue(int nField) const;
@@ -234,42 +960,183 @@ public:
     const char* getStringField(int nField, const char* szNullValue="") const;
     const char* getStringField(const char* szField, const char* szNullValue="") const;
 
+    // sqlite3_get_table() keeps no lengths, so this has to measure the text
+    std::string_view getStringView(int nField, std::string_view szNullValue=std::string_view()) const;
+    std::string_view getStringView(const char* szField, std::string_view szNullValue=std::string_view()) const;
+
     bool fieldIsNull(int nField) const;
     bool fieldIsNull(const char* szField) const;
 
+    // Remember numbers parsed by getIntField/getFloatField/getDoubleField
+    // so that repeated reads of a cell do not parse it again
+    void setCacheNumbers(bool bCacheNumbers);
+
     void setRow(int nRow);
 
     void finalize();
 
 private:
 
+    struct NumericCell
+    {
+        long long nValue;
+        double dValue;
+        unsigned char nParsed;
+    };
+
     void checkResults() const;
+    void buildColumnIndex();
+
+    long long parseIntField(int nField) const;
+    double parseDoubleField(int nField) const;
 
     int mnCols;
     int mnRows;
     int mnCurrentRow;
     char** mpaszResults;
+    detail::NameIndex mColumns;
+    bool mbCacheNumbers;
+    mutable std::vector<NumericCell> mvNumbers;
+};
+
+
+/**
+ * Result set stored column by column with native types, built by stepping a
+ * query. Each column holds 64-bit integers, doubles, or text/blob bytes in
+ * one arena indexed by offsets, plus a NULL bitmap. A column takes the type
+ * of its first non-NULL value; integers are widened to doubles if a real
+ * shows up later, and numeric columns to text if text or a blob does.
+ * Numbers read as text are formatted as SQLite would on first use, and
+ * like all text stay valid until the next fetch().
+*/
+class CppSQLite3ResultSet
+{
+public:
+
+    CppSQLite3ResultSet();
+
+    // Appends up to nMaxRows rows (all if negative) from the query,
+    // advancing it. Returns the number of rows appended. Later fetches
+    // must be from queries with the same column names as the first.
+    int fetch(CppSQLite3Query& rQuery, int nMaxRows=-1);
+
+    // Room for nRows rows in total, columns typed later get it too
+    void reserve(int nRows);
+
+    int numFields() const;
+
+    int numRows() const;
+
+    int fieldIndex(const char* szField) const;
+    const char* fieldName(int nCol) const;
+
+    // SQLITE_INTEGER, SQLITE_FLOAT, SQLITE_TEXT, SQLITE_BLOB, or SQLITE_NULL
+    // if the column holds only NULLs
+    int fieldDataType(int nCol) const;
+
+    int getIntField(int nField, int nNullValue=0) const;
+    int getIntField(const char* szField, int nNullValue=0) const;
+
+    long long getInt64Field(int nField, long long nNullValue=0) const;
+    long long getInt64Field(const char* szField, long long nNullValue=0) const;
+
+    double getDoubleField(int nField, double dNullValue=0.0) const;
+    double getDoubleField(const char* szField, double dNullValue=0.0) const;
+
+    const char* getStringField(int nField, const char* szNullValue="") const;
+    const char* getStringField(const char* szField, const char* szNullValue="") const;
+
+    const unsigned char* getBlobField(int nField, int& nLen) const;
+    const unsigned char* getBlobField(const char* szField, int& nLen) const;
+
+    std::string_view getStringView(int nField, std::string_view szNullValue=std::string_view()) const;
+    std::string_view getStringView(const char* szField, std::string_view szNullValue=std::string_view()) const;
+
+#if defined(__cpp_lib_span)
+    std::span<const std::byte> getBlobSpan(int nField) const;
+    std::span<const std::byte> getBlobSpan(const char* szField) const;
+#endif
+
+    bool fieldIsNull(int nField) const;
+    bool fieldIsNull(const char* szField) const;
+
+    void setRow(int nRow);
+
+#if defined(__cpp_lib_span)
+    // Whole columns for vectorized processing. NULL rows hold 0, and the
+    // bitmap has bit (nRow % 64) of word (nRow / 64) set for NULL rows.
+    std::span<const long long> int64Column(int nCol) const;
+    std::span<const double> doubleColumn(int nCol) const;
+    std::span<const std::uint64_t> nullBitmap(int nCol) const;
+    // Value nRow is arena[offsets[nRow], offsets[nRow+1]-1), each value is
+    // followed by a NUL terminator
+    std::span<const std::size_t> offsetsColumn(int nCol) const;
+    std::span<const char> arenaColumn(int nCol) const;
+#endif
+
+private:
+
+    struct Column
+    {
+        std::string sName;
+        int nType;
+        std::vector<long long> vInt;
+        std::vector<double> vDouble;
+        std::vector<std::size_t> vOffsets;
+        std::vector<char> vArena;
+        std::vector<std::uint64_t> vNulls;
+        // Numbers formatted as text, laid out like vOffsets and vArena
+        mutable std::vector<std::size_t> vTextOffsets;
+        mutable std::vector<char> vText;
+    };
+
+    void appendRow(sqlite3_stmt* pVM);
+    void setColumnType(Column& col, int nType);
+    void reserveColumn(Column& col);
+
+    const Column& column(int nCol) const;
+    bool isNull(const Column& col) const;
+    // Text or blob bytes of the current row, which must not be NULL
+    const char* bytes(const Column& col, std::size_t& nLen) const;
+
+    std::vector<Column> mvColumns;
+    detail::NameIndex mColumns;
+    int mnRows;
+    int mnCurrentRow;
+    int mnReserved;
 };
 
 
+class CppSQLite3DB;
+
+template <typename Signature>
+class CppSQLite3TypedStatement;
+
+
 class CppSQLite3Statement
 {
 public:
 
     CppSQLite3Statement();
 
-    CppSQLite3Statement(const CppSQLite3Statement& rStatement);
+    CppSQLite3Statement(CppSQLite3Statement&& rStatement) noexcept;
 
-    CppSQLite3Statement(sqlite3* pDB, sqlite3_stmt* pVM);
+    CppSQLite3Statement(sqlite3* pDB,
+                    sqlite3_stmt* pVM,
+                    detail::StatementCache::Entry* pEntry=0);
 
-    virtual ~CppSQLite3Statement();
+    ~CppSQLite3Statement();
 
-    CppSQLite3Statement& operator=(const CppSQLite3Statement& rStatement);
+    CppSQLite3Statement& operator=(CppSQLite3Statement&& rStatement) noexcept;
 
     int execDML();
 
     CppSQLite3Query execQuery();
 
+    // Runs the query with the current bindings into a result set, then
+    // resets the statement
+    CppSQLite3ResultSet execResultSet();
+
     void bind(int nParam, const char* szValue);
     void bind(int nParam, const int nValue);
     void bind(int nParam, const long long nValue);
@@ -277,63 +1144,1744 @@ public:
     void bind(int nParam, const unsigned char* blobValue, int nLen);
     void bindNull(int nParam);
 
+    // nBytes of zeros, for a blob to be filled through CppSQLite3BlobStream
+    void bindZeroBlob(int nParam, sqlite3_uint64 nBytes);
+
+    // Text and blobs are copied
+    void bind(int nParam, std::string_view szValue);
+#if defined(__cpp_lib_span)
+    void bind(int nParam, std::span<const std::byte> blobValue);
+#endif
+
+    // Zero-copy binds, the caller keeps the data alive until the statement
+    // is reset, rebound or finalized
+    void bindStatic(int nParam, std::string_view szValue);
+#if defined(__cpp_lib_span)
+    void bindStatic(int nParam, std::span<const std::byte> blobValue);
+#endif
+
+    // Zero-copy binds that take ownership of the buffer until the parameter
+    // is rebound with another owned buffer or the statement is finalized
+    void bind(int nParam, std::string&& sValue);
+    void bind(int nParam, std::vector<unsigned char>&& blobValue);
+
+    // Named parameters, szName may omit the :, @ or $ prefix unless the
+    // statement has more than one parameter of that name
+    int bindParameterIndex(std::string_view szName);
+    int bindParameterIndex(const CppSQLite3Param& param);
+
+    // Names are taken as anything that converts to std::string_view but
+    // an integer or nullptr, so bind(0, value) is never read as a name
+    template <typename Name, typename... Value,
+              typename = std::enable_if_t<std::is_convertible_v<const Name&, std::string_view> &&
+                                          !std::is_integral_v<Name> &&
+                                          !std::is_same_v<Name, std::nullptr_t>>>
+    void bind(const Name& szName, Value&&... value)
+    {
+        if constexpr (std::is_pointer_v<Name>)
+        {
+            if (!szName)
+            {
+                throw CppSQLite3Exception(CPPSQLITE_ERROR,
+                                        "Parameter name is null",
+                                        false);
+            }
+        }
+
+        bind(bindParameterIndex(szName), std::forward<Value>(value)...);
+    }
+
+    template <typename... Value>
+    void bind(const CppSQLite3Param& param, Value&&... value)
+    {
+        bind(bindParameterIndex(param), std::forward<Value>(value)...);
+    }
+
+    void bindNull(const char* szName) { bindNull(bindParameterIndex(szName)); }
+    void bindNull(const CppSQLite3Param& param) { bindNull(bindParameterIndex(param)); }
+
+    // Binds values to parameters 1, 2, ... in order, text is copied
+    template <typename... Values>
+    void bindAll(const Values&... values)
+    {
+        checkVM();
+
+        int nParam = 0;
+        int nRet = SQLITE_OK;
+        ((nRet = (nRet == SQLITE_OK ? detail::bindValue(mpVM, ++nParam, values) : nRet)), ...);
+
+        if (nRet != SQLITE_OK)
+        {
+            throw CppSQLite3Exception(nRet,
+                                    "Error binding param",
+                                    false);
+        }
+
+        for (int n = 1; n <= nParam; n++)
+        {
+            releaseOwned(n);
+        }
+    }
+
+    // Binds, steps and resets the statement once per element of rows, which
+    // must be tuple-like (std::tuple, std::pair, std::array) or be mapped to
+    // one by project, e.g. [](const Rec& r) { return std::tie(r.id, r.name); }
+    // Unless a transaction is already open the batch runs in one, committed
+    // every nCommitInterval rows (0 commits once at the end). Throws once,
+    // with the index of the failing row, and rolls back the open transaction.
+    template <typename Range>
+    CppSQLite3BatchResult executeBatch(const Range& rows, int nCommitInterval=0)
+    {
+        return executeBatch(rows,
+                            [](const auto& row) -> const auto& { return row; },
+                            nCommitInterval);
+    }
+
+    template <typename Range, typename Projection>
+    CppSQLite3BatchResult executeBatch(const Range& rows,
+                                    Projection project,
+                                    int nCommitInterval=0)
+    {
+        checkDB();
+        checkVM();
+
+        // Counted as execDML() counts them, leaving out rows changed by
+        // triggers and foreign key actions
+        CppSQLite3BatchResult result = {0, 0};
+        bool bWrites = !sqlite3_stmt_readonly(mpVM);
+        bool bOwnTransaction = beginBatch();
+
+        try
+        {
+            for (const auto& row : rows)
+            {
+                int nParams = 0;
+                int nRet = std::apply([&](const auto&... values)
+                {
+                    int nRes = SQLITE_OK;
+                    ((nRes = (nRes == SQLITE_OK ? detail::bindValue(mpVM, ++nParams, values) : nRes)), ...);
+                    return nRes;
+                }, project(row));
+
+                // Buffers owned for these parameters are unused once the
+                // first row is bound
+                if (nRet == SQLITE_OK && result.nRows == 0)
+                {
+                    for (int n = 1; n <= nParams; n++)
+                    {
+                        releaseOwned(n);
+                    }
+                }
+
+                if (nRet == SQLITE_OK)
+                {
+                    nRet = stepBatchRow();
+                }
+
+                if (nRet != SQLITE_OK)
+                {
+                    failBatch(result.nRows, nRet);
+                }
+
+                if (bWrites)
+                {
+                    result.nChanges += sqlite3_changes(mpDB);
+                }
+
+                result.nRows++;
+
+                if (bOwnTransaction && nCommitInterval > 0 && result.nRows % nCommitInterval == 0)
+                {
+                    endBatch(true);
+                }
+            }
+        }
+        catch (...)
+        {
+            if (bOwnTransaction)
+            {
+                rollbackBatch();
+            }
+            throw;
+        }
+
+        if (bOwnTransaction)
+        {
+            endBatch(false);
+        }
+
+        return result;
+    }
+
     void reset();
 
     void finalize();
 
 private:
 
+    template <typename Signature>
+    friend class CppSQLite3TypedStatement;
+
+    bool beginBatch();
+    int stepBatchRow();
+    void endBatch(bool bContinue);
+    void rollbackBatch();
+    [[noreturn]] void failBatch(long long nRow, int nErr);
+
     void checkDB() const;
     void checkVM() const;
+    void reserveOwned(int nParam);
+    void releaseOwned(int nParam);
+
+    detail::StatementMeta& meta();
+    detail::StatementMeta& paramIndex();
 
     sqlite3* mpDB;
     sqlite3_stmt* mpVM;
+    detail::StatementCache::Entry* mpEntry;
+
+    // Buffers handed over to the rvalue bind() overloads, by parameter.
+    // Text is held through a pointer so short strings do not move.
+    std::vector<std::unique_ptr<std::string>> mvOwnedText;
+    std::vector<std::vector<unsigned char>> mvOwnedBlobs;
+
+    // Lookup tables of a handle that is not cached
+    std::unique_ptr<detail::StatementMeta> mpMeta;
 };
 
 
-class CppSQLite3DB
+/**
+ * Prepared statement with its parameter and column types fixed at compile
+ * time, e.g. CppSQLite3TypedStatement<std::tuple<long long, std::string>(int)>
+ * takes one int parameter and yields (long long, std::string) rows. A
+ * non-tuple result type reads a single column, and void is used for
+ * statements that return no rows. Arity is checked once, when the
+ * statement is prepared.
+*/
+template <typename Row, typename... Args>
+class CppSQLite3TypedStatement<Row(Args...)>
 {
 public:
 
-    CppSQLite3DB();
+    class Rows
+    {
+    public:
 
-    virtual ~CppSQLite3DB();
+        class iterator
+        {
+        public:
 
-    void open(const char* szFile);
+            using iterator_category = std::input_iterator_tag;
+            using value_type = Row;
+            using difference_type = std::ptrdiff_t;
+            using pointer = void;
+            using reference = Row;
 
-    void close();
+            explicit iterator(Rows* pRows=0) : mpRows(pRows) {}
 
-    bool tableExists(const char* szTable);
+            Row operator*() const { return detail::readRow<Row>(mpRows->mpVM); }
 
-    int execDML(const char* szSQL);
+            iterator& operator++() { mpRows->step(); return *this; }
 
-    CppSQLite3Query execQuery(const char* szSQL);
+            bool operator==(const iterator& rhs) const { return done() == rhs.done(); }
+            bool operator!=(const iterator& rhs) const { return done() != rhs.done(); }
 
-    int execScalar(const char* szSQL);
+        private:
 
-    CppSQLite3Table getTable(const char* szSQL);
+            bool done() const { return !mpRows || mpRows->mbEof; }
 
-    CppSQLite3Statement compileStatement(const char* szSQL);
+            Rows* mpRows;
+        };
 
-    sqlite_int64 lastRowId() const;
+        explicit Rows(sqlite3_stmt* pVM) : mpVM(pVM), mbEof(false) { step(); }
 
-    void interrupt() { sqlite3_interrupt(mpDB); }
+        // Iterators point at the Rows, so it stays where execQuery() put it
+        Rows(Rows&&) = delete;
+        Rows(const Rows&) = delete;
+        Rows& operator=(const Rows&) = delete;
+
+        ~Rows()
+        {
+            if (mpVM)
+            {
+                sqlite3_reset(mpVM);
+            }
+        }
+
+        iterator begin() { return iterator(this); }
+        iterator end() { return iterator(); }
+
+        bool eof() const { return mbEof; }
+
+    private:
+
+        void step()
+        {
+            int nRet = sqlite3_step(mpVM);
+
+            if (nRet == SQLITE_DONE)
+            {
+                mbEof = true;
+            }
+            else if (nRet != SQLITE_ROW)
+            {
+                mbEof = true;
+                sqlite3_reset(mpVM);
+                throw CppSQLite3Exception(nRet,
+                                        sqlite3_errmsg(sqlite3_db_handle(mpVM)),
+                                        false);
+            }
+        }
+
+        sqlite3_stmt* mpVM;
+        bool mbEof;
+    };
+
+    explicit CppSQLite3TypedStatement(CppSQLite3Statement&& statement) :
+        mStatement(std::move(statement))
+    {
+        checkArity();
+    }
+
+    CppSQLite3TypedStatement(CppSQLite3DB& db, std::string_view szSQL);
+
+    // Runs the statement to completion, returns the number of rows changed
+    int execDML(const Args&... args)
+    {
+        bindAll(args...);
+
+        int nRet;
+        do
+        {
+            nRet = sqlite3_step(mStatement.mpVM);
+        }
+        while (nRet == SQLITE_ROW);
+
+        if (nRet != SQLITE_DONE)
+        {
+            fail(nRet);
+        }
+
+        int nRowsChanged = sqlite3_changes(mStatement.mpDB);
+        sqlite3_reset(mStatement.mpVM);
+        return nRowsChanged;
+    }
+
+    // Rows are decoded as they are iterated, the statement is reset when
+    // the returned object goes out of scope
+    Rows execQuery(const Args&... args)
+    {
+        static_assert(!std::is_void_v<Row>, "Statement does not return rows");
+        bindAll(args...);
+        return Rows(mStatement.mpVM);
+    }
+
+    // First row only, std::nullopt if there are none. The statement is
+    // reset before returning, so Row must own its text.
+    std::optional<Row> execRow(const Args&... args)
+    {
+        static_assert(!std::is_void_v<Row>, "Statement does not return rows");
+        static_assert(!detail::rowBorrows<Row>(),
+                    "execRow() rows must own their text, use std::string");
+        bindAll(args...);
+
+        int nRet = sqlite3_step(mStatement.mpVM);
+
+        if (nRet == SQLITE_DONE)
+        {
+            sqlite3_reset(mStatement.mpVM);
+            return std::nullopt;
+        }
+        else if (nRet != SQLITE_ROW)
+        {
+            fail(nRet);
+        }
+
+        std::optional<Row> row(detail::readRow<Row>(mStatement.mpVM));
+        sqlite3_reset(mStatement.mpVM);
+        return row;
+    }
+
+    CppSQLite3Statement& statement() { return mStatement; }
+
+private:
+
+    void checkArity()
+    {
+        mStatement.checkVM();
+
+        if (sqlite3_bind_parameter_count(mStatement.mpVM) != static_cast<int>(sizeof...(Args)))
+        {
+            throw CppSQLite3Exception(CPPSQLITE_ERROR,
+                                    "Parameter count does not match statement",
+                                    false);
+        }
+
+        if (!std::is_void_v<Row> &&
+            sqlite3_column_count(mStatement.mpVM) != detail::rowColumnCount<Row>())
+        {
+            throw CppSQLite3Exception(CPPSQLITE_ERROR,
+                                    "Column count does not match statement",
+                                    false);
+        }
+    }
+
+    void bindAll(const Args&... args)
+    {
+        // Every call starts here, so a moved-from statement throws
+        mStatement.checkVM();
+
+        sqlite3_stmt* pVM = mStatement.mpVM;
+        sqlite3_reset(pVM);
+
+        int nParam = 0;
+        int nRet = SQLITE_OK;
+        ((nRet = (nRet == SQLITE_OK ? detail::bindValue(pVM, ++nParam, args) : nRet)), ...);
+
+        if (nRet != SQLITE_OK)
+        {
+            throw CppSQLite3Exception(nRet,
+                                    "Error binding param",
+                                    false);
+        }
+
+        for (int n = 1; n <= nParam; n++)
+        {
+            mStatement.releaseOwned(n);
+        }
+    }
+
+    [[noreturn]] void fail(int nRet)
+    {
+        CppSQLite3Exception e(nRet, sqlite3_errmsg(mStatement.mpDB), false);
+        sqlite3_reset(mStatement.mpVM);
+        throw e;
+    }
+
+    CppSQLite3Statement mStatement;
+};
+
+
+class CppSQLite3DB
+{
+public:
+
+    CppSQLite3DB();
+
+    // Queries, statements and tables hold the connection and its cached
+    // statements, not the CppSQLite3DB, so they stay valid across a move
+    CppSQLite3DB(CppSQLite3DB&& db) noexcept;
+
+    ~CppSQLite3DB();
+
+    CppSQLite3DB& operator=(CppSQLite3DB&& db) noexcept;
+
+    void open(const char* szFile);
+
+    // Opens with sqlite3_open_v2(), then applies options.profile and reads
+    // each setting back, throwing if one did not take effect
+    void open(const char* szFile, const CppSQLite3OpenOptions& options);
+
+    void close();
+
+    bool tableExists(const char* szTable);
+
+    int execDML(const char* szSQL);
+    int execDML(std::string_view szSQL);
+
+    // Runs every statement of a multi-statement string in turn, discarding
+    // any result rows. Returns the number of rows changed by the script.
+    int execScript(std::string_view szSQL);
+
+    CppSQLite3Query execQuery(const char* szSQL);
+    CppSQLite3Query execQuery(std::string_view szSQL);
+
+    int execScalar(const char* szSQL);
+
+    // Runs szSQL with args bound in order and reads the first column of the
+    // first row straight into a T. A T of std::optional reads no row or NULL
+    // as std::nullopt, otherwise a missing row throws.
+    template <typename T, typename... Args>
+    T execScalar(std::string_view szSQL, const Args&... args);
+
+    CppSQLite3Table getTable(const char* szSQL);
+
+    CppSQLite3ResultSet getResultSet(const char* szSQL);
+    CppSQLite3ResultSet getResultSet(std::string_view szSQL);
+
+    CppSQLite3Statement compileStatement(const char* szSQL);
+    CppSQLite3Statement compileStatement(std::string_view szSQL);
+
+    sqlite_int64 lastRowId() const;
+
+    void interrupt() { sqlite3_interrupt(mpDB); }
+
+    // True between BEGIN and COMMIT/ROLLBACK, including after an error
+    // that did not roll the transaction back
+    bool inTransaction() const { return mpDB && !sqlite3_get_autocommit(mpDB); }
 
     void setBusyTimeout(int nMillisecs);
 
+    // Limits of the prepared statement cache, nMaxEntries=0 disables it and
+    // nMaxBytes=0 removes the memory limit
+    void setStatementCacheLimits(int nMaxEntries, long long nMaxBytes);
+
+    CppSQLite3StatementCacheStats statementCacheStats() const;
+
+    void clearStatementCache();
+
+    CppSQLite3TransactionStats transactionStats() const { return mTransactionStats; }
+
     static const char* SQLiteVersion() { return SQLITE_VERSION; }
 
+    // Bytes currently allocated by SQLite, and the highest value reached
+    static sqlite3_int64 memoryUsed() { return sqlite3_memory_used(); }
+    static sqlite3_int64 memoryHighwater(bool bReset=false) { return sqlite3_memory_highwater(bReset); }
+
 private:
 
-    CppSQLite3DB(const CppSQLite3DB& db);
-    CppSQLite3DB& operator=(const CppSQLite3DB& db);
+    friend class CppSQLite3ParallelQuery;
+    friend class CppSQLite3Transaction;
+    friend class CppSQLite3Savepoint;
+    friend class CppSQLite3Backup;
+    friend class CppSQLite3BlobStream;
+    friend class CppSQLite3PagedTable;
+
+    detail::StatementCache& cache();
+
+    void applyProfile(const CppSQLite3Profile& profile);
+    void setPragma(const char* szPragma, long long nValue);
+    // First column of the first row, bypassing the statement cache, for
+    // SQL with literals formatted in that would only evict hot statements
+    std::optional<std::string> execUncached(const char* szSQL);
+
+    sqlite3_stmt* compile(std::string_view szSQL,
+                        detail::StatementCache::Entry*& pEntry,
+                        const char** pszTail=0);
 
-    sqlite3_stmt* compile(const char* szSQL);
+    sqlite3_stmt* prepare(std::string_view szSQL,
+                        unsigned int nFlags,
+                        const char** pszTail);
+
+    void runToCompletion(sqlite3_stmt* pVM,
+                        detail::StatementCache::Entry* pEntry);
+
+    sqlite3_stmt* compileScalar(std::string_view szSQL,
+                            detail::StatementCache::Entry*& pEntry);
+
+    bool stepScalar(sqlite3_stmt* pVM,
+                    detail::StatementCache::Entry* pEntry,
+                    int nBindRet);
+
+    void releaseScalar(sqlite3_stmt* pVM,
+                    detail::StatementCache::Entry* pEntry);
 
     void checkDB() const;
 
     sqlite3* mpDB;
     int mnBusyTimeoutMs;
+    // Shared with checked out handles, which may outlive the DB
+    std::shared_ptr<detail::StatementCache> mCache;
+    CppSQLite3TransactionStats mTransactionStats;
+    // Savepoints open on this connection, the next one is named after it
+    int mnSavepoints;
+};
+
+
+template <typename T, typename... Args>
+T CppSQLite3DB::execScalar(std::string_view szSQL, const Args&... args)
+{
+    // The statement is reset before returning, std::optional included
+    static_assert(!detail::columnBorrows<T>(),
+                "Scalar results must own their text");
+
+    detail::StatementCache::Entry* pEntry;
+    sqlite3_stmt* pVM = compileScalar(szSQL, pEntry);
+
+    int nParam = 0;
+    int nRet = SQLITE_OK;
+    ((nRet = (nRet == SQLITE_OK ? detail::bindValue(pVM, ++nParam, args) : nRet)), ...);
+
+    if (!stepScalar(pVM, pEntry, nRet))
+    {
+        releaseScalar(pVM, pEntry);
+
+        if constexpr (detail::is_optional<T>::value)
+        {
+            return std::nullopt;
+        }
+        else
+        {
+            throw CppSQLite3Exception(CPPSQLITE_ERROR,
+                                    "Invalid scalar query",
+                                    false);
+        }
+    }
+
+    T value = detail::columnValue<T>(pVM, 0);
+    releaseScalar(pVM, pEntry);
+    return value;
+}
+
+
+template <typename Row, typename... Args>
+CppSQLite3TypedStatement<Row(Args...)>::CppSQLite3TypedStatement(CppSQLite3DB& db, std::string_view szSQL) :
+    mStatement(db.compileStatement(szSQL))
+{
+    checkArity();
+}
+
+
+/**
+ * Transaction that rolls back when it goes out of scope uncommitted,
+ * including on an exception. IMMEDIATE takes the write lock at the start,
+ * so a busy database fails the begin instead of a later write, and the
+ * unit of work never has to be retried halfway. The database must not be
+ * moved or closed while the transaction is open.
+*/
+class CppSQLite3Transaction
+{
+public:
+
+    enum Mode
+    {
+        DEFERRED,
+        IMMEDIATE,
+        EXCLUSIVE
+    };
+
+    explicit CppSQLite3Transaction(CppSQLite3DB& db, Mode eMode=IMMEDIATE);
+
+    CppSQLite3Transaction(const CppSQLite3Transaction&) = delete;
+    CppSQLite3Transaction& operator=(const CppSQLite3Transaction&) = delete;
+
+    ~CppSQLite3Transaction();
+
+    // A commit that fails with SQLITE_BUSY leaves the transaction open,
+    // so it can be tried again
+    void commit();
+    void rollback();
+
+    bool isActive() const { return mbActive; }
+
+private:
+
+    CppSQLite3DB& mDB;
+    bool mbActive;
+};
+
+
+/**
+ * Savepoint scope, which may nest inside a CppSQLite3Transaction or
+ * another savepoint. release() keeps its changes in the enclosing
+ * transaction; leaving the scope without it rolls them back. Outside a
+ * transaction a savepoint behaves as a deferred transaction of its own.
+*/
+class CppSQLite3Savepoint
+{
+public:
+
+    explicit CppSQLite3Savepoint(CppSQLite3DB& db);
+
+    CppSQLite3Savepoint(const CppSQLite3Savepoint&) = delete;
+    CppSQLite3Savepoint& operator=(const CppSQLite3Savepoint&) = delete;
+
+    ~CppSQLite3Savepoint();
+
+    void release();
+
+    // Undoes the changes made since the savepoint and ends it
+    void rollback();
+
+    bool isActive() const { return mbActive; }
+
+private:
+
+    void exec(const char* szVerb);
+
+    CppSQLite3DB& mDB;
+    int mnLevel;
+    bool mbActive;
+};
+
+
+struct CppSQLite3BackupProgress
+{
+    int nRemaining;
+    int nPageCount;
+    long long nSteps;
+    // Times the copy started over because another connection wrote to
+    // the source
+    long long nRestarts;
+    // Steps skipped because the source or destination was locked
+    long long nBusyRetries;
+};
+
+
+/**
+ * Online backup of a live database, copied a few pages at a time with
+ * sqlite3_backup_step(). The source stays readable and writable between
+ * steps; with a WAL source writers are not blocked at all. Throttling by
+ * pause and byte budget keeps the copy from starving other I/O. A copy
+ * restarts by itself when another connection writes to the source;
+ * writes through the source connection are copied as they happen.
+ * Running in the background uses the source and destination connections
+ * from another thread, so neither may be used elsewhere meanwhile.
+*/
+class CppSQLite3Backup
+{
+public:
+
+    CppSQLite3Backup(CppSQLite3DB& dest,
+                    CppSQLite3DB& source,
+                    const char* szDestName="main",
+                    const char* szSourceName="main");
+
+    // Backs up into szDestFile, which is created or overwritten
+    CppSQLite3Backup(const char* szDestFile,
+                    CppSQLite3DB& source,
+                    const char* szSourceName="main");
+
+    CppSQLite3Backup(const CppSQLite3Backup&) = delete;
+    CppSQLite3Backup& operator=(const CppSQLite3Backup&) = delete;
+
+    // Cancels a background copy that is still running
+    ~CppSQLite3Backup();
+
+    // Pages copied per step, -1 copies the rest in one step. Fewer pages
+    // hold the source lock for less time.
+    void setPagesPerStep(int nPages) { mnPagesPerStep.store(nPages); }
+
+    // Waits between steps. nBytesPerSecond=0 removes the byte budget.
+    // These settings may be changed while the copy runs in the background.
+    void setPause(std::chrono::microseconds pause) { mnPauseMicros.store(pause.count()); }
+    void setBytesPerSecond(long long nBytesPerSecond) { mnBytesPerSecond.store(nBytesPerSecond); }
+
+    // Called after every step, on the thread running the copy
+    void setProgressHandler(std::function<void(const CppSQLite3BackupProgress&)> fnProgress);
+
+    // Copies one step without waiting, true once the backup is complete
+    bool step();
+
+    // Steps until complete or cancelled, pausing as configured
+    void run();
+
+    // run() on a thread of its own, wait() joins it and rethrows its error
+    void start();
+    void wait();
+
+    // Stops run() before its next step, for good
+    void cancel();
+
+    bool done() const { return mbDone.load(); }
+
+    CppSQLite3BackupProgress progress() const;
+
+private:
+
+    void init(sqlite3* pDest,
+            const char* szDestName,
+            CppSQLite3DB& source,
+            const char* szSourceName);
+    void finish();
+    void pause(std::chrono::microseconds wait);
+
+    CppSQLite3DB mOwnDest;
+    sqlite3_backup* mpBackup;
+    sqlite3* mpDest;
+    int mnPageSize;
+
+    std::atomic<int> mnPagesPerStep;
+    std::atomic<long long> mnPauseMicros;
+    std::atomic<long long> mnBytesPerSecond;
+    std::function<void(const CppSQLite3BackupProgress&)> mfnProgress;
+
+    std::atomic<int> mnRemaining{0};
+    std::atomic<int> mnPageCount{0};
+    std::atomic<long long> mnSteps{0};
+    std::atomic<long long> mnRestarts{0};
+    std::atomic<long long> mnBusyRetries{0};
+    std::atomic<bool> mbDone{false};
+
+    std::thread mThread;
+    std::exception_ptr mpError;
+    std::mutex mMutex;
+    std::condition_variable mCancelled;
+    bool mbCancel;
+};
+
+
+/**
+ * Incremental access to one blob value, read and written a chunk at a time
+ * so a large object is never held in memory whole. A blob cannot change
+ * size through the stream: reserve it first with bindZeroBlob(), then open
+ * a writable stream on the row. The handle expires if the row is changed
+ * by other means, after which reads and writes throw SQLITE_ABORT until
+ * reopen() opens it again. Streams must be closed before their database.
+*/
+class CppSQLite3BlobStream
+{
+public:
+
+    CppSQLite3BlobStream();
+
+    CppSQLite3BlobStream(CppSQLite3DB& db,
+                        const char* szTable,
+                        const char* szColumn,
+                        sqlite_int64 nRowId,
+                        bool bWritable=false,
+                        const char* szDBName="main");
+
+    CppSQLite3BlobStream(CppSQLite3BlobStream&& blob) noexcept;
+    CppSQLite3BlobStream& operator=(CppSQLite3BlobStream&& blob) noexcept;
+
+    CppSQLite3BlobStream(const CppSQLite3BlobStream&) = delete;
+    CppSQLite3BlobStream& operator=(const CppSQLite3BlobStream&) = delete;
+
+    ~CppSQLite3BlobStream();
+
+    void open(CppSQLite3DB& db,
+            const char* szTable,
+            const char* szColumn,
+            sqlite_int64 nRowId,
+            bool bWritable=false,
+            const char* szDBName="main");
+
+    // Moves to the same column of another row, cheaper than a new open
+    void reopen(sqlite_int64 nRowId);
+
+    void close();
+
+    bool isOpen() const { return mpBlob != 0; }
+
+    int size() const { return mnSize; }
+    int tell() const { return mnPos; }
+    void seek(int nPos);
+
+    // Reads from the current position, returns the bytes read, 0 at the end
+    int read(void* pBuf, int nLen);
+
+    // Writes at the current position, throws past the end of the blob
+    void write(const void* pBuf, int nLen);
+
+private:
+
+    void openBlob(sqlite_int64 nRowId);
+    void checkBlob() const;
+    void release() noexcept;
+
+    sqlite3* mpDB;
+    sqlite3_blob* mpBlob;
+    int mnSize;
+    int mnPos;
+
+    // Kept to replace a handle that has expired
+    std::string msTable;
+    std::string msColumn;
+    std::string msDBName;
+    bool mbWritable;
+};
+
+
+/**
+ * std::streambuf over a CppSQLite3BlobStream, buffering nChunk bytes, so
+ * blobs can be used with std::istream and std::ostream. Output stops at
+ * the end of the blob. Output is written back on sync(), on seeking, and
+ * when the buffer is destroyed.
+*/
+class CppSQLite3BlobBuf : public std::streambuf
+{
+public:
+
+    explicit CppSQLite3BlobBuf(CppSQLite3BlobStream& blob, std::size_t nChunk=65536);
+
+    CppSQLite3BlobBuf(const CppSQLite3BlobBuf&) = delete;
+    CppSQLite3BlobBuf& operator=(const CppSQLite3BlobBuf&) = delete;
+
+    ~CppSQLite3BlobBuf() override;
+
+protected:
+
+    int_type underflow() override;
+    int_type overflow(int_type c) override;
+    int sync() override;
+
+    pos_type seekoff(off_type nOffset,
+                    std::ios_base::seekdir eDir,
+                    std::ios_base::openmode eMode) override;
+    pos_type seekpos(pos_type nPos, std::ios_base::openmode eMode) override;
+
+private:
+
+    // Blob position of the character at gptr() or pptr()
+    int position() const;
+    void flush();
+
+    CppSQLite3BlobStream& mBlob;
+    std::vector<char> mvBuffer;
+    // Blob position of the start of the buffer
+    int mnOffset;
+};
+
+
+/**
+ * Process-wide SQLite settings, which only take effect before SQLite is
+ * initialised, i.e. before the first database is opened, or after
+ * sqlite3_shutdown().
+*/
+class CppSQLite3Runtime
+{
+public:
+
+    // Serves SQLite's allocations, and so detail::SQLite3Memory and
+    // CppSQLite3Buffer, from a size-class pool with a cache per thread,
+    // so reader threads seldom share a lock. Memory taken for the pool is
+    // reused but not returned to the system. bMemStatus=false also stops
+    // SQLite counting memory, which takes a global mutex per allocation;
+    // CppSQLite3DB::memoryUsed() then reports 0.
+    static void installAllocator(bool bMemStatus=true);
+
+    // Any other allocator
+    static void installAllocator(const sqlite3_mem_methods& methods);
+
+    // Counts of the pool, from every thread
+    static CppSQLite3AllocatorStats allocatorStats();
+};
+
+
+/**
+ * Table over a large result that keeps only one page of rows in memory.
+ * Rows are read forward from a live statement as setRow() moves past the
+ * current page. Moving back re-seeks with keyset pagination on szKeyColumn,
+ * which must be a unique column of the result (e.g. "SELECT rowid AS id,
+ * ..."). Rows are ordered by that key, so it must be backed by an index
+ * (the rowid or INTEGER PRIMARY KEY will do); otherwise SQLite sorts the
+ * whole result on every seek. szSQL must be a single statement.
+*/
+class CppSQLite3PagedTable
+{
+public:
+
+    CppSQLite3PagedTable(CppSQLite3DB& db,
+                    std::string_view szSQL,
+                    const char* szKeyColumn,
+                    int nPageSize=1000);
+
+    CppSQLite3PagedTable(const CppSQLite3PagedTable&) = delete;
+    CppSQLite3PagedTable& operator=(const CppSQLite3PagedTable&) = delete;
+
+    int numFields() const;
+
+    // Counts the rows with a separate query unless the end has been reached
+    int numRows() const;
+
+    int pageSize() const { return mnPageSize; }
+
+    int fieldIndex(const char* szField) const;
+    const char* fieldName(int nCol) const;
+
+    const char* fieldValue(int nField) const;
+    const char* fieldValue(const char* szField) const;
+
+    int getIntField(int nField, int nNullValue=0) const;
+    int getIntField(const char* szField, int nNullValue=0) const;
+
+    float getFloatField(int nField, float fNullValue=0.0f) const;
+    float getFloatField(const char* szField, float fNullValue=0.0f) const;
+
+    double getDoubleField(int nField, double dNullValue=0.0) const;
+    double getDoubleField(const char* szField, double dNullValue=0.0) const;
+
+    const char* getStringField(int nField, const char* szNullValue="") const;
+    const char* getStringField(const char* szField, const char* szNullValue="") const;
+
+    // Values are kept as text, blobs hold their bytes unchanged
+    std::string_view getStringView(int nField, std::string_view szNullValue=std::string_view()) const;
+    std::string_view getStringView(const char* szField, std::string_view szNullValue=std::string_view()) const;
+
+#if defined(__cpp_lib_span)
+    std::span<const std::byte> getBlobSpan(int nField) const;
+    std::span<const std::byte> getBlobSpan(const char* szField) const;
+#endif
+
+    bool fieldIsNull(int nField) const;
+    bool fieldIsNull(const char* szField) const;
+
+    void setRow(int nRow);
+
+    void finalize();
+
+private:
+
+    struct Key
+    {
+        int nType;
+        long long nValue;
+        double dValue;
+        std::string sValue;
+    };
+
+    void seek(int nPage);
+    bool loadPage();
+    void checkResults() const;
+    std::size_t cell(int nField) const;
+
+    CppSQLite3DB* mpDB;
+    std::string msSQL;
+    int mnPageSize;
+    int mnKeyCol;
+
+    CppSQLite3Statement mFirst;
+    CppSQLite3Statement mSeek;
+    CppSQLite3Query mCursor;
+    // Row the cursor is positioned on
+    int mnCursorRow;
+
+    // Key of the last row of each page read so far
+    std::vector<Key> mvPageKeys;
+
+    int mnCols;
+    std::vector<std::string> mvNames;
+    detail::NameIndex mColumns;
+
+    int mnPageStart;
+    int mnPageRows;
+    int mnCurrentRow;
+    mutable int mnRows;
+    std::vector<char> mvArena;
+    // Offset of each cell of the page in mvArena, -1 for NULL, and its
+    // length without the terminator
+    std::vector<long long> mvCells;
+    std::vector<std::size_t> mvLengths;
+};
+
+
+/**
+ * Fixed set of connections to one WAL database: nReaders read-only
+ * connections and a single writer. Leases hand out a connection for the
+ * exclusive use of one thread and give it back when destroyed.
+ * Readers are checked out without locking unless all are busy; writers
+ * queue for the writer connection in arrival order. Leases must be
+ * returned before the pool is destroyed.
+*/
+class CppSQLite3Pool
+{
+public:
+
+    class Lease
+    {
+    public:
+
+        Lease() : mpPool(0), mpDB(0), mnSlot(0) {}
+
+        Lease(Lease&& rLease) noexcept;
+        Lease& operator=(Lease&& rLease) noexcept;
+
+        ~Lease() { release(); }
+
+        CppSQLite3DB& db() const { return *mpDB; }
+        CppSQLite3DB* operator->() const { return mpDB; }
+
+        explicit operator bool() const { return mpDB != 0; }
+
+        // Gives the connection back to the pool early
+        void release() noexcept;
+
+    private:
+
+        friend class CppSQLite3Pool;
+
+        Lease(CppSQLite3Pool* pPool, CppSQLite3DB* pDB, int nSlot);
+
+        CppSQLite3Pool* mpPool;
+        CppSQLite3DB* mpDB;
+        // Reader index, or -1 for the writer
+        int mnSlot;
+        std::chrono::steady_clock::time_point mtLeased;
+    };
+
+    // fnConfigure runs on every connection once it is open, to set the
+    // same pragmas, functions and busy handling on each. Connections are
+    // opened with SQLITE_OPEN_NOMUTEX, as a lease is used by one thread.
+    CppSQLite3Pool(const char* szFile,
+                int nReaders,
+                std::function<void(CppSQLite3DB&)> fnConfigure=nullptr);
+
+    // The writer is always switched to WAL. Readers skip the journal mode
+    // and page size of the profile, which only the writer can set.
+    CppSQLite3Pool(const char* szFile,
+                int nReaders,
+                const CppSQLite3OpenOptions& options,
+                std::function<void(CppSQLite3DB&)> fnConfigure=nullptr);
+
+    CppSQLite3Pool(const CppSQLite3Pool&) = delete;
+    CppSQLite3Pool& operator=(const CppSQLite3Pool&) = delete;
+
+    // Block until a connection is free
+    Lease reader();
+    Lease writer();
+
+    // Empty lease if every reader is in use
+    Lease tryReader();
+    // Empty lease if the writer is in use or has writers queued for it
+    Lease tryWriter();
+
+    int numReaders() const { return mnReaders; }
+
+    CppSQLite3PoolStats stats() const;
+
+private:
+
+    struct Slot
+    {
+        CppSQLite3DB db;
+        std::atomic<bool> bBusy{false};
+    };
+
+    int tryAcquireReader();
+    void releaseReader(int nSlot, long long nBusyMicros) noexcept;
+    void releaseWriter(long long nBusyMicros) noexcept;
+
+    static long long microsSince(std::chrono::steady_clock::time_point t);
+
+    int mnReaders;
+    std::unique_ptr<Slot[]> mpReaders;
+    CppSQLite3DB mWriter;
+    std::chrono::steady_clock::time_point mtCreated;
+
+    // Where the next reader search starts, spreads threads over the slots
+    std::atomic<unsigned int> mnNextReader{0};
+    std::atomic<int> mnReaderWaiters{0};
+
+    // Ticket lock for the writer, served in order
+    std::atomic<unsigned long long> mnWriterTicket{0};
+    std::atomic<unsigned long long> mnWriterServing{0};
+
+    // Only taken when a lease has to wait
+    std::mutex mMutex;
+    std::condition_variable mReaderFree;
+    std::condition_variable mWriterFree;
+
+    std::atomic<long long> mnReadLeases{0};
+    std::atomic<long long> mnWriteLeases{0};
+    std::atomic<long long> mnReadWaits{0};
+    std::atomic<long long> mnWriteWaits{0};
+    std::atomic<long long> mnReadWaitMicros{0};
+    std::atomic<long long> mnWriteWaitMicros{0};
+    std::atomic<long long> mnReadBusyMicros{0};
+    std::atomic<long long> mnWriteBusyMicros{0};
+};
+
+
+/**
+ * Runs one query over a key range split across the readers of a pool.
+ * szSQL takes the low and high key of a partition as parameters 1 and 2,
+ * both inclusive, e.g. "select sum(v) from t where ts between ? and ?".
+ * szBoundsSQL returns the smallest and largest key in one row, e.g.
+ * "select min(ts), max(ts) from t". Keys must be integers. The range is
+ * cut into nPartitions equal parts, which readers take in turn, so more
+ * partitions than readers evens out skewed keys.
+ * SNAPSHOT runs the partitions on several readers that open one WAL
+ * snapshot, so all see the same version of the database. It needs SQLite
+ * and this file built with SQLITE_ENABLE_SNAPSHOT and a WAL database, and
+ * throws when the snapshot cannot be taken. INDEPENDENT runs them on
+ * several readers in read transactions of their own, so a write committed
+ * meanwhile may show in some partitions and not others. SERIAL runs them
+ * in turn in a single read transaction on one reader.
+*/
+class CppSQLite3ParallelQuery
+{
+public:
+
+    enum Mode
+    {
+        SNAPSHOT,
+        INDEPENDENT,
+        SERIAL
+    };
+
+    // nPartitions of 0 uses one per reader
+    CppSQLite3ParallelQuery(CppSQLite3Pool& pool,
+                            std::string_view szSQL,
+                            std::string_view szBoundsSQL,
+                            int nPartitions=0,
+                            Mode eMode=SNAPSHOT);
+
+    CppSQLite3ParallelQuery(const CppSQLite3ParallelQuery&) = delete;
+    CppSQLite3ParallelQuery& operator=(const CppSQLite3ParallelQuery&) = delete;
+
+    // fnPartial(CppSQLite3Query&) runs on the reader of each partition,
+    // its results are folded in key order by fnCombine(T, partial)
+    template <typename T, typename Partial, typename Combine>
+    T reduce(T init, Partial fnPartial, Combine fnCombine);
+
+    // Reads rows as CppSQLite3TypedStatement does and merges the
+    // partitions by less, by which each must already be ordered.
+    // Rows ordered by the key itself come back unchanged.
+    template <typename Row, typename Less = std::less<Row>>
+    std::vector<Row> merge(Less less = Less());
+
+    int numPartitions() const { return mnPartitions; }
+
+    Mode mode() const { return meMode; }
+
+    // Readers the last run used, 1 if it ran serially (one partition, or
+    // a pool of one reader)
+    int lastReaders() const { return mnLastReaders; }
+
+private:
+
+    struct Range
+    {
+        long long nLow;
+        long long nHigh;
+    };
+
+    // Calls fnPartition(query, nPartition) once for every partition,
+    // nPartition counting up from the lowest keys
+    void run(const std::function<void(CppSQLite3Query&, int)>& fnPartition);
+
+    std::vector<Range> split(CppSQLite3DB& db);
+    void runPartition(CppSQLite3DB& db,
+                    const Range& range,
+                    int nPartition,
+                    const std::function<void(CppSQLite3Query&, int)>& fnPartition);
+
+    static void checkColumns(CppSQLite3Query& q, int nCols);
+    static void rollback(CppSQLite3DB& db) noexcept;
+
+    CppSQLite3Pool& mPool;
+    std::string msSQL;
+    std::string msBoundsSQL;
+    int mnPartitions;
+    Mode meMode;
+    int mnLastReaders;
 };
 
+
+template <typename T, typename Partial, typename Combine>
+T CppSQLite3ParallelQuery::reduce(T init, Partial fnPartial, Combine fnCombine)
+{
+    using Result = std::invoke_result_t<Partial&, CppSQLite3Query&>;
+
+    std::vector<std::optional<Result>> vPartials(mnPartitions);
+    run([&](CppSQLite3Query& q, int nPartition)
+    {
+        vPartials[nPartition].emplace(fnPartial(q));
+    });
+
+    for (std::optional<Result>& partial : vPartials)
+    {
+        if (partial)
+        {
+            init = fnCombine(std::move(init), std::move(*partial));
+        }
+    }
+
+    return init;
+}
+
+
+template <typename Row, typename Less>
+std::vector<Row> CppSQLite3ParallelQuery::merge(Less less)
+{
+    static_assert(!detail::rowBorrows<Row>(), "Merged rows must own their text");
+
+    std::vector<std::vector<Row>> vParts(mnPartitions);
+    run([&](CppSQLite3Query& q, int nPartition)
+    {
+        checkColumns(q, detail::rowColumnCount<Row>());
+
+        std::vector<Row>& vRows = vParts[nPartition];
+        for (; !q.eof(); q.nextRow())
+        {
+            vRows.push_back(detail::readRow<Row>(q.mpVM));
+        }
+    });
+
+    std::size_t nTotal = 0;
+    for (const std::vector<Row>& vRows : vParts)
+    {
+        nTotal += vRows.size();
+    }
+
+    std::vector<Row> vMerged;
+    vMerged.reserve(nTotal);
+
+    // Heap of (partition, next row) ordered so the smallest row is on top,
+    // ties go to the lower partition to keep the merge stable
+    using Cursor = std::pair<std::size_t, std::size_t>;
+    auto greater = [&](const Cursor& a, const Cursor& b)
+    {
+        const Row& rowA = vParts[a.first][a.second];
+        const Row& rowB = vParts[b.first][b.second];
+        if (less(rowB, rowA)) return true;
+        if (less(rowA, rowB)) return false;
+        return a.first > b.first;
+    };
+
+    std::vector<Cursor> vHeap;
+    for (std::size_t nPart = 0; nPart < vParts.size(); nPart++)
+    {
+        if (!vParts[nPart].empty())
+        {
+            vHeap.emplace_back(nPart, 0);
+        }
+    }
+    std::make_heap(vHeap.begin(), vHeap.end(), greater);
+
+    while (!vHeap.empty())
+    {
+        std::pop_heap(vHeap.begin(), vHeap.end(), greater);
+        Cursor& cursor = vHeap.back();
+        vMerged.push_back(std::move(vParts[cursor.first][cursor.second]));
+
+        if (++cursor.second < vParts[cursor.first].size())
+        {
+            std::push_heap(vHeap.begin(), vHeap.end(), greater);
+        }
+        else
+        {
+            vHeap.pop_back();
+        }
+    }
+
+    return vMerged;
+}
+
+
+struct CppSQLite3WriteQueueStats
+{
+    long long nSubmitted;
+    long long nCommitted;
+    long long nFailed;
+    long long nTransactions;
+};
+
+
+/**
+ * Owns a writer connection and runs every write submitted to it on one
+ * thread, grouping them into a transaction per commit window. A window
+ * closes after nMaxBatch writes or once the oldest has waited maxLatency.
+ * Each write runs in its own savepoint, so a failing write is rolled back
+ * alone. Futures are fulfilled once the transaction has committed.
+ * Writes must not begin or end transactions themselves.
+*/
+class CppSQLite3WriteQueue
+{
+public:
+
+    CppSQLite3WriteQueue(CppSQLite3DB&& db,
+                    int nMaxBatch=256,
+                    std::chrono::microseconds maxLatency=std::chrono::milliseconds(5));
+
+    CppSQLite3WriteQueue(const CppSQLite3WriteQueue&) = delete;
+    CppSQLite3WriteQueue& operator=(const CppSQLite3WriteQueue&) = delete;
+
+    // Commits whatever is still queued, then stops the writer thread
+    ~CppSQLite3WriteQueue();
+
+    // Runs fnWrite(db) on the writer thread, the future gets its result
+    template <typename F>
+    std::future<std::invoke_result_t<std::decay_t<F>&, CppSQLite3DB&>> submit(F&& fnWrite);
+
+    // Runs szSQL with args bound in order, the future gets the number of
+    // rows changed. Text arguments are copied.
+    template <typename... Args>
+    std::future<int> execDML(std::string_view szSQL, const Args&... args);
+
+    // Waits until everything submitted so far has been committed or has
+    // failed. Must not be called from a write.
+    void flush();
+
+    CppSQLite3WriteQueueStats stats() const;
+
+private:
+
+    struct Item
+    {
+        virtual ~Item() {}
+        virtual void run(CppSQLite3DB& db) = 0;
+        virtual void commit() = 0;
+        virtual void fail(std::exception_ptr e) = 0;
+
+        std::chrono::steady_clock::time_point tSubmitted;
+    };
+
+    template <typename F>
+    struct Task : Item
+    {
+        typedef std::invoke_result_t<F&, CppSQLite3DB&> Result;
+
+        explicit Task(F&& f) : fn(std::move(f)) {}
+        explicit Task(const F& f) : fn(f) {}
+
+        void run(CppSQLite3DB& db) override
+        {
+            if constexpr (std::is_void_v<Result>)
+            {
+                fn(db);
+            }
+            else
+            {
+                result.emplace(fn(db));
+            }
+        }
+
+        void commit() override
+        {
+            if constexpr (std::is_void_v<Result>)
+            {
+                promise.set_value();
+            }
+            else
+            {
+                promise.set_value(std::move(*result));
+            }
+        }
+
+        void fail(std::exception_ptr e) override { promise.set_exception(e); }
+
+        F fn;
+        std::promise<Result> promise;
+        std::optional<std::conditional_t<std::is_void_v<Result>, bool, Result>> result;
+    };
+
+    void push(std::unique_ptr<Item> pItem);
+    void writerLoop();
+    void runBatch(std::vector<std::unique_ptr<Item>>& vBatch);
+
+    CppSQLite3DB mDB;
+    int mnMaxBatch;
+    std::chrono::microseconds mMaxLatency;
+
+    mutable std::mutex mMutex;
+    std::condition_variable mHasWork;
+    std::condition_variable mFinished;
+    std::deque<std::unique_ptr<Item>> mQueue;
+    bool mbStop;
+    int mnFlushWaiters;
+    long long mnSubmitted;
+    long long mnFinished;
+    long long mnFailed;
+    long long mnTransactions;
+
+    // Started last, once everything it uses is set up
+    std::thread mThread;
+};
+
+
+template <typename F>
+std::future<std::invoke_result_t<std::decay_t<F>&, CppSQLite3DB&>> CppSQLite3WriteQueue::submit(F&& fnWrite)
+{
+    std::unique_ptr<Task<std::decay_t<F>>> pTask(new Task<std::decay_t<F>>(std::forward<F>(fnWrite)));
+    auto future = pTask->promise.get_future();
+    push(std::move(pTask));
+    return future;
+}
+
+
+template <typename... Args>
+std::future<int> CppSQLite3WriteQueue::execDML(std::string_view szSQL, const Args&... args)
+{
+    std::tuple<detail::owned_value_t<std::decay_t<Args>>...> values(args...);
+
+    return submit([sSQL = std::string(szSQL), values = std::move(values)](CppSQLite3DB& db)
+    {
+        CppSQLite3Statement stmt = db.compileStatement(sSQL);
+        std::apply([&](const auto&... value) { stmt.bindAll(value...); }, values);
+        return stmt.execDML();
+    });
+}
+
+
+#if defined(CPPSQLITE_HAS_COROUTINES)
+
+class CppSQLite3AsyncDB;
+
+
+/**
+ * Awaitable that runs a piece of work on a CppSQLite3AsyncDB worker thread
+ * and resumes the awaiting coroutine with its result, or rethrows the
+ * exception it ended with.
+*/
+template <typename T>
+class CppSQLite3Awaitable
+{
+public:
+
+    CppSQLite3Awaitable(CppSQLite3AsyncDB* pAsync, std::function<T()> fnWork) :
+        mpAsync(pAsync), mfnWork(std::move(fnWork)) {}
+
+    // Work on a reader connection, or the writer if bWrite, run once it is free
+    CppSQLite3Awaitable(CppSQLite3AsyncDB* pAsync, std::function<T(CppSQLite3Pool::Lease)> fnLease, bool bWrite=false) :
+        mpAsync(pAsync), mfnLease(std::move(fnLease)), mbWrite(bWrite) {}
+
+    bool await_ready() const noexcept { return false; }
+
+    void await_suspend(std::coroutine_handle<> hCoroutine);
+
+    T await_resume()
+    {
+        if (mException)
+        {
+            std::rethrow_exception(mException);
+        }
+
+        if constexpr (!std::is_void_v<T>)
+        {
+            return std::move(*mResult);
+        }
+    }
+
+private:
+
+    template <typename F>
+    void complete(std::coroutine_handle<> hCoroutine, F&& fnWork);
+
+    CppSQLite3AsyncDB* mpAsync;
+    std::function<T()> mfnWork;
+    std::function<T(CppSQLite3Pool::Lease)> mfnLease;
+    bool mbWrite = false;
+    std::optional<std::conditional_t<std::is_void_v<T>, bool, T>> mResult;
+    std::exception_ptr mException;
+};
+
+
+/**
+ * Rows of a query stepped on CppSQLite3AsyncDB workers a batch at a time.
+ * co_await next() moves to the next row and is false at the end; it only
+ * suspends when the current batch is used up. row() is the batch,
+ * positioned on the current row. A stream holds its reader until it is
+ * destroyed, which must happen before its CppSQLite3AsyncDB goes.
+*/
+class CppSQLite3RowStream
+{
+public:
+
+    class Next
+    {
+    public:
+
+        explicit Next(CppSQLite3RowStream* pStream) : mpStream(pStream) {}
+
+        bool await_ready();
+        void await_suspend(std::coroutine_handle<> hCoroutine);
+        bool await_resume();
+
+    private:
+
+        CppSQLite3RowStream* mpStream;
+    };
+
+    CppSQLite3RowStream(CppSQLite3RowStream&& rStream) noexcept = default;
+    CppSQLite3RowStream& operator=(CppSQLite3RowStream&& rStream) noexcept;
+
+    ~CppSQLite3RowStream();
+
+    Next next() { return Next(this); }
+
+    const CppSQLite3ResultSet& row() const { return mRows; }
+
+private:
+
+    friend class CppSQLite3AsyncDB;
+
+    CppSQLite3RowStream(CppSQLite3AsyncDB* pAsync, int nBatchRows);
+
+    // Replaces the batch with up to mnBatchRows more rows
+    void fetch();
+
+    // Finishes with the query, then hands its reader back
+    void release() noexcept;
+
+    CppSQLite3AsyncDB* mpAsync;
+    // Declared in this order so the query goes before its statement, and
+    // the statement before the connection
+    CppSQLite3Pool::Lease mLease;
+    CppSQLite3Statement mStatement;
+    CppSQLite3Query mQuery;
+    CppSQLite3ResultSet mRows;
+    int mnRow;
+    int mnBatchRows;
+    std::exception_ptr mException;
+};
+
+
+/**
+ * Coroutine front end to a CppSQLite3Pool. Each call returns an awaitable
+ * that runs on one of nThreads worker threads with a pooled connection.
+ * Coroutines resume on the worker unless fnResume is given, which is then
+ * handed each coroutine to resume, e.g. to post it back to a reactor.
+*/
+class CppSQLite3AsyncDB
+{
+public:
+
+    // nThreads=0 uses one per reader plus one for the writer
+    CppSQLite3AsyncDB(CppSQLite3Pool& pool,
+                    int nThreads=0,
+                    std::function<void(std::coroutine_handle<>)> fnResume=nullptr);
+
+    CppSQLite3AsyncDB(const CppSQLite3AsyncDB&) = delete;
+    CppSQLite3AsyncDB& operator=(const CppSQLite3AsyncDB&) = delete;
+
+    // Runs the work already queued, then stops the workers
+    ~CppSQLite3AsyncDB();
+
+    // Rows stepped per thread handoff by row streams
+    void setBatchRows(int nBatchRows) { mnBatchRows = nBatchRows > 0 ? nBatchRows : 1; }
+
+    // On the writer connection, yields the number of rows changed. The
+    // writer is handed back before the coroutine resumes.
+    template <typename... Args>
+    CppSQLite3Awaitable<int> execDML(std::string_view szSQL, const Args&... args);
+
+    // On a reader connection, held until the stream is destroyed
+    template <typename... Args>
+    CppSQLite3Awaitable<CppSQLite3RowStream> execQuery(std::string_view szSQL, const Args&... args);
+
+    // On the statement's own connection, which must not be used elsewhere
+    // until the awaitable completes or the stream is destroyed
+    CppSQLite3Awaitable<int> execDML(CppSQLite3Statement& stmt);
+    CppSQLite3Awaitable<CppSQLite3RowStream> execQuery(CppSQLite3Statement& stmt);
+
+    void post(std::function<void()> fnJob);
+    void resume(std::coroutine_handle<> hCoroutine);
+
+    // Runs fnJob with a reader or the writer lease. A job that finds the
+    // connection busy is parked rather than blocking a worker, as a worker
+    // may be needed to step the stream or finish the write holding it. It
+    // gets an empty lease if the workers stop first.
+    void postRead(std::function<void(CppSQLite3Pool::Lease)> fnJob);
+    void postWrite(std::function<void(CppSQLite3Pool::Lease)> fnJob);
+
+    // Requeues the parked jobs, when a connection may have been returned
+    void retryParked();
+
+private:
+
+    void workerLoop();
+    void tryRead(std::function<void(CppSQLite3Pool::Lease)> fnJob);
+    void tryWrite(std::function<void(CppSQLite3Pool::Lease)> fnJob);
+
+    CppSQLite3Pool& mPool;
+    int mnBatchRows;
+    std::function<void(std::coroutine_handle<>)> mfnResume;
+
+    std::mutex mMutex;
+    std::condition_variable mHasWork;
+    std::deque<std::function<void()>> mJobs;
+    // Retries of jobs waiting for a connection
+    std::deque<std::function<void()>> mParked;
+    bool mbStop;
+    std::vector<std::thread> mvThreads;
+};
+
+
+template <typename T>
+void CppSQLite3Awaitable<T>::await_suspend(std::coroutine_handle<> hCoroutine)
+{
+    if (mfnLease)
+    {
+        std::function<void(CppSQLite3Pool::Lease)> fnJob = [this, hCoroutine](CppSQLite3Pool::Lease lease)
+        {
+            complete(hCoroutine, [&] { return mfnLease(std::move(lease)); });
+        };
+
+        if (mbWrite)
+        {
+            mpAsync->postWrite(std::move(fnJob));
+        }
+        else
+        {
+            mpAsync->postRead(std::move(fnJob));
+        }
+    }
+    else
+    {
+        mpAsync->post([this, hCoroutine] { complete(hCoroutine, mfnWork); });
+    }
+}
+
+
+template <typename T>
+template <typename F>
+void CppSQLite3Awaitable<T>::complete(std::coroutine_handle<> hCoroutine, F&& fnWork)
+{
+    try
+    {
+        if constexpr (std::is_void_v<T>)
+        {
+            fnWork();
+            mResult.emplace(true);
+        }
+        else
+        {
+            mResult.emplace(fnWork());
+        }
+    }
+    catch (...)
+    {
+        mException = std::current_exception();
+    }
+
+    mpAsync->resume(hCoroutine);
+}
+
+
+template <typename... Args>
+CppSQLite3Awaitable<int> CppSQLite3AsyncDB::execDML(std::string_view szSQL, const Args&... args)
+{
+    std::tuple<detail::owned_value_t<std::decay_t<Args>>...> values(args...);
+
+    return CppSQLite3Awaitable<int>(this, [this, sSQL = std::string(szSQL), values](CppSQLite3Pool::Lease lease)
+    {
+        if (!lease)
+        {
+            throw CppSQLite3Exception(CPPSQLITE_ERROR,
+                                    "Workers stopped before the writer was free",
+                                    false);
+        }
+
+        int nChanged;
+        {
+            CppSQLite3Statement stmt = lease->compileStatement(sSQL);
+            std::apply([&](const auto&... value) { stmt.bindAll(value...); }, values);
+            nChanged = stmt.execDML();
+        }
+
+        lease.release();
+        retryParked();
+        return nChanged;
+    }, true);
+}
+
+
+template <typename... Args>
+CppSQLite3Awaitable<CppSQLite3RowStream> CppSQLite3AsyncDB::execQuery(std::string_view szSQL, const Args&... args)
+{
+    std::tuple<detail::owned_value_t<std::decay_t<Args>>...> values(args...);
+
+    return CppSQLite3Awaitable<CppSQLite3RowStream>(this, [this, sSQL = std::string(szSQL), values](CppSQLite3Pool::Lease lease)
+    {
+        if (!lease)
+        {
+            throw CppSQLite3Exception(CPPSQLITE_ERROR,
+                                    "Workers stopped before a reader was free",
+                                    false);
+        }
+
+        CppSQLite3RowStream stream(this, mnBatchRows);
+        stream.mLease = std::move(lease);
+        stream.mStatement = stream.mLease->compileStatement(sSQL);
+        std::apply([&](const auto&... value) { stream.mStatement.bindAll(value...); }, values);
+        stream.mQuery = stream.mStatement.execQuery();
+        stream.fetch();
+        return stream;
+    });
+}
+
+#endif
+
 #endif
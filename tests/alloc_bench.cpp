@@ -0,0 +1,184 @@
+////////////////////////////////////////////////////////////////////////////////
+// Latency and memory of the pool allocator against glibc malloc, under many
+// reader threads
+//
+// Each thread holds a reader of a CppSQLite3Pool and runs short range reads
+// into a CppSQLite3ResultSet, with a sorted read now and then, for a fixed
+// time. Every allocator is tried in a process of its own, as it has to be
+// installed before SQLite is initialised; the process reports queries per
+// second, the median, p99 and p99.9 query latency, and its RSS at the end
+// and at its peak. The database is made in the working directory and
+// removed at the end. POSIX only.
+//
+// g++ -std=c++17 -O2 -I.. alloc_bench.cpp -lsqlite3 -lpthread -o alloc_bench
+// ./alloc_bench [threads] [seconds]
+////////////////////////////////////////////////////////////////////////////////
+#include "../CppSQLite3.cpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <random>
+#include <thread>
+#include <vector>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static const char* gszFile = "alloc_bench.db";
+static const int gnRows = 200000;
+
+
+// VmRSS or VmHWM from /proc/self/status, in MB
+static double statusMegabytes(const char* szField)
+{
+    FILE* fp = fopen("/proc/self/status", "r");
+    char szLine[256];
+    double dMegabytes = 0;
+
+    while (fp && fgets(szLine, sizeof(szLine), fp))
+    {
+        if (strncmp(szLine, szField, strlen(szField)) == 0)
+        {
+            dMegabytes = atof(szLine + strlen(szField) + 1) / 1024;
+        }
+    }
+
+    if (fp)
+    {
+        fclose(fp);
+    }
+
+    return dMegabytes;
+}
+
+
+// Runs fn in a child process and waits for it
+static void inChild(const std::function<void()>& fn)
+{
+    fflush(stdout);
+    pid_t pid = fork();
+
+    if (pid == 0)
+    {
+        fn();
+        fflush(stdout);
+        _exit(0);
+    }
+
+    int nStatus;
+    waitpid(pid, &nStatus, 0);
+}
+
+
+static void createDatabase()
+{
+    remove(gszFile);
+    CppSQLite3DB db;
+    db.open(gszFile);
+    db.execDML("pragma journal_mode=wal");
+    db.execDML("create table t(id integer primary key, name text, payload text)");
+    db.execDML("begin");
+    CppSQLite3Statement stmt = db.compileStatement("insert into t values(?, ?, ?)");
+    for (int nRow = 0; nRow < gnRows; nRow++)
+    {
+        stmt.bind(1, nRow);
+        stmt.bind(2, std::string("name ") + std::to_string((nRow * 7919) % gnRows));
+        stmt.bind(3, std::string(40 + nRow % 200, 'x'));
+        stmt.execDML();
+        stmt.reset();
+    }
+    db.execDML("commit");
+}
+
+
+static void run(const char* szName, int nThreads, int nSeconds)
+{
+    CppSQLite3Pool pool(gszFile, nThreads);
+    std::vector<std::vector<float>> vLatencies(nThreads);
+    std::vector<std::thread> vThreads;
+    std::chrono::steady_clock::time_point tEnd = std::chrono::steady_clock::now() + std::chrono::seconds(nSeconds);
+
+    for (int nThread = 0; nThread < nThreads; nThread++)
+    {
+        vThreads.emplace_back([&, nThread]
+        {
+            CppSQLite3Pool::Lease lease = pool.reader();
+            std::mt19937 rng(nThread);
+            std::vector<float>& vMicros = vLatencies[nThread];
+
+            for (int n = 0; std::chrono::steady_clock::now() < tEnd; n++)
+            {
+                bool bSort = n % 8 == 0;
+                int nFirst = static_cast<int>(rng() % gnRows);
+                std::chrono::steady_clock::time_point tStart = std::chrono::steady_clock::now();
+
+                CppSQLite3Statement stmt = lease->compileStatement(bSort ?
+                    "select name from t where id between ? and ? order by name" :
+                    "select id, name, payload from t where id between ? and ?");
+                stmt.bindAll(nFirst, nFirst + (bSort ? 500 : 50));
+                CppSQLite3Query q = stmt.execQuery();
+                CppSQLite3ResultSet rs;
+                rs.fetch(q);
+
+                vMicros.push_back(std::chrono::duration<float, std::micro>(std::chrono::steady_clock::now() - tStart).count());
+            }
+        });
+    }
+
+    for (std::thread& thread : vThreads)
+    {
+        thread.join();
+    }
+
+    std::vector<float> vAll;
+    for (const std::vector<float>& vMicros : vLatencies)
+    {
+        vAll.insert(vAll.end(), vMicros.begin(), vMicros.end());
+    }
+    std::sort(vAll.begin(), vAll.end());
+
+    auto percentile = [&](double dFraction) { return vAll[static_cast<std::size_t>(dFraction * (vAll.size() - 1))]; };
+
+    printf("%-24s %9.0f  %8.1f  %8.1f  %8.1f  %8.1f  %8.1f\n", szName,
+        vAll.size() / static_cast<double>(nSeconds),
+        percentile(0.5), percentile(0.99), percentile(0.999),
+        statusMegabytes("VmRSS:"), statusMegabytes("VmHWM:"));
+}
+
+
+int main(int argc, char** argv)
+{
+    int nThreads = argc > 1 ? atoi(argv[1]) : 32;
+    int nSeconds = argc > 2 ? atoi(argv[2]) : 5;
+
+    inChild(createDatabase);
+
+    printf("%d reader threads, %d s\n", nThreads, nSeconds);
+    printf("%-24s %9s  %8s  %8s  %8s  %8s  %8s\n", "", "queries/s", "p50 us", "p99 us", "p99.9 us", "RSS MB", "peak MB");
+
+    inChild([&]
+    {
+        run("glibc malloc", nThreads, nSeconds);
+    });
+    inChild([&]
+    {
+        sqlite3_config(SQLITE_CONFIG_MEMSTATUS, 0);
+        run("glibc malloc, no stats", nThreads, nSeconds);
+    });
+    inChild([&]
+    {
+        CppSQLite3Runtime::installAllocator();
+        run("pool", nThreads, nSeconds);
+    });
+    inChild([&]
+    {
+        CppSQLite3Runtime::installAllocator(false);
+        run("pool, no stats", nThreads, nSeconds);
+    });
+
+    remove(gszFile);
+    remove((std::string(gszFile) + "-wal").c_str());
+    remove((std::string(gszFile) + "-shm").c_str());
+    return 0;
+}
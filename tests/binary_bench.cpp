@@ -0,0 +1,105 @@
+////////////////////////////////////////////////////////////////////////////////
+// Throughput of the binary encoding, against the original SQLite encode.c
+//
+// Text-like data needs few escapes and random data many, so both are timed
+// for sqlite3_encode_binary(), sqlite3_decode_binary() and each kernel
+// built for this machine.
+//
+// g++ -std=c++17 -O2 -I.. binary_bench.cpp -lsqlite3 -o binary_bench
+// ./binary_bench [megabytes]
+////////////////////////////////////////////////////////////////////////////////
+#include "../CppSQLite3.cpp"
+#include "encode_ref.h"
+
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <random>
+#include <vector>
+
+
+// Best of a few runs, in MB/s of binary
+static double measure(int nLen, const std::function<void()>& fn)
+{
+    double dBest = 0;
+
+    for (int n = 0; n < 5; n++)
+    {
+        std::chrono::steady_clock::time_point tStart = std::chrono::steady_clock::now();
+        fn();
+        double dSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - tStart).count();
+        dBest = std::max(dBest, nLen / 1e6 / dSeconds);
+    }
+
+    return dBest;
+}
+
+
+static void report(const char* szData, const char* szName, double dRef, double dNew)
+{
+    printf("%-7s %-18s %9.0f MB/s  %9.0f MB/s  %5.2fx\n", szData, szName, dRef, dNew, dNew / dRef);
+}
+
+
+int main(int argc, char** argv)
+{
+    int nLen = (argc > 1 ? atoi(argv[1]) : 64) << 20;
+    std::mt19937 rng(42);
+
+    printf("%-7s %-18s %14s  %14s\n", "data", "", "encode.c", "CppSQLite3");
+
+    for (int nData = 0; nData < 2; nData++)
+    {
+        const char* szData = nData ? "random" : "text";
+        std::vector<unsigned char> in(nLen);
+
+        for (unsigned char& c : in)
+        {
+            if (nData)
+            {
+                c = static_cast<unsigned char>(rng());
+            }
+            else
+            {
+                c = rng() % 100 ? static_cast<unsigned char>(0x41 + rng() % 26) : static_cast<unsigned char>(rng());
+            }
+        }
+
+        std::vector<unsigned char> enc(3 + (257 * static_cast<size_t>(nLen)) / 254);
+        std::vector<unsigned char> out(enc.size());
+        std::vector<unsigned char> dec(nLen + 1);
+        int nEnc = refEncode(in.data(), nLen, enc.data());
+        int e = enc[0];
+
+        double dRefEncode = measure(nLen, [&] { refEncode(in.data(), nLen, out.data()); });
+        double dRefDecode = measure(nLen, [&] { refDecode(enc.data(), dec.data()); });
+
+        report(szData, "encode", dRefEncode,
+            measure(nLen, [&] { sqlite3_encode_binary(in.data(), nLen, out.data()); }));
+        report(szData, "decode", dRefDecode,
+            measure(nLen, [&] { sqlite3_decode_binary(enc.data(), dec.data()); }));
+
+        int nRead;
+#if defined(CPPSQLITE_X86_SIMD)
+        report(szData, "sse2 encode", dRefEncode,
+            measure(nLen, [&] { encodeBinarySSE2(in.data(), nLen, out.data(), e); }));
+        report(szData, "sse2 decode", dRefDecode,
+            measure(nLen, [&] { decodeBinarySSE2(enc.data() + 1, nEnc - 1, dec.data(), e, &nRead); }));
+
+        if (cpuHasAVX2())
+        {
+            report(szData, "avx2 encode", dRefEncode,
+                measure(nLen, [&] { encodeBinaryAVX2(in.data(), nLen, out.data(), e); }));
+            report(szData, "avx2 decode", dRefDecode,
+                measure(nLen, [&] { decodeBinaryAVX2(enc.data() + 1, nEnc - 1, dec.data(), e, &nRead); }));
+        }
+#else
+        report(szData, "portable encode", dRefEncode,
+            measure(nLen, [&] { encodeBinaryPortable(in.data(), nLen, out.data(), e); }));
+        report(szData, "portable decode", dRefDecode,
+            measure(nLen, [&] { decodeBinaryPortable(enc.data() + 1, nEnc - 1, dec.data(), e, &nRead); }));
+#endif
+    }
+
+    return 0;
+}
@@ -0,0 +1,304 @@
+////////////////////////////////////////////////////////////////////////////////
+// Differential fuzz test of the binary encoding against SQLite encode.c
+//
+// Every kernel built for this machine, CppSQLite3Binary (which codes in
+// place) and the chunked encoder and decoder must give the same output as
+// the original sqlite3_encode_binary() and sqlite3_decode_binary(), and
+// reject the same malformed input. CppSQLite3.cpp is included to reach the
+// kernels, which are static.
+//
+// g++ -std=c++17 -O1 -g -fsanitize=address,undefined -I.. binary_fuzz.cpp -lsqlite3 -o binary_fuzz
+// ./binary_fuzz [iterations] [seed]
+////////////////////////////////////////////////////////////////////////////////
+#include "../CppSQLite3.cpp"
+#include "encode_ref.h"
+
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#define CHECK(expr) \
+    if (!(expr)) \
+    { \
+        fprintf(stderr, "%s:%d: check failed: %s (iteration %ld)\n", __FILE__, __LINE__, #expr, gnIteration); \
+        exit(1); \
+    }
+
+static long gnIteration = 0;
+
+
+typedef int (*KernelEncode)(const unsigned char* in, int n, unsigned char* out, int e);
+typedef int (*KernelDecode)(const unsigned char* in, int n, unsigned char* out, int e, int* pnRead);
+
+struct Kernel
+{
+    const char* szName;
+    KernelEncode encode;
+    KernelDecode decode;
+};
+
+
+static std::vector<Kernel> kernels()
+{
+    std::vector<Kernel> vKernels;
+#if defined(CPPSQLITE_X86_SIMD)
+    vKernels.push_back(Kernel{"sse2", encodeBinarySSE2, decodeBinarySSE2});
+    if (cpuHasAVX2())
+    {
+        vKernels.push_back(Kernel{"avx2", encodeBinaryAVX2, decodeBinaryAVX2});
+    }
+#else
+    vKernels.push_back(Kernel{"portable", encodeBinaryPortable, decodeBinaryPortable});
+#endif
+    vKernels.push_back(Kernel{"dispatch", encodeBinaryBody, decodeBinaryBody});
+    return vKernels;
+}
+
+
+// Runs of the bytes that need escapes under some offset are what the
+// kernels handle apart from plain bytes, so most inputs are built of them
+static std::vector<unsigned char> makeInput(std::mt19937& rng, int nLen)
+{
+    std::vector<unsigned char> v(nLen);
+    int nMode = rng() % 5;
+
+    for (unsigned char& c : v)
+    {
+        switch (nMode)
+        {
+        case 0: c = static_cast<unsigned char>(rng()); break;
+        case 1: c = "\x00\x01\x27\x02\x28"[rng() % 5]; break;
+        case 2: c = static_cast<unsigned char>(rng() % 4); break;
+        case 3: c = rng() % 50 ? 7 : static_cast<unsigned char>(rng()); break;
+        default: c = rng() % 16 ? 0x41 : "\x00\x01\x27"[rng() % 3]; break;
+        }
+    }
+
+    return v;
+}
+
+
+// Splits nLen into chunks of random length, some of them empty
+static std::vector<int> makeChunks(std::mt19937& rng, int nLen)
+{
+    std::vector<int> vChunks;
+    int nMax = 1 + static_cast<int>(rng() % 70);
+
+    while (nLen > 0)
+    {
+        int nChunk = std::min(nLen, static_cast<int>(rng() % (nMax + 1)));
+        vChunks.push_back(nChunk);
+        nLen -= nChunk;
+    }
+
+    return vChunks;
+}
+
+
+static void checkKernels(const std::vector<Kernel>& vKernels,
+                        const std::vector<unsigned char>& in,
+                        const std::vector<unsigned char>& ref,
+                        int nRef)
+{
+    int nLen = static_cast<int>(in.size());
+    int e = ref[0];
+    std::vector<unsigned char> out(nRef + 1);
+    std::vector<unsigned char> dec(nLen + 1);
+
+    for (const Kernel& k : vKernels)
+    {
+        std::fill(out.begin(), out.end(), 0xAA);
+        CHECK(k.encode(in.data(), nLen, out.data(), e) == nRef - 1);
+        CHECK(memcmp(out.data(), ref.data() + 1, nRef - 1) == 0);
+
+        int nRead = 0;
+        CHECK(k.decode(ref.data() + 1, nRef - 1, dec.data(), e, &nRead) == nLen);
+        CHECK(nRead == nRef - 1);
+        CHECK(memcmp(dec.data(), in.data(), nLen) == 0);
+
+        // In place, the way CppSQLite3Binary::getBinary() decodes
+        std::vector<unsigned char> buf(ref.begin(), ref.begin() + nRef + 1);
+        CHECK(k.decode(buf.data() + 1, nRef - 1, buf.data(), e, &nRead) == nLen);
+        CHECK(memcmp(buf.data(), in.data(), nLen) == 0);
+    }
+}
+
+
+static void checkMalformed(std::mt19937& rng,
+                        const std::vector<Kernel>& vKernels,
+                        const std::vector<unsigned char>& ref,
+                        int nRef)
+{
+    // An escape byte followed by anything but 1, 2 or 3
+    std::vector<unsigned char> bad(ref.begin(), ref.begin() + nRef + 1);
+    int nPos = 1 + static_cast<int>(rng() % (nRef - 1));
+    bad[nPos] = 1;
+    if (nPos + 1 < nRef)
+    {
+        bad[nPos + 1] = static_cast<unsigned char>(4 + rng() % 252);
+    }
+
+    int nBad = static_cast<int>(strlen(reinterpret_cast<const char*>(bad.data())));
+    std::vector<unsigned char> expect(nRef);
+    std::vector<unsigned char> dec(nRef);
+    int nExpect = refDecode(bad.data(), expect.data());
+
+    for (const Kernel& k : vKernels)
+    {
+        int nRead = 0;
+        int nDec = k.decode(bad.data() + 1, nBad - 1, dec.data(), bad[0], &nRead);
+        CHECK((nDec < 0) == (nExpect < 0));
+        if (nExpect >= 0)
+        {
+            CHECK(nDec == nExpect && memcmp(dec.data(), expect.data(), nExpect) == 0);
+        }
+    }
+
+    bool bThrew = false;
+    try
+    {
+        CppSQLite3BinaryDecoder decoder;
+        decoder.decode(bad.data(), nBad, dec.data());
+        decoder.finish();
+    }
+    catch (CppSQLite3Exception&)
+    {
+        bThrew = true;
+    }
+    CHECK(bThrew == (nExpect < 0));
+}
+
+
+static void checkBinary(const std::vector<unsigned char>& in,
+                        const std::vector<unsigned char>& ref,
+                        int nRef)
+{
+    int nLen = static_cast<int>(in.size());
+
+    CppSQLite3Binary binary;
+    binary.setBinary(in.data(), nLen);
+    CHECK(binary.getEncodedLength() == nRef);
+    CHECK(memcmp(binary.getEncoded(), ref.data(), nRef + 1) == 0);
+    CHECK(binary.getBinaryLength() == nLen);
+    CHECK(memcmp(binary.getBinary(), in.data(), nLen) == 0);
+
+    CppSQLite3Binary decoded;
+    decoded.setEncoded(ref.data());
+    CHECK(decoded.getBinaryLength() == nLen);
+    CHECK(memcmp(decoded.getBinary(), in.data(), nLen) == 0);
+
+    // sqlite3_encode_binary() from the end of its own output buffer
+    std::vector<unsigned char> buf(3 + (257 * static_cast<size_t>(nLen)) / 254);
+    unsigned char* pIn = buf.data() + buf.size() - nLen;
+    memcpy(pIn, in.data(), nLen);
+    CHECK(sqlite3_encode_binary(pIn, nLen, buf.data()) == nRef);
+    CHECK(memcmp(buf.data(), ref.data(), nRef + 1) == 0);
+
+    std::vector<unsigned char> dec(nLen + 1);
+    CHECK(sqlite3_decode_binary(ref.data(), dec.data()) == nLen);
+    CHECK(memcmp(dec.data(), in.data(), nLen) == 0);
+}
+
+
+static void checkChunked(std::mt19937& rng,
+                        const std::vector<unsigned char>& in,
+                        const std::vector<unsigned char>& ref,
+                        int nRef)
+{
+    std::vector<int> vChunks = makeChunks(rng, static_cast<int>(in.size()));
+
+    CppSQLite3BinaryEncoder encoder;
+    int nPos = 0;
+    for (int nChunk : vChunks)
+    {
+        encoder.scan(in.data() + nPos, nChunk);
+        nPos += nChunk;
+    }
+
+    std::vector<unsigned char> out;
+    std::vector<unsigned char> chunk;
+    nPos = 0;
+    for (int nChunk : vChunks)
+    {
+        chunk.resize(CppSQLite3BinaryEncoder::chunkBound(nChunk));
+        int nOut = encoder.encode(in.data() + nPos, nChunk, chunk.data());
+        out.insert(out.end(), chunk.begin(), chunk.begin() + nOut);
+        nPos += nChunk;
+    }
+
+    unsigned char end[2];
+    int nEnd = encoder.finish(end);
+    out.insert(out.end(), end, end + nEnd + 1);
+    CHECK(static_cast<int>(out.size()) == nRef + 1);
+    CHECK(memcmp(out.data(), ref.data(), nRef + 1) == 0);
+
+    // Empty input encodes as "x", which is not an encoding to decode
+    if (in.empty())
+    {
+        return;
+    }
+
+    // Splits here fall inside escapes as well as between them
+    CppSQLite3BinaryDecoder decoder;
+    std::vector<unsigned char> dec;
+    nPos = 0;
+    for (int nChunk : makeChunks(rng, nRef))
+    {
+        chunk.resize(nChunk);
+        int nOut = decoder.decode(ref.data() + nPos, nChunk, chunk.data());
+        dec.insert(dec.end(), chunk.begin(), chunk.begin() + nOut);
+        nPos += nChunk;
+    }
+    decoder.finish();
+    CHECK(dec == in);
+}
+
+
+int main(int argc, char** argv)
+{
+    long nIterations = argc > 1 ? atol(argv[1]) : 200000;
+    unsigned int nSeed = argc > 2 ? static_cast<unsigned int>(atol(argv[2])) : 42;
+
+    std::mt19937 rng(nSeed);
+    std::vector<Kernel> vKernels = kernels();
+
+    for (gnIteration = 0; gnIteration < nIterations; gnIteration++)
+    {
+        // Every short length, then mostly a few vectors' worth with some
+        // long enough for the unrolled loops
+        int nLen;
+        if (gnIteration < 1000)
+        {
+            nLen = static_cast<int>(gnIteration);
+        }
+        else
+        {
+            nLen = static_cast<int>(rng() % (gnIteration % 10 == 0 ? 20000 : 300));
+        }
+
+        std::vector<unsigned char> in = makeInput(rng, nLen);
+        std::vector<unsigned char> ref(3 + (257 * static_cast<size_t>(nLen)) / 254);
+        int nRef = refEncode(in.data(), nLen, ref.data());
+
+        std::vector<unsigned char> out(ref.size());
+        CHECK(sqlite3_encode_binary(in.data(), nLen, out.data()) == nRef);
+        CHECK(memcmp(out.data(), ref.data(), nRef + 1) == 0);
+
+        if (nLen > 0)
+        {
+            checkKernels(vKernels, in, ref, nRef);
+            checkMalformed(rng, vKernels, ref, nRef);
+            checkBinary(in, ref, nRef);
+        }
+
+        checkChunked(rng, in, ref, nRef);
+    }
+
+    printf("%ld iterations, kernels:", nIterations);
+    for (const Kernel& k : vKernels)
+    {
+        printf(" %s", k.szName);
+    }
+    printf("\n");
+    return 0;
+}
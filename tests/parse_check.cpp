@@ -0,0 +1,86 @@
+////////////////////////////////////////////////////////////////////////////////
+// Check of the number parsing behind the getDoubleField accessors
+//
+// parseDouble() reads with std::from_chars where it can and must give the
+// same double as strtod() in the C locale for any input, including values
+// out of range and hex floats, which from_chars does not read. Fixed edge
+// cases are followed by random doubles printed as decimal and hex.
+// CppSQLite3.cpp is included to reach parseDouble(), which is static.
+//
+// g++ -std=c++17 -O1 -g -fsanitize=address,undefined -I.. parse_check.cpp -lsqlite3 -o parse_check
+// ./parse_check [iterations] [seed]
+////////////////////////////////////////////////////////////////////////////////
+#include "../CppSQLite3.cpp"
+
+#include <cmath>
+#include <cstdio>
+#include <random>
+
+#define CHECK(expr, szValue) \
+    if (!(expr)) \
+    { \
+        fprintf(stderr, "%s:%d: check failed: %s (\"%s\")\n", __FILE__, __LINE__, #expr, szValue); \
+        exit(1); \
+    }
+
+
+static bool sameDouble(double d1, double d2)
+{
+    return (std::isnan(d1) && std::isnan(d2)) || std::memcmp(&d1, &d2, sizeof(double)) == 0;
+}
+
+
+static void checkValue(const char* szValue)
+{
+    CHECK(sameDouble(parseDouble(szValue), std::strtod(szValue, 0)), szValue);
+}
+
+
+int main(int argc, char** argv)
+{
+    long nIterations = argc > 1 ? atol(argv[1]) : 1000000;
+    std::mt19937_64 rng(argc > 2 ? strtoul(argv[2], 0, 10) : 42);
+
+    static const char* aszValues[] =
+    {
+        "0", "-0", "1.5", " \t+2.25", "12abc", "", "abc", "+", "-", ".", "e5",
+        "1e999", "-1e999", "1e-400", "4.9e-324", "2.2250738585072011e-308",
+        "1.7976931348623157e308", "1.7976931348623159e308",
+        "0x1p3", "-0X1.8p1", " 0x10", "0x", "0xg", "0x1p99999",
+        "inf", "-Infinity", "nan", "1e", "1e+", "1.e2", ".5"
+    };
+
+    for (const char* szValue : aszValues)
+    {
+        checkValue(szValue);
+    }
+
+    CHECK(parseDouble("1e999") == HUGE_VAL, "1e999");
+    CHECK(parseDouble("0x1p3") == 8.0, "0x1p3");
+
+    // Text cells reach the parser through CppSQLite3Table
+    CppSQLite3DB db;
+    db.open(":memory:");
+    CppSQLite3Table t = db.getTable("select '1e999', '0x1p3'");
+    CHECK(t.getDoubleField(0) == HUGE_VAL, "1e999");
+    CHECK(t.getDoubleField(1) == 8.0, "0x1p3");
+
+    char szValue[64];
+
+    for (long n = 0; n < nIterations; n++)
+    {
+        std::uint64_t nBits = rng();
+        double dValue;
+        std::memcpy(&dValue, &nBits, sizeof(double));
+
+        snprintf(szValue, sizeof(szValue), "%.17g", dValue);
+        checkValue(szValue);
+        snprintf(szValue, sizeof(szValue), "%a", dValue);
+        checkValue(szValue);
+        snprintf(szValue, sizeof(szValue), "%.3e", dValue);
+        checkValue(szValue);
+    }
+
+    printf("ok, %ld iterations\n", nIterations);
+    return 0;
+}
@@ -0,0 +1,140 @@
+////////////////////////////////////////////////////////////////////////////////
+// CppSQLite3ResultSet against CppSQLite3Table on a million-row result
+//
+// Times loading the result with getTable() and with fetch(), the heap each
+// keeps for it, and a scan summing a double column by field index (and, with
+// C++20, through doubleColumn()). Heap use is read from glibc mallinfo2(),
+// which sees both the sqlite3_get_table() strings and the typed vectors.
+//
+// g++ -std=c++17 -O2 -I.. resultset_bench.cpp -lsqlite3 -o resultset_bench
+// ./resultset_bench [rows]
+////////////////////////////////////////////////////////////////////////////////
+#include "../CppSQLite3.cpp"
+
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+
+// Best of a few runs, in milliseconds
+static double measure(int nRuns, const std::function<void()>& fn)
+{
+    double dBest = 0;
+
+    for (int n = 0; n < nRuns; n++)
+    {
+        std::chrono::steady_clock::time_point tStart = std::chrono::steady_clock::now();
+        fn();
+        double dMillis = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - tStart).count();
+        dBest = n ? std::min(dBest, dMillis) : dMillis;
+    }
+
+    return dBest;
+}
+
+
+static double heapMegabytes()
+{
+#if defined(__GLIBC__)
+    struct mallinfo2 info = mallinfo2();
+    return (info.uordblks + info.hblkhd) / 1e6;
+#else
+    return 0;
+#endif
+}
+
+
+static void report(const char* szName, const char* szUnit, double dTable, double dResultSet)
+{
+    printf("%-16s %10.1f %-3s %10.1f %-3s %6.2fx\n", szName, dTable, szUnit, dResultSet, szUnit, dTable / dResultSet);
+}
+
+
+int main(int argc, char** argv)
+{
+    int nRows = argc > 1 ? atoi(argv[1]) : 1000000;
+    const char* szSelect = "select id, price, name, qty from t";
+
+    CppSQLite3DB db;
+    db.open(":memory:");
+    db.execDML("create table t(id integer, price real, name text, qty integer)");
+    db.execDML("begin");
+    CppSQLite3Statement stmt = db.compileStatement("insert into t values(?, ?, ?, ?)");
+    for (int nRow = 0; nRow < nRows; nRow++)
+    {
+        stmt.bind(1, nRow);
+        stmt.bind(2, nRow * 0.01);
+        stmt.bind(3, "item name");
+        if (nRow % 10)
+        {
+            stmt.bind(4, nRow % 1000);
+        }
+        stmt.execDML();
+        stmt.reset();
+    }
+    db.execDML("commit");
+
+    volatile double dSink = 0;
+
+    printf("%-16s %14s %14s\n", "", "Table", "ResultSet");
+
+    double dLoadTable = measure(3, [&] { CppSQLite3Table t = db.getTable(szSelect); });
+    double dLoadResultSet = measure(3, [&] { CppSQLite3Query q = db.execQuery(szSelect); CppSQLite3ResultSet rs; rs.fetch(q); });
+    report("load", "ms", dLoadTable, dLoadResultSet);
+
+    double dHeap = heapMegabytes();
+    CppSQLite3Table t = db.getTable(szSelect);
+    double dHeapTable = heapMegabytes() - dHeap;
+
+    dHeap = heapMegabytes();
+    CppSQLite3ResultSet rs;
+    {
+        CppSQLite3Query q = db.execQuery(szSelect);
+        rs.fetch(q);
+    }
+    double dHeapResultSet = heapMegabytes() - dHeap;
+    report("heap", "MB", dHeapTable, dHeapResultSet);
+
+    auto sumTable = [&]
+    {
+        double dSum = 0;
+        for (int n = 0; n < nRows; n++)
+        {
+            t.setRow(n);
+            dSum += t.getDoubleField(1) + t.getIntField(3);
+        }
+        dSink = dSum;
+    };
+    auto sumResultSet = [&]
+    {
+        double dSum = 0;
+        for (int n = 0; n < nRows; n++)
+        {
+            rs.setRow(n);
+            dSum += rs.getDoubleField(1) + rs.getIntField(3);
+        }
+        dSink = dSum;
+    };
+    double dSumTable = measure(5, sumTable);
+    report("scan by index", "ms", dSumTable, measure(5, sumResultSet));
+
+#if defined(__cpp_lib_span)
+    auto sumColumns = [&]
+    {
+        std::span<const double> vPrice = rs.doubleColumn(1);
+        std::span<const long long> vQty = rs.int64Column(3);
+        double dSum = 0;
+        for (int n = 0; n < nRows; n++)
+        {
+            dSum += vPrice[n] + vQty[n];
+        }
+        dSink = dSum;
+    };
+    report("scan by column", "ms", dSumTable, measure(5, sumColumns));
+#endif
+
+    return 0;
+}
@@ -0,0 +1,151 @@
+////////////////////////////////////////////////////////////////////////////////
+// Named field access on a CppSQLite3Table, against the original accessors
+//
+// The original getIntField("name") and friends looked the name up with a
+// strcmp() scan of the header row twice, once for fieldIsNull() and once for
+// fieldValue(), then parsed with atoi()/atof(). That is reproduced here on
+// top of fieldName()/fieldValue(int) and timed against the hashed lookup
+// and from_chars parsing, with and without setCacheNumbers(). The table has
+// 16 columns and the fields read are the last ones, as in a wide select.
+//
+// g++ -std=c++17 -O2 -I.. table_bench.cpp -lsqlite3 -o table_bench
+// ./table_bench [rows]
+////////////////////////////////////////////////////////////////////////////////
+#include "../CppSQLite3.cpp"
+
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <string>
+
+
+// Best of a few runs, in millions of fields read per second
+static double measure(long nReads, const std::function<void()>& fn)
+{
+    double dBest = 0;
+
+    for (int n = 0; n < 5; n++)
+    {
+        std::chrono::steady_clock::time_point tStart = std::chrono::steady_clock::now();
+        fn();
+        double dSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - tStart).count();
+        dBest = std::max(dBest, nReads / 1e6 / dSeconds);
+    }
+
+    return dBest;
+}
+
+
+static void report(const char* szName, double dRef, double dNew)
+{
+    printf("%-20s %9.1f M/s  %9.1f M/s  %6.2fx\n", szName, dRef, dNew, dNew / dRef);
+}
+
+
+// The original named lookup
+static const char* refFieldValue(const CppSQLite3Table& t, const char* szField)
+{
+    for (int nField = 0; nField < t.numFields(); nField++)
+    {
+        if (strcmp(szField, t.fieldName(nField)) == 0)
+        {
+            return t.fieldValue(nField);
+        }
+    }
+
+    throw CppSQLite3Exception(CPPSQLITE_ERROR, "Invalid field name requested", false);
+}
+
+
+static int refIntField(const CppSQLite3Table& t, const char* szField)
+{
+    return refFieldValue(t, szField) == 0 ? 0 : atoi(refFieldValue(t, szField));
+}
+
+
+static double refDoubleField(const CppSQLite3Table& t, const char* szField)
+{
+    return refFieldValue(t, szField) == 0 ? 0.0 : atof(refFieldValue(t, szField));
+}
+
+
+static const char* refStringField(const CppSQLite3Table& t, const char* szField)
+{
+    return refFieldValue(t, szField) == 0 ? "" : refFieldValue(t, szField);
+}
+
+
+int main(int argc, char** argv)
+{
+    int nRows = argc > 1 ? atoi(argv[1]) : 100000;
+
+    CppSQLite3DB db;
+    db.open(":memory:");
+
+    std::string sCreate = "create table t(";
+    for (int nCol = 0; nCol < 13; nCol++)
+    {
+        sCreate += "filler_column_" + std::to_string(nCol) + " integer, ";
+    }
+    db.execDML((sCreate + "quantity integer, amount real, note text)").c_str());
+
+    db.execDML("begin");
+    CppSQLite3Statement stmt = db.compileStatement(
+        "insert into t(quantity, amount, note) values(?, ?, ?)");
+    for (int nRow = 0; nRow < nRows; nRow++)
+    {
+        stmt.bind(1, nRow);
+        stmt.bind(2, nRow * 0.25 + 0.1);
+        stmt.bind(3, "note");
+        stmt.execDML();
+        stmt.reset();
+    }
+    db.execDML("commit");
+
+    CppSQLite3Table t = db.getTable("select * from t");
+    volatile double dSink = 0;
+
+    printf("%-20s %14s  %14s\n", "", "original", "CppSQLite3");
+
+    report("int by name",
+        measure(nRows, [&] { for (int n = 0; n < nRows; n++) { t.setRow(n); dSink = refIntField(t, "quantity"); } }),
+        measure(nRows, [&] { for (int n = 0; n < nRows; n++) { t.setRow(n); dSink = t.getIntField("quantity"); } }));
+    report("double by name",
+        measure(nRows, [&] { for (int n = 0; n < nRows; n++) { t.setRow(n); dSink = refDoubleField(t, "amount"); } }),
+        measure(nRows, [&] { for (int n = 0; n < nRows; n++) { t.setRow(n); dSink = t.getDoubleField("amount"); } }));
+    report("string by name",
+        measure(nRows, [&] { for (int n = 0; n < nRows; n++) { t.setRow(n); dSink = *refStringField(t, "note"); } }),
+        measure(nRows, [&] { for (int n = 0; n < nRows; n++) { t.setRow(n); dSink = *t.getStringField("note"); } }));
+
+    // Every cell read four times, as a report might
+    long nReads = 4L * nRows;
+    auto refRepeat = [&]
+    {
+        for (int n = 0; n < nRows; n++)
+        {
+            t.setRow(n);
+            for (int k = 0; k < 4; k++)
+            {
+                dSink = refDoubleField(t, "amount");
+            }
+        }
+    };
+    auto newRepeat = [&]
+    {
+        for (int n = 0; n < nRows; n++)
+        {
+            t.setRow(n);
+            for (int k = 0; k < 4; k++)
+            {
+                dSink = t.getDoubleField("amount");
+            }
+        }
+    };
+
+    double dRefRepeat = measure(nReads, refRepeat);
+    report("double x4", dRefRepeat, measure(nReads, newRepeat));
+    t.setCacheNumbers(true);
+    report("double x4, cached", dRefRepeat, measure(nReads, newRepeat));
+
+    return 0;
+}